@@ -21,7 +21,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
-#include <libgen.h>
+#include <pthread.h>
 
 // Using 2.9.x FUSE API
 #define FUSE_USE_VERSION 29
@@ -30,7 +30,11 @@
 #include "a1fs.h"
 #include "fs_ctx.h"
 #include "options.h"
-#include "map.h"
+#include "journal.h"
+#include "dirty.h"
+#include "readahead.h"
+#include "session.h"
+#include "writeback.h"
 
 //NOTE: All path arguments are absolute paths within the a1fs file system and
 // start with a '/' that corresponds to the a1fs root directory.
@@ -52,39 +56,100 @@ a1fs_inode *get_ino(fs_ctx *fs, int ino_no) {
 	return &itable[ino_no];
 }
 
+/**
+* Fills in the attributes reported by getattr and readdir from the inode.
+*/
+void fill_stat(const a1fs_inode *inode, struct stat *st) {
+	memset(st, 0, sizeof(*st));
+	st->st_mode = inode->mode;
+	st->st_nlink = inode->links;
+	st->st_size = inode->size;
+	st->st_blocks = inode->used_blocks_count * A1FS_BLOCK_SIZE / 512;
+	st->st_mtim = inode->mtime;
+}
+
 a1fs_extent *get_exts_blk(fs_ctx *fs, a1fs_inode *ino) {
-	a1fs_extent *exts_blk = (a1fs_extent *)(fs->first_data_blk + A1FS_BLOCK_SIZE * ino->extents_blk);
+	a1fs_extent *exts_blk = fs_ctx_blk(fs, fs->sb->first_data_blk + ino->extents_blk, STORAGE_META);
 	return exts_blk;
 }
 
 void *get_db(fs_ctx *fs, int db_no) {
-	void *db = fs->first_data_blk + A1FS_BLOCK_SIZE * db_no;
+	void *db = fs_ctx_blk(fs, fs->sb->first_data_blk + db_no, 0);
 	return db;
 }
 
+a1fs_dentry *get_dentries_blk(fs_ctx *fs, int db_no) {
+	a1fs_dentry *dentries_blk = fs_ctx_blk(fs, fs->sb->first_data_blk + db_no, STORAGE_META);
+	return dentries_blk;
+}
 
-/* Bitmaps */
-int allocate_bit(unsigned char *bitmap, int count) {
-	int groupsOfBits = (count % 8 == 0)
-			? count / 8
-			: (count / 8) + 1;
-	int index = 0;
-
-	for (int i = 0; i < groupsOfBits; i++) {
-		for (int j = 0; j < 8; j++) {
-			unsigned char mask = 1 << (7 - j);
-			if (!(bitmap[i] & mask)) {
-				bitmap[i] = bitmap[i] | mask;		// switch bit from 0 to 1
-				return index;
-			}
-			index++;
-		}
+
+/** Record a metadata change for the journal and for fsync() of the inodes the callback works on. */
+void mark_meta_dirty(fs_ctx *fs, const void *ptr, size_t len) {
+	fs_ctx_dirty(fs, ptr, len);
+	journal_dirty(fs, ptr, len);
+	dirty_meta(fs, ptr, len);
+}
+
+
+/** Record that data blks of a file were changed, for fsync() and for background writeback. */
+void mark_data_blks_dirty(fs_ctx *fs, int ino_no, int db_no, int num_of_blks) {
+	a1fs_blk_t blk = fs->sb->first_data_blk + db_no;
+	dirty_data(fs, ino_no, blk, num_of_blks);
+	writeback_dirty(fs, blk, num_of_blks);
+}
+
+
+/** Record a file data change made through a pointer into one of its data blks. */
+void mark_data_dirty(fs_ctx *fs, int ino_no, const void *ptr, size_t len) {
+	a1fs_blk_t first, last;
+	fs_ctx_dirty(fs, ptr, len);
+	fs_ctx_blk_range(fs, ptr, len, &first, &last);
+	mark_data_blks_dirty(fs, ino_no, first - fs->sb->first_data_blk, last - first + 1);
+}
+
+
+/**
+* Finishes a callback that changed the file system.
+*	Metadata changes are attributed to ino1 and ino2 (-1 for none) for fsync().
+*/
+void end_op(fs_ctx *fs, int ino1, int ino2) {
+	dirty_end_op(fs, ino1, ino2);
+	journal_end_op(fs);
+}
+
+
+/**
+* Writes the free counts kept by the allocator to the superblock so that the
+*	image is up to date after fsync() or unmount.
+*/
+void fold_free_counts(fs_ctx *fs) {
+	if (alloc_fold(fs)) {
+		mark_meta_dirty(fs, fs->sb, sizeof(*fs->sb));
 	}
+}
+
+
+/**
+* Starts a change to the attributes, dentries or extents of an inode (-1 for
+*	none). Its sequence counter stays odd until ino_write_end(), so lock-free
+*	getattr readers that overlap the change retry.
+*/
+void ino_write_begin(fs_ctx *fs, int ino_no) {
+	if (!fs->ino_seq || ino_no < 0) { return; }
+	unsigned seq = __atomic_load_n(&fs->ino_seq[ino_no], __ATOMIC_RELAXED);
+	__atomic_store_n(&fs->ino_seq[ino_no], seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-	return -ENOSPC;
+void ino_write_end(fs_ctx *fs, int ino_no) {
+	if (!fs->ino_seq || ino_no < 0) { return; }
+	unsigned seq = __atomic_load_n(&fs->ino_seq[ino_no], __ATOMIC_RELAXED);
+	__atomic_store_n(&fs->ino_seq[ino_no], seq + 1, __ATOMIC_RELEASE);
 }
 
 
+/* Bitmaps */
 void allocate_bit_at_index(unsigned char *bitmap, int index) {
 	int groupOfBits = index / 8;
 	int bitInGroup = index % 8;
@@ -111,13 +176,29 @@ void deallocate_bit_at_index(unsigned char *bitmap, int index) {
 }
 
 
+void deallocate_contiguous_bits_at_index(unsigned char *bitmap, int index, int num_of_bits) {
+	// clear leading bits up to a group boundary, whole groups, then trailing bits
+	while (num_of_bits > 0 && index % 8 != 0) {
+		deallocate_bit_at_index(bitmap, index++);
+		num_of_bits--;
+	}
+	memset(&bitmap[index / 8], 0, num_of_bits / 8);
+	index += num_of_bits - num_of_bits % 8;
+	num_of_bits %= 8;
+	while (num_of_bits > 0) {
+		deallocate_bit_at_index(bitmap, index++);
+		num_of_bits--;
+	}
+}
+
+
 bool check_if_contiguous_dbs_are_free(fs_ctx *fs, int index, int num_of_blks) {
 	for (int i = index; i < index + num_of_blks; i++) {
 		int groupOfBits = i / 8;
 		int bitInGroup = i % 8;
 		unsigned char mask = 1 << (7 - bitInGroup);
 		unsigned char *d_bitmap = fs->data_bitmap;
-		if (d_bitmap[groupOfBits] & mask) {
+		if ((d_bitmap[groupOfBits] & mask) || journal_pinned(fs, fs->sb->first_data_blk + i)) {
 			return false;
 		}
 	}
@@ -129,7 +210,7 @@ int find_contiguous_dbs_start_from_index(fs_ctx *fs, int startingIndex, int num_
 	a1fs_superblock *sb = fs->sb;
 	unsigned char *d_bitmap = fs->data_bitmap;
 
-	if ((int)sb->free_data_blocks_count < num_of_blks) {
+	if ((int)alloc_free_blks(fs) < num_of_blks) {
 		return -ENOSPC;
 	}
 
@@ -183,16 +264,11 @@ int find_contiguous_dbs_start_from_index(fs_ctx *fs, int startingIndex, int num_
 
 /* Inode */
 int allocate_ino(fs_ctx *fs, mode_t mode, uint32_t links) {
-	a1fs_superblock *sb = fs->sb;
-
-	if ((int)sb->free_inodes_count < 1) {
-		return -ENOSPC;
-	}
-
-	int new_ino_no = allocate_bit(fs->inode_bitmap, sb->inodes_count);
+	int new_ino_no = alloc_pop_ino(fs);
 	if (new_ino_no < 0) {
 		return new_ino_no;
 	} else {
+		allocate_bit_at_index(fs->inode_bitmap, new_ino_no);
 		a1fs_inode *new_ino = get_ino(fs, new_ino_no);
 
 		new_ino->mode = mode;
@@ -203,8 +279,12 @@ int allocate_ino(fs_ctx *fs, mode_t mode, uint32_t links) {
 		new_ino->used_blocks_count = 0;
 		new_ino->extents_blk = -1;		// no extents block for empty file or dir
 		new_ino->extents_count = 0;
+		new_ino->next_orphan = 0;
+
+		alloc_count(fs, -1, 0);
 
-		sb->free_inodes_count -= 1;
+		mark_meta_dirty(fs, &fs->inode_bitmap[new_ino_no / 8], 1);
+		mark_meta_dirty(fs, new_ino, sizeof(*new_ino));
 
 		return new_ino_no;
 	}
@@ -213,7 +293,9 @@ int allocate_ino(fs_ctx *fs, mode_t mode, uint32_t links) {
 
 void deallocate_ino_at_index(fs_ctx *fs, int index) {
 	deallocate_bit_at_index(fs->inode_bitmap, index);
-	fs->sb->free_inodes_count += 1;
+	alloc_count(fs, 1, 0);
+	alloc_push_ino(fs, index);
+	mark_meta_dirty(fs, &fs->inode_bitmap[index / 8], 1);
 }
 
 
@@ -222,10 +304,10 @@ void deallocate_ino_at_index(fs_ctx *fs, int index) {
 void initialize_dbs_at_index_for_ino(fs_ctx *fs, a1fs_inode *ino, int db_no, int num_of_blks) {
 	allocate_contiguous_bits_at_index(fs->data_bitmap, db_no, num_of_blks);
 	ino->used_blocks_count += num_of_blks;
-	fs->sb->free_data_blocks_count -= num_of_blks;
-	for (int i = 0; i < num_of_blks; i++) {
-		memset(get_db(fs, db_no + i), 0, A1FS_BLOCK_SIZE);
-	}
+	alloc_count(fs, 0, -num_of_blks);
+	fs_ctx_zero(fs, fs->sb->first_data_blk + db_no, num_of_blks);
+	mark_meta_dirty(fs, &fs->data_bitmap[db_no / 8], (db_no + num_of_blks - 1) / 8 - db_no / 8 + 1);
+	mark_meta_dirty(fs, ino, sizeof(*ino));
 }
 
 
@@ -257,59 +339,133 @@ int get_size_in_last_blk(a1fs_inode *ino) {
 void deallocate_db_for_ino(fs_ctx *fs, a1fs_inode *ino, int db_no) {
 	deallocate_bit_at_index(fs->data_bitmap, db_no);
 	ino->used_blocks_count -= 1;
-	fs->sb->free_data_blocks_count += 1;
+	alloc_count(fs, 0, 1);
+	mark_meta_dirty(fs, &fs->data_bitmap[db_no / 8], 1);
+	mark_meta_dirty(fs, ino, sizeof(*ino));
+	journal_revoke(fs, fs->sb->first_data_blk + db_no, 1);
 }
 
 
-void *get_ptr_to_end_of_file(fs_ctx *fs, a1fs_inode *file_ino) {
-	void *ptr_to_file_last_data_blk = get_db(fs, get_last_data_blk_no(fs, file_ino));
-	return  ptr_to_file_last_data_blk + (file_ino->size % A1FS_BLOCK_SIZE);
+/**
+* Returns the db number of the blk at index blk_index within the file.
+*	Returns -1 if the file doesn't have that many blks.
+*/
+int get_file_db_no(fs_ctx *fs, a1fs_inode *file_ino, int blk_index) {
+	if (file_ino->extents_blk == -1) { return -1; }
+	a1fs_extent *exts_blk = get_exts_blk(fs, file_ino);
+	for (int i = 0; i < (int)file_ino->extents_count; i++) {
+		if (blk_index < (int)exts_blk[i].count) {
+			return exts_blk[i].start + blk_index;
+		}
+		blk_index -= exts_blk[i].count;
+	}
+	return -1;
 }
 
 
-void traverse_exts_to_get_byte_ptr(fs_ctx *fs, a1fs_inode *parent_ino, int num_of_blks, int byte_index, void **result) {
-	a1fs_extent *exts_blk = get_exts_blk(fs, parent_ino);
-	int blks_counter = 0;
-	for (int i = 0; i < (int)parent_ino->extents_count; i++) {
-		a1fs_extent ext = exts_blk[i];
-		for (int j = 0; j < (int)ext.count; j++) {
-			blks_counter++;
-			if (blks_counter == num_of_blks) {
-				void *db = get_db(fs, ext.start + j);
-				*result = (byte_index % A1FS_BLOCK_SIZE == 0) 		// e.g. when byte_index == 4096
-				 		? db + A1FS_BLOCK_SIZE			// return pointer to file's first db + 4096
-						: db + byte_index;
-			}
+/**
+* Copies size bytes between buf and the file starting at byte offset, one db at a time.
+*	The byte range must be within the file.
+*/
+void copy_file_bytes(fs_ctx *fs, a1fs_inode *file_ino, void *buf, size_t size, off_t offset, bool to_file) {
+	while (size > 0) {
+		int offset_in_blk = offset % A1FS_BLOCK_SIZE;
+		size_t bytes = A1FS_BLOCK_SIZE - offset_in_blk;
+		if (bytes > size) { bytes = size; }
+
+		void *ptr = get_db(fs, get_file_db_no(fs, file_ino, offset / A1FS_BLOCK_SIZE)) + offset_in_blk;
+		if (to_file) {
+			fs_ctx_copy(fs, ptr, buf, bytes);
+			mark_data_dirty(fs, file_ino->index, ptr, bytes);
+		} else {
+			memcpy(buf, ptr, bytes);
 		}
+		buf += bytes;
+		offset += bytes;
+		size -= bytes;
 	}
 }
 
-void *get_ptr_to_byte_in_file(fs_ctx *fs, a1fs_inode *file_ino, int byte_index){
-	if (byte_index == 0) {
-		a1fs_extent *exts_blk = get_exts_blk(fs, file_ino);
-		a1fs_extent first_ext = exts_blk[0];
-		return get_db(fs, first_ext.start);
+
+
+/**
+* Calls fn once with the runs of image blks backing blks first to last (indices
+*	within the file), one run per extent, so that the backend reads them all in
+*	one batch. The blks must be within the file.
+*/
+void for_each_file_run(fs_ctx *fs, a1fs_inode *file_ino, int first, int last,
+		void (*fn)(fs_ctx *fs, const storage_run *runs, size_t n)) {
+	if (first > last || file_ino->extents_blk == -1) { return; }
+	a1fs_extent *exts_blk = get_exts_blk(fs, file_ino);
+	storage_run runs[A1FS_EXTS_MAX];
+	size_t n = 0;
+	int ext_first = 0;
+	for (int i = 0; i < (int)file_ino->extents_count && ext_first <= last; i++) {
+		int ext_last = ext_first + exts_blk[i].count - 1;
+		if (ext_last >= first) {
+			int from = first > ext_first ? first : ext_first;
+			int to = last < ext_last ? last : ext_last;
+			runs[n].blk = fs->sb->first_data_blk + exts_blk[i].start + (from - ext_first);
+			runs[n].count = to - from + 1;
+			n++;
+		}
+		ext_first = ext_last + 1;
 	}
-	// db_number_in_file is the number of data blks belong to file that we need to scan to find the byte at index {byte_index}
-	int db_number_in_file = byte_index / A1FS_BLOCK_SIZE + ((byte_index % A1FS_BLOCK_SIZE) != 0);
-	void *result;
-	traverse_exts_to_get_byte_ptr(fs, file_ino, db_number_in_file, byte_index, &result);
-	return result;
+	fn(fs, runs, n);
 }
 
+/**
+* Asks the storage backend to load the dbs backing size bytes at byte offset
+*	in one batch, so that a following copy_file_bytes doesn't fault them in one
+*	block at a time. The byte range must be within the file.
+*/
+void prefetch_file_bytes(fs_ctx *fs, a1fs_inode *file_ino, size_t size, off_t offset) {
+	if (size == 0) { return; }
+	for_each_file_run(fs, file_ino, offset / A1FS_BLOCK_SIZE,
+			(offset + size - 1) / A1FS_BLOCK_SIZE, fs_ctx_prefetch);
+}
+
+/**
+* Updates the readahead state of the open file for a read of size bytes at byte
+*	offset, and starts reading the blks ahead of a sequential stream.
+*/
+void readahead_file(fs_ctx *fs, a1fs_inode *file_ino, readahead *ra, size_t size, off_t offset) {
+	if (size == 0) { return; }
+	size_t file_blks = (file_ino->size + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+	size_t start;
+	size_t count = readahead_next(ra, offset / A1FS_BLOCK_SIZE,
+			(offset + size - 1) / A1FS_BLOCK_SIZE, file_blks, &start);
+	// start is only set if there is something to read ahead
+	if (count == 0) { return; }
+	for_each_file_run(fs, file_ino, start, (int)(start + count) - 1, fs_ctx_readahead);
+}
+
+/**
+* Applies an madvise() hint to all dbs of the file, one run per extent.
+*/
+void advise_file(fs_ctx *fs, a1fs_inode *file_ino, int advice) {
+	if (file_ino->extents_blk == -1) { return; }
+	a1fs_extent *exts_blk = get_exts_blk(fs, file_ino);
+	for (int i = 0; i < (int)file_ino->extents_count; i++) {
+		fs_ctx_advise(fs, fs->sb->first_data_blk + exts_blk[i].start, exts_blk[i].count, advice);
+	}
+}
 
 
 /* Extent */
 int initialize_ext_blk_for_ino(fs_ctx *fs, a1fs_inode *ino) {
-	a1fs_superblock *sb = fs->sb;
-
-	if ((int)sb->free_data_blocks_count < 1) {
+	int db_no = alloc_pop_blk(fs);
+	if (db_no < 0) {
 		return -ENOSPC;
 	}
-	ino->extents_blk = allocate_bit(fs->data_bitmap, sb->data_blocks_count);
+	allocate_bit_at_index(fs->data_bitmap, db_no);
+	ino->extents_blk = db_no;
 	ino->used_blocks_count += 1;
-	sb->free_data_blocks_count -= 1;
+	alloc_count(fs, 0, -1);
 	memset(get_exts_blk(fs, ino), 0, A1FS_BLOCK_SIZE);
+	mark_meta_dirty(fs, &fs->data_bitmap[ino->extents_blk / 8], 1);
+	mark_meta_dirty(fs, ino, sizeof(*ino));
+	mark_meta_dirty(fs, get_exts_blk(fs, ino), A1FS_BLOCK_SIZE);
 	return 0;
 }
 
@@ -321,6 +477,8 @@ void add_to_ext_blk_for_ino(fs_ctx *fs, a1fs_inode *ino, int data_blk_no, int nu
 	new_ext->count = num_of_blks;
 
 	ino->extents_count += 1;
+	mark_meta_dirty(fs, new_ext, sizeof(*new_ext));
+	mark_meta_dirty(fs, ino, sizeof(*ino));
 }
 
 
@@ -332,6 +490,8 @@ void shrink_ext_for_ino(fs_ctx *fs, a1fs_inode *ino) {
 	} else {
 		last_ext->count -= 1;
 	}
+	mark_meta_dirty(fs, last_ext, sizeof(*last_ext));
+	mark_meta_dirty(fs, ino, sizeof(*ino));
 	if (ino->extents_count == 0) {
 		deallocate_db_for_ino(fs, ino, ino->extents_blk);
 		ino->extents_blk = -1;
@@ -341,24 +501,86 @@ void shrink_ext_for_ino(fs_ctx *fs, a1fs_inode *ino) {
 
 
 /* Directory Entry */
-void add_to_dentries_blk_for_ino(fs_ctx *fs, a1fs_inode *parent_ino, int dentries_blk_no, int dentry_ino_no, char *dentry_name) {
-	a1fs_dentry *dentries_blk = (a1fs_dentry *) get_db(fs, dentries_blk_no);
+void add_to_dentries_blk_for_ino(fs_ctx *fs, a1fs_inode *parent_ino, int dentries_blk_no, int dentry_ino_no,
+		const char *dentry_name, size_t name_len) {
+	a1fs_dentry *dentries_blk = get_dentries_blk(fs, dentries_blk_no);
 
-	a1fs_dentry *new_entry = &dentries_blk[parent_ino->size / sizeof(a1fs_dentry)];
+	a1fs_dentry *new_entry = &dentries_blk[(parent_ino->size / sizeof(a1fs_dentry)) % A1FS_EXT_DENTRIES_MAX];
 	new_entry->ino = dentry_ino_no;
-	strncpy(new_entry->name, dentry_name, A1FS_NAME_MAX);
+	memcpy(new_entry->name, dentry_name, name_len);
+	memset(new_entry->name + name_len, 0, A1FS_NAME_MAX - name_len);
 
 	parent_ino->size += sizeof(a1fs_dentry);
+	mark_meta_dirty(fs, new_entry, sizeof(*new_entry));
+	mark_meta_dirty(fs, parent_ino, sizeof(*parent_ino));
 }
 
 
 a1fs_dentry *get_last_dentry_for_ino(fs_ctx *fs, a1fs_inode *parent_ino) {
-	a1fs_dentry *last_entries_blk = (a1fs_dentry *) get_db(fs, get_last_data_blk_no(fs, parent_ino));
+	a1fs_dentry *last_entries_blk = get_dentries_blk(fs, get_last_data_blk_no(fs, parent_ino));
 	int num_of_entries_in_last_blk = get_size_in_last_blk(parent_ino) / sizeof(a1fs_dentry);
 	return &last_entries_blk[num_of_entries_in_last_blk - 1];
 }
 
 
+/**
+* Returns the dentry at index pos among all dentries of the dir.
+*/
+a1fs_dentry *get_dentry_at(fs_ctx *fs, a1fs_inode *parent_ino, int pos) {
+	int db_no = get_file_db_no(fs, parent_ino, pos / A1FS_EXT_DENTRIES_MAX);
+	return &get_dentries_blk(fs, db_no)[pos % A1FS_EXT_DENTRIES_MAX];
+}
+
+
+/**
+* Removes the last dentry of the dir, freeing the last db if it becomes empty.
+*/
+void drop_last_dentry(fs_ctx *fs, a1fs_inode *parent_ino) {
+	parent_ino->size -= sizeof(a1fs_dentry);
+	mark_meta_dirty(fs, parent_ino, sizeof(*parent_ino));
+	if (parent_ino->size % A1FS_BLOCK_SIZE == 0) {
+		deallocate_db_for_ino(fs, parent_ino, get_last_data_blk_no(fs, parent_ino));
+		shrink_ext_for_ino(fs, parent_ino);
+	}
+}
+
+
+/**
+* Returns the open dir state of the dir, or NULL if it has no open handles.
+*/
+open_dir *find_open_dir(fs_ctx *fs, int dir_ino_no) {
+	for (open_dir *od = fs->open_dirs; od; od = od->next) {
+		if ((int)od->ino == dir_ino_no) { return od; }
+	}
+	return NULL;
+}
+
+
+/**
+* Fills the tombstones left in the dir while it was open by moving the last
+*	dentries into them, and frees the dbs emptied at the end.
+*/
+void compact_dentries(fs_ctx *fs, a1fs_inode *parent_ino) {
+	int dentries_total = parent_ino->size / sizeof(a1fs_dentry);
+	for (int pos = 0; pos < dentries_total; pos++) {
+		a1fs_dentry *entry = get_dentry_at(fs, parent_ino, pos);
+		if (entry->name[0] != '\0') { continue; }
+
+		// Tombstones at the end are simply dropped, possibly including this one
+		while (dentries_total > pos && get_dentry_at(fs, parent_ino, dentries_total - 1)->name[0] == '\0') {
+			drop_last_dentry(fs, parent_ino);
+			dentries_total--;
+		}
+		if (dentries_total == pos) { break; }
+
+		*entry = *get_dentry_at(fs, parent_ino, dentries_total - 1);
+		mark_meta_dirty(fs, entry, sizeof(*entry));
+		drop_last_dentry(fs, parent_ino);
+		dentries_total--;
+	}
+}
+
+
 
 
 /* File */
@@ -392,6 +614,7 @@ int extend_file(fs_ctx *fs, a1fs_inode *file_ino, int additional_bytes) {
 				}
 
 				initialize_dbs_at_index_for_ino(fs, file_ino, new_db_no, num_of_blks_to_allocate);	// 4.1. Allocate new dbs
+				mark_data_blks_dirty(fs, file_ino->index, new_db_no, num_of_blks_to_allocate);
 				add_bytes = (num_of_blks_to_allocate * A1FS_BLOCK_SIZE >= additional_bytes)
 							? additional_bytes
 							: num_of_blks_to_allocate * A1FS_BLOCK_SIZE;
@@ -410,6 +633,7 @@ int extend_file(fs_ctx *fs, a1fs_inode *file_ino, int additional_bytes) {
 
 	// 5. Update metadata p.s. some metadata has been updated by helper functions
 	clock_gettime(CLOCK_REALTIME, &(file_ino->mtime));
+	mark_meta_dirty(fs, file_ino, sizeof(*file_ino));
 
 	return 0;
 }
@@ -431,25 +655,90 @@ int shrink_file(fs_ctx *fs, a1fs_inode *file_ino, int unwanted_bytes) {
 			shrink_ext_for_ino(fs, file_ino);
 		}
 	}
+	// Bytes past EOF in the last db must be zero in case the file grows again
+	if (file_ino->size % A1FS_BLOCK_SIZE != 0) {
+		int offset_in_blk = file_ino->size % A1FS_BLOCK_SIZE;
+		void *tail = get_db(fs, get_file_db_no(fs, file_ino, file_ino->size / A1FS_BLOCK_SIZE)) + offset_in_blk;
+		memset(tail, 0, A1FS_BLOCK_SIZE - offset_in_blk);
+		mark_data_dirty(fs, file_ino->index, tail, A1FS_BLOCK_SIZE - offset_in_blk);
+	}
 	clock_gettime(CLOCK_REALTIME, &(file_ino->mtime));
+	mark_meta_dirty(fs, file_ino, sizeof(*file_ino));
 	return 0;
 }
 
 
 
 /* Directory Entries Traversal */
-int traverse_exts_to_fill_name(fs_ctx *fs, a1fs_inode *parent_ino, void *buf, fuse_fill_dir_t filler) {
+/** Files up to this many dbs have their ext blk prefetched by readdir. */
+#define READDIR_SMALL_FILE_BLKS 16
+
+/**
+* Starts loading the inode table blks of the entries of a dentry blk, and the
+*	ext blks of the small files among them, so that the getattr and open calls
+*	that usually follow a readdir find them in memory.
+*/
+void prefetch_dentries_inodes(fs_ctx *fs, a1fs_dentry *entries_blk, int count) {
+	const int inodes_per_blk = A1FS_BLOCK_SIZE / sizeof(a1fs_inode);
+	storage_run runs[A1FS_EXT_DENTRIES_MAX] = {{0, 0}};
+	size_t n = 0;
+
+	// Tombstones may name inodes that were freed or reused since
+	for (int k = 0; k < count; k++) {
+		if (entries_blk[k].name[0] == '\0') { continue; }
+		a1fs_blk_t itable_blk = fs->sb->inode_table_blk + entries_blk[k].ino / inodes_per_blk;
+		storage_run *last = (n > 0) ? &runs[n - 1] : NULL;
+		if (last && itable_blk >= last->blk && itable_blk <= last->blk + last->count) {
+			if (itable_blk == last->blk + last->count) {
+				last->count++;
+			}
+		} else {
+			runs[n].blk = itable_blk;
+			runs[n].count = 1;
+			n++;
+		}
+	}
+	fs_ctx_readahead(fs, runs, n);
+
+	// Reading the inodes waits for their blks, which are all in flight by now
+	n = 0;
+	for (int k = 0; k < count; k++) {
+		if (entries_blk[k].name[0] == '\0') { continue; }
+		a1fs_inode *ino = get_ino(fs, entries_blk[k].ino);
+		if (S_ISREG(ino->mode) && ino->extents_blk != -1 &&
+				ino->size <= READDIR_SMALL_FILE_BLKS * A1FS_BLOCK_SIZE) {
+			runs[n].blk = fs->sb->first_data_blk + ino->extents_blk;
+			runs[n].count = 1;
+			n++;
+		}
+	}
+	fs_ctx_readahead(fs, runs, n);
+}
+
+/**
+* readdir offset at which a listing resumes with the dentry in slot of the dir's
+*	blk_index-th db. Offsets 0 and 1 are "." and ".."; slot may be
+*	A1FS_EXT_DENTRIES_MAX, meaning the first slot of the next db.
+*/
+#define DENTRY_OFF(blk_index, slot) ((off_t)(blk_index) * A1FS_EXT_DENTRIES_MAX + (slot) + 2)
+
+/**
+* Passes the dentries of the dir to filler starting at index first, each with
+*	the offset of the next one, until filler reports that its buffer is full.
+*	Tombstones are skipped; *tombstones is set if any were seen.
+*/
+int traverse_exts_to_fill_name(fs_ctx *fs, a1fs_inode *parent_ino, void *buf, fuse_fill_dir_t filler,
+		int first, bool *tombstones) {
 	if (parent_ino->extents_blk == -1) { return 0; }	// do nothing when no ext blk has been allocated for this dir
 
 	int dentries_total = parent_ino->size / sizeof(a1fs_dentry);
 	a1fs_extent *exts_blk = get_exts_blk(fs, parent_ino);
+	int blk_index = 0;
 
   for (int i = 0; i < (int)parent_ino->extents_count; i++) {
     a1fs_extent ext = exts_blk[i];
 
-		for (int j = 0; j < (int)ext.count; j++) {
-			struct a1fs_dentry *entries_blk = (struct a1fs_dentry *) get_db(fs, ext.start + j);
-
+		for (int j = 0; j < (int)ext.count; j++, blk_index++) {
 			int dentries_in_this_blk;
 			if (dentries_total > A1FS_EXT_DENTRIES_MAX) {
 				dentries_in_this_blk = A1FS_EXT_DENTRIES_MAX;
@@ -457,10 +746,17 @@ int traverse_exts_to_fill_name(fs_ctx *fs, a1fs_inode *parent_ino, void *buf, fu
 			} else {
 				dentries_in_this_blk = dentries_total;
 			}
+			if (blk_index < first / A1FS_EXT_DENTRIES_MAX) { continue; }	// listed by an earlier call
 
-			for (int k = 0; k < dentries_in_this_blk; k++) {
+			struct a1fs_dentry *entries_blk = get_dentries_blk(fs, ext.start + j);
+			int k = (blk_index == first / A1FS_EXT_DENTRIES_MAX) ? first % A1FS_EXT_DENTRIES_MAX : 0;
+			prefetch_dentries_inodes(fs, entries_blk + k, dentries_in_this_blk - k);
+			for (; k < dentries_in_this_blk; k++) {
 				struct a1fs_dentry entry = entries_blk[k];
-				if (filler(buf, entry.name, NULL, 0) != 0) { return -ENOMEM; }
+				if (entry.name[0] == '\0') { *tombstones = true; continue; }
+				struct stat st;
+				fill_stat(get_ino(fs, entry.ino), &st);
+				if (filler(buf, entry.name, &st, DENTRY_OFF(blk_index, k + 1)) != 0) { return 0; }
 			}
 		}
   }
@@ -469,8 +765,12 @@ int traverse_exts_to_fill_name(fs_ctx *fs, a1fs_inode *parent_ino, void *buf, fu
 }
 
 
-int traverse_exts_to_replace_dentry(fs_ctx *fs, a1fs_inode *parent_ino, char *dentry_name) {
-	if (parent_ino->size == 0) { return 0; }
+/**
+* Returns the dentry named by the len bytes at name in the dir, or NULL if there
+*	is none. name doesn't have to be null-terminated.
+*/
+a1fs_dentry *find_dentry(fs_ctx *fs, a1fs_inode *parent_ino, const char *name, size_t len) {
+	if (parent_ino->extents_blk == -1) { return NULL; }
 	int dentries_total = parent_ino->size / sizeof(a1fs_dentry);
 	a1fs_extent *exts_blk = get_exts_blk(fs, parent_ino);
 
@@ -478,29 +778,52 @@ int traverse_exts_to_replace_dentry(fs_ctx *fs, a1fs_inode *parent_ino, char *de
     a1fs_extent ext = exts_blk[i];
 
 		for (int j = 0; j < (int)ext.count; j++) {
-			struct a1fs_dentry *entries_blk = (struct a1fs_dentry *) get_db(fs, ext.start + j);
-
-			int dentries_in_this_blk;
-			if (dentries_total > A1FS_EXT_DENTRIES_MAX) {
-				dentries_in_this_blk = A1FS_EXT_DENTRIES_MAX;
-				dentries_total -= A1FS_EXT_DENTRIES_MAX;
-			} else {
-				dentries_in_this_blk = dentries_total;
-			}
+			a1fs_dentry *entries_blk = get_dentries_blk(fs, ext.start + j);
+			int dentries_in_this_blk = (dentries_total > A1FS_EXT_DENTRIES_MAX) ? A1FS_EXT_DENTRIES_MAX : dentries_total;
+			dentries_total -= dentries_in_this_blk;
 
 			for (int k = 0; k < dentries_in_this_blk; k++) {
-				struct a1fs_dentry *entry = &entries_blk[k];
-				if (strcmp(entry->name, dentry_name) == 0) {
-					 a1fs_dentry *last_entry = get_last_dentry_for_ino(fs, parent_ino);
-					 entry->ino = last_entry->ino;
-					 strncpy(entry->name, last_entry->name, A1FS_NAME_MAX);
-					 break;
-				}
+				a1fs_dentry *entry = &entries_blk[k];
+				if (entry->name[len] == '\0' && memcmp(entry->name, name, len) == 0) { return entry; }
 			}
 		}
   }
-	parent_ino->size -= sizeof(a1fs_dentry);
-	return 0;
+	return NULL;
+}
+
+
+/**
+* Removes the dentry from the dir. While the dir has open handles the dentry is
+*	left as a tombstone so that the other dentries keep their readdir offsets;
+*	otherwise the last dentry takes its place.
+*/
+void remove_dentry(fs_ctx *fs, a1fs_inode *parent_ino, int parent_ino_no, a1fs_dentry *entry) {
+	open_dir *od = find_open_dir(fs, parent_ino_no);
+	if (od) {
+		entry->name[0] = '\0';
+		mark_meta_dirty(fs, entry, sizeof(*entry));
+		od->has_tombstones = true;
+		return;
+	}
+
+	a1fs_dentry *last_entry = get_last_dentry_for_ino(fs, parent_ino);
+	if (entry != last_entry) {
+		*entry = *last_entry;
+		mark_meta_dirty(fs, entry, sizeof(*entry));
+	}
+	drop_last_dentry(fs, parent_ino);	// frees the last db if it is emptied
+}
+
+
+/**
+* Returns whether the dir has no dentries other than tombstones.
+*/
+bool dir_is_empty(fs_ctx *fs, a1fs_inode *dir_ino) {
+	int dentries_total = dir_ino->size / sizeof(a1fs_dentry);
+	for (int pos = 0; pos < dentries_total; pos++) {
+		if (get_dentry_at(fs, dir_ino, pos)->name[0] != '\0') { return false; }
+	}
+	return true;
 }
 
 
@@ -521,73 +844,263 @@ int traverse_exts_to_deallocate_dbs(fs_ctx *fs, a1fs_inode *parent_ino) {
 
 
 
+/* Orphan */
+/** Maximum number of data blks freed by an orphan step while holding the fs lock. */
+#define ORPHAN_BATCH_BLKS 256
 
-int get_dentry_ino_no(fs_ctx *fs, a1fs_inode *parent_ino, char *dentry_name) {
-	if (parent_ino->extents_blk == -1) {
-		return -ENOENT;
+/**
+* Frees up to ORPHAN_BATCH_BLKS data blks of the first orphan, starting from its last extent.
+*	The orphan's inode and ext blk are freed once all of its extents are gone.
+*	Returns true if the orphan list is not empty afterwards.
+*/
+bool free_orphan_step(fs_ctx *fs) {
+	a1fs_superblock *sb = fs->sb;
+	if (sb->orphan_head == 0) { return false; }
+
+	int ino_no = sb->orphan_head;
+	a1fs_inode *ino = get_ino(fs, ino_no);
+	int budget = ORPHAN_BATCH_BLKS;
+
+	while (budget > 0 && ino->extents_count > 0) {
+		a1fs_extent *last_ext = &get_exts_blk(fs, ino)[ino->extents_count - 1];
+		int num_of_blks = ((int)last_ext->count > budget) ? budget : (int)last_ext->count;
+		last_ext->count -= num_of_blks;
+		int first_db_no = last_ext->start + last_ext->count;
+		deallocate_contiguous_bits_at_index(fs->data_bitmap, first_db_no, num_of_blks);
+		ino->used_blocks_count -= num_of_blks;
+		alloc_count(fs, 0, num_of_blks);
+		if (last_ext->count == 0) {
+			ino->extents_count -= 1;
+		}
+		budget -= num_of_blks;
+		mark_meta_dirty(fs, &fs->data_bitmap[first_db_no / 8], (first_db_no + num_of_blks - 1) / 8 - first_db_no / 8 + 1);
+		mark_meta_dirty(fs, last_ext, sizeof(*last_ext));
+		journal_revoke(fs, sb->first_data_blk + first_db_no, num_of_blks);
 	}
-	if (!S_ISDIR(parent_ino->mode)) {
-		return -ENOTDIR;
+	mark_meta_dirty(fs, ino, sizeof(*ino));
+	mark_meta_dirty(fs, sb, sizeof(*sb));
+
+	if (ino->extents_count == 0) {
+		if (ino->extents_blk != -1) {
+			deallocate_db_for_ino(fs, ino, ino->extents_blk);
+			ino->extents_blk = -1;
+		}
+		sb->orphan_head = ino->next_orphan;
+		ino->next_orphan = 0;
+		deallocate_ino_at_index(fs, ino_no);
 	}
+	return sb->orphan_head != 0;
+}
 
-	int dentries_total = parent_ino->size / sizeof(a1fs_dentry);;
-	a1fs_extent *exts_blk = get_exts_blk(fs, parent_ino);
 
-  for (int i = 0; i < (int)parent_ino->extents_count; i++) {	// Traverse all extents
-		a1fs_extent ext = exts_blk[i];
+/** Orphan steps done by one run of free_orphans_task() before it queues itself again. */
+#define ORPHAN_TASK_STEPS 16
 
-		for (int j = 0; j < (int)ext.count; j++) {	// Traverse all data blks in one extent
-			a1fs_dentry *entries_blk = (a1fs_dentry *) get_db(fs, ext.start + j);
+/**
+* Background task: frees orphaned inodes in small batches, letting FUSE requests
+*	in between batches. Queues itself again if orphans are left, so that other
+*	tasks get a turn on the worker.
+*/
+void free_orphans_task(fs_ctx *fs, void *arg) {
+	(void)arg;// unused
+	fs_ctx_lock(fs);
+	for (int i = 0; i < ORPHAN_TASK_STEPS && fs->sb->orphan_head != 0 && !fs->stopping; i++) {
+		free_orphan_step(fs);
+		end_op(fs, -1, -1);
+		// let pending FUSE requests in between batches
+		fs_ctx_unlock(fs);
+		iosched_bg_wait(fs, 1);
+		fs_ctx_lock(fs);
+	}
+	fs->orphans_queued = fs->sb->orphan_head != 0 && !fs->stopping &&
+	                     taskpool_submit(fs, TASK_LOW, free_orphans_task, NULL);
+	fs_ctx_unlock(fs);
+}
 
-			int dentries_in_this_blk;
-			if (dentries_total > A1FS_EXT_DENTRIES_MAX) {
-				dentries_in_this_blk = A1FS_EXT_DENTRIES_MAX;
-				dentries_total -= A1FS_EXT_DENTRIES_MAX;
-			} else {
-				dentries_in_this_blk = dentries_total;
-			}
 
-			for (int k = 0; k < dentries_in_this_blk; k++) {	// Traverse all entries in one data blk
-				a1fs_dentry entry = entries_blk[k];
-				if (strcmp(entry.name, dentry_name) == 0) {
-		      return entry.ino;
-		    }
-			}
-		}
-  }
+/**
+* Queues free_orphans_task() if there are orphans and it isn't queued yet. If
+*	the pool is full, the next unlink or mount tries again.
+*/
+void queue_orphans(fs_ctx *fs) {
+	if (fs->orphans_queued || fs->sb->orphan_head == 0) { return; }
+	fs->orphans_queued = taskpool_submit(fs, TASK_LOW, free_orphans_task, NULL);
+}
 
-  return -ENOENT;
+
+/**
+* Puts an unlinked inode on the persistent orphan list so its blks can be freed
+*	later by a background task instead of on the FUSE thread.
+*/
+void add_orphan(fs_ctx *fs, a1fs_inode *ino, int ino_no) {
+	dirty_forget(fs, ino_no);
+	ino->links = 0;
+	ino->next_orphan = fs->sb->orphan_head;
+	fs->sb->orphan_head = ino_no;
+	mark_meta_dirty(fs, ino, sizeof(*ino));
+	mark_meta_dirty(fs, fs->sb, sizeof(*fs->sb));
+	queue_orphans(fs);
 }
 
 
 
 /* Path */
+/** Result of resolving a path with resolve_path(). */
+typedef struct path_info {
+	/** Inode number of the dir containing the last component. */
+	int parent_ino_no;
+	/** Inode number of the last component, or -errno if it doesn't exist. */
+	int ino_no;
+	/** Last component; points into the path and is not null-terminated. */
+	const char *name;
+	size_t name_len;
+	/** Slot of the last component in its parent dir; NULL if it doesn't exist. */
+	a1fs_dentry *dentry;
+} path_info;
+
+/**
+* Resolves the path in one pass over it, without copying it: each component is
+*	a (pointer, length) token looked up in the dir named by the previous one.
+*	For "/" the parent is the root dir itself and the name is empty.
+*	Returns the inode number of the path (also in pi->ino_no) or -errno; when
+*	only the last component is missing, pi still describes its parent.
+*/
+int resolve_path(fs_ctx *fs, const char *path, path_info *pi) {
+	pi->parent_ino_no = 0;
+	pi->ino_no = 0;
+	pi->name = path;
+	pi->name_len = 0;
+	pi->dentry = NULL;
+
+	const char *p = path;
+	while (*p != '\0') {
+		if (*p == '/') { p++; continue; }
+		const char *name = p;
+		while (*p != '\0' && *p != '/') { p++; }
+		size_t len = p - name;
+
+		if (pi->ino_no < 0) { return pi->ino_no; }	// a component before the last is missing
+		a1fs_inode *parent_ino = get_ino(fs, pi->ino_no);
+		pi->parent_ino_no = pi->ino_no;
+		pi->name = name;
+		pi->name_len = len;
+		if (!S_ISDIR(parent_ino->mode)) {
+			pi->dentry = NULL;
+			pi->ino_no = -ENOTDIR;
+		} else if (len >= A1FS_NAME_MAX) {
+			pi->dentry = NULL;
+			pi->ino_no = -ENAMETOOLONG;
+		} else {
+			pi->dentry = find_dentry(fs, parent_ino, name, len);
+			pi->ino_no = pi->dentry ? (int)pi->dentry->ino : -ENOENT;
+		}
+	}
+	return pi->ino_no;
+}
+
 int path_lookup(fs_ctx *fs, const char *path, bool look_for_parent) {
-    char buffer[A1FS_PATH_MAX];
-    char *copy = strncpy(buffer, path, A1FS_PATH_MAX);
-    char *search_name;
-    int parent_ino_no = 0;
-		int child_ino_no = 0;
-
-    while ( (search_name = strsep(&copy, "/")) != NULL ) {
-			if (strcmp(search_name, "") == 0) {
-				continue;
-			}
-			parent_ino_no = child_ino_no;
-			a1fs_inode *parent_ino = get_ino(fs, parent_ino_no);
-      child_ino_no = get_dentry_ino_no(fs, parent_ino, search_name);
-      if (child_ino_no < 0) {
-        break;
-      }
-    }
+	path_info pi;
+	int ino_no = resolve_path(fs, path, &pi);
+	return look_for_parent ? pi.parent_ino_no : ino_no;
+}
+
 
-    return look_for_parent ? parent_ino_no : child_ino_no;
+/** Deepest path resolved without the lock; deeper paths take the lock. */
+#define OPTIMISTIC_DEPTH_MAX 32
+/** Lock-free getattr attempts before falling back to the lock. */
+#define OPTIMISTIC_TRIES 4
+
+/**
+* Reads a metadata blk without the fs lock: the working copy kept by the journal
+*	if the blk has one, otherwise the image.
+*/
+const void *peek_meta_blk(fs_ctx *fs, a1fs_blk_t blk) {
+	const void *copy = journal_peek(fs, blk);
+	return copy ? copy : fs->storage->get(fs, blk, STORAGE_META);
 }
 
-void path_lookup_for_last_dentry(const char *path, char last_dentry_name[A1FS_NAME_MAX]) {
-		char buffer[A1FS_PATH_MAX];
-		strcpy(buffer, path);
-		strncpy(last_dentry_name, basename(buffer), A1FS_NAME_MAX);
+/**
+* Looks up a name in a dir without the fs lock. A writer may be changing the dir,
+*	so every extent and inode number read is checked against the image before
+*	it is used. Returns the inode number, -ENOENT, or -EAGAIN if the dir is
+*	inconsistent.
+*/
+int find_dentry_optimistic(fs_ctx *fs, const a1fs_inode *parent_ino, const char *name, size_t len) {
+	const a1fs_superblock *sb = fs->sb;
+	int exts_blk_no = parent_ino->extents_blk;
+	a1fs_blk_t exts_count = parent_ino->extents_count;
+	uint64_t dentries_total = parent_ino->size / sizeof(a1fs_dentry);
+	if (exts_blk_no == -1) { return -ENOENT; }
+	if (exts_blk_no < 0 || (a1fs_blk_t)exts_blk_no >= sb->data_blocks_count || exts_count > A1FS_EXTS_MAX) {
+		return -EAGAIN;
+	}
+	const a1fs_extent *exts_blk = peek_meta_blk(fs, sb->first_data_blk + exts_blk_no);
+
+	for (a1fs_blk_t i = 0; i < exts_count && dentries_total > 0; i++) {
+		a1fs_extent ext = exts_blk[i];
+		if (ext.start >= sb->data_blocks_count || ext.count > sb->data_blocks_count - ext.start) { return -EAGAIN; }
+
+		for (a1fs_blk_t j = 0; j < ext.count && dentries_total > 0; j++) {
+			const a1fs_dentry *entries_blk = peek_meta_blk(fs, sb->first_data_blk + ext.start + j);
+			uint64_t dentries_in_this_blk = (dentries_total > A1FS_EXT_DENTRIES_MAX) ? A1FS_EXT_DENTRIES_MAX : dentries_total;
+			dentries_total -= dentries_in_this_blk;
+
+			for (uint64_t k = 0; k < dentries_in_this_blk; k++) {
+				const a1fs_dentry *entry = &entries_blk[k];
+				if (entry->name[len] == '\0' && memcmp(entry->name, name, len) == 0) {
+					a1fs_ino_t ino_no = entry->ino;
+					return (ino_no < sb->inodes_count) ? (int)ino_no : -EAGAIN;
+				}
+			}
+		}
+	}
+	return -ENOENT;
+}
+
+/**
+* getattr without the fs lock: resolves the path and reads the attributes
+*	while recording the sequence counter of every inode on the way, then
+*	checks that no writer changed any of them. Returns 0 or -errno like
+*	a1fs_getattr(), or -EAGAIN if a writer overlapped the lookup.
+*/
+int getattr_optimistic(fs_ctx *fs, const char *path, struct stat *st) {
+	int visited[OPTIMISTIC_DEPTH_MAX];
+	unsigned seqs[OPTIMISTIC_DEPTH_MAX];
+	int depth = 0;
+	int ino_no = 0;
+	int ret = 0;
+
+	const char *p = path;
+	for (;;) {
+		if (depth == OPTIMISTIC_DEPTH_MAX) { return -EAGAIN; }
+		unsigned seq = __atomic_load_n(&fs->ino_seq[ino_no], __ATOMIC_ACQUIRE);
+		if (seq & 1) { return -EAGAIN; }
+		visited[depth] = ino_no;
+		seqs[depth] = seq;
+		depth++;
+
+		const a1fs_inode *inode = get_ino(fs, ino_no);
+		while (*p == '/') { p++; }
+		if (*p == '\0') {
+			fill_stat(inode, st);
+			break;
+		}
+		const char *name = p;
+		while (*p != '\0' && *p != '/') { p++; }
+		size_t len = p - name;
+
+		if (!S_ISDIR(inode->mode)) { ret = -ENOTDIR; break; }
+		if (len >= A1FS_NAME_MAX) { ret = -ENAMETOOLONG; break; }
+		ino_no = find_dentry_optimistic(fs, inode, name, len);
+		if (ino_no == -EAGAIN) { return -EAGAIN; }
+		if (ino_no < 0) { ret = ino_no; break; }
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	for (int i = 0; i < depth; i++) {
+		if (__atomic_load_n(&fs->ino_seq[visited[i]], __ATOMIC_RELAXED) != seqs[i]) { return -EAGAIN; }
+	}
+	return ret;
 }
 
 
@@ -616,13 +1129,54 @@ static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
 		return true;
 	}
 
-	size_t size;
-	void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
-	if (!image) {
-		return false;
-	}
+	return fs_ctx_init(fs, opts);
+}
 
-	return fs_ctx_init(fs, image, size);
+/**
+ * Start background threads.
+ *
+ * Called by FUSE once the file system is mounted. Threads can't be started in
+ * a1fs_init() since FUSE forks into the background after it returns. Orphans
+ * left over from the previous mount are picked up here.
+ *
+ * @param conn  connection capabilities; readdirplus and the writeback cache
+ *              are requested if the library supports them.
+ * @return      file system context passed to fuse_main().
+ */
+static void *a1fs_start(struct fuse_conn_info *conn)
+{
+	fs_ctx *fs = get_fs();
+#ifdef FUSE_CAP_READDIRPLUS
+	if (conn->capable & FUSE_CAP_READDIRPLUS) {
+		conn->want |= FUSE_CAP_READDIRPLUS;
+	}
+#endif
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+	if (fs->writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	} else if (fs->writeback_cache) {
+		fprintf(stderr, "The kernel doesn't support the writeback cache\n");
+		fs->writeback_cache = false;
+	}
+#else
+	(void)conn;// unused
+	if (fs->writeback_cache) {
+		fprintf(stderr, "This FUSE version doesn't support the writeback cache\n");
+		fs->writeback_cache = false;
+	}
+#endif
+	if (fs->sb) {
+		fs->stopping = false;
+		taskpool_start(fs);
+		fs_ctx_lock(fs);
+		queue_orphans(fs);
+		fs_ctx_unlock(fs);
+		journal_start(fs);
+		writeback_start(fs);
+		prefetch_list_start(fs);
+		kcache_start(fs, fuse_get_context()->fuse);
+	}
+	return fs;
 }
 
 /**
@@ -634,8 +1188,21 @@ static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
 static void a1fs_destroy(void *ctx)
 {
 	fs_ctx *fs = (fs_ctx*)ctx;
-	if (fs->image) {
-		munmap(fs->image, fs->size);
+	if (fs->sb) {
+		kcache_stop(fs);
+		prefetch_list_stop(fs);
+		taskpool_stop(fs);
+		writeback_stop(fs);
+		fs_ctx_lock(fs);
+		fold_free_counts(fs);
+		end_op(fs, -1, -1);
+		fs_ctx_unlock(fs);
+		journal_stop(fs);
+		fs_ctx_lock(fs);
+		if (dirty_sync_all(fs) < 0) {
+			fprintf(stderr, "Failed to write back the image; changes may be lost\n");
+		}
+		fs_ctx_unlock(fs);
 		fs_ctx_destroy(fs);
 	}
 }
@@ -666,15 +1233,17 @@ static int a1fs_statfs(const char *path, struct statvfs *st)
 	st->f_frsize  = A1FS_BLOCK_SIZE;
 	//TODO: fill in the rest of required fields based on the information stored
 	// in the superblock
+	fs_ctx_lock(fs);
 	a1fs_superblock *sb = fs->sb;
 
 	st->f_blocks = sb->blocks_count;
-	st->f_bfree = sb->free_data_blocks_count;
+	st->f_bfree = alloc_free_blks(fs);
 	st->f_bavail = st->f_bfree;
 	st->f_files = sb->inodes_count;
-	st->f_ffree = sb->free_inodes_count;
+	st->f_ffree = alloc_free_inodes(fs);
 	st->f_favail = st->f_ffree;
 	st->f_namemax = A1FS_NAME_MAX;
+	fs_ctx_unlock(fs);
 
 	return 0;
 }
@@ -708,27 +1277,28 @@ static int a1fs_getattr(const char *path, struct stat *st)
 		return -ENAMETOOLONG;
 	}
 
-	memset(st, 0, sizeof(*st));
 	fs_ctx *fs = get_fs();
 
+	// Most lookups don't overlap a change to the inodes on their path
+	if (fs->ino_seq) {
+		for (int i = 0; i < OPTIMISTIC_TRIES; i++) {
+			int ret = getattr_optimistic(fs, path, st);
+			if (ret != -EAGAIN) { return ret; }
+		}
+	}
+
 	//TODO: lookup the inode for given path and, if it exists, fill in the
 	// required fields based on the information stored in the inode
 		//NOTE: all the fields set below are required and must be set according
 		// to the information stored in the corresponding inode
+	fs_ctx_lock(fs);
 	int ino_no = path_lookup(fs, path, false);
-	if (ino_no < 0) {
-		return ino_no;
-	} else {
-		a1fs_inode *inode = get_ino(fs, ino_no);
-
-		st->st_mode = inode->mode;
-		st->st_nlink = inode->links;
-		st->st_size = inode->size;
-		st->st_blocks = inode->used_blocks_count * A1FS_BLOCK_SIZE / 512;
-		st->st_mtim = inode->mtime;
-
-		return 0;
+	if (ino_no >= 0) {
+		fill_stat(get_ino(fs, ino_no), st);
 	}
+	fs_ctx_unlock(fs);
+
+	return (ino_no < 0) ? ino_no : 0;
 }
 
 
@@ -737,6 +1307,16 @@ static int a1fs_getattr(const char *path, struct stat *st)
  *
  * Implements the readdir() system call. Should call filler(buf, name, NULL, 0)
  * for each directory entry. See fuse.h in libfuse source code for details.
+ * The attributes of each entry are passed to filler() as well, so that the
+ * kernel can cache them in bulk where readdirplus is supported instead of
+ * asking for them with one getattr() call per entry.
+ *
+ * Each entry is passed with the offset of the next one, encoding the position
+ * of its dentry (db index within the directory and slot within the db), and
+ * the listing stops when the filler buffer is full. FUSE calls readdir again
+ * with the offset of the last entry it took, so huge directories are listed in
+ * buffer sized pieces. Offsets stay valid while the directory is open since
+ * removed entries are left as tombstones until a1fs_releasedir().
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a directory.
@@ -747,26 +1327,116 @@ static int a1fs_getattr(const char *path, struct stat *st)
  * @param path    path to the directory.
  * @param buf     buffer that receives the result.
  * @param filler  function that needs to be called for each directory entry.
- *                Pass 0 as offset (4th argument). 3rd argument can be NULL.
- * @param offset  unused.
- * @param fi      unused.
+ * @param offset  offset to resume the listing at; 0 to start from the first
+ *                entry.
+ * @param fi      file info; fh holds the open directory state, if any.
  * @return        0 on success; -errno on error.
  */
 static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                         off_t offset, struct fuse_file_info *fi)
 {
-	(void)offset;// unused
-	(void)fi;// unused
 	fs_ctx *fs = get_fs();
 
 	//TODO: lookup the directory inode for given path and iterate through its
 	// directory entries
-	if (filler(buf, "." , NULL, 0) != 0) { return -ENOMEM; }
-	if (filler(buf, "..", NULL, 0) != 0) { return -ENOMEM; }
-
+	fs_ctx_lock(fs);
 	int ino_no = path_lookup(fs, path, false);
 	a1fs_inode *ino = get_ino(fs, ino_no);
-	return traverse_exts_to_fill_name(fs, ino, buf, filler);
+	struct stat st;
+	fill_stat(ino, &st);
+	bool tombstones = false;
+	int ret = 0;
+	if (offset < 1 && filler(buf, "." , &st, 1) != 0) { goto end; }
+	if (offset < 2 && filler(buf, "..", NULL, 2) != 0) { goto end; }
+	ret = traverse_exts_to_fill_name(fs, ino, buf, filler, (offset > 2) ? offset - 2 : 0, &tombstones);
+
+	// Tombstones left by a crash are compacted on release as well
+	open_dir *od = (open_dir *)(uintptr_t)fi->fh;
+	if (od && tombstones) { od->has_tombstones = true; }
+end:
+	fs_ctx_unlock(fs);
+	return ret;
+}
+
+
+/**
+ * Open a directory.
+ *
+ * Registers the handle so that entries removed while the directory is open are
+ * left as tombstones and the offsets returned by a1fs_readdir() stay valid.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "path" exists and is a directory.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param path  path to the directory.
+ * @param fi    file info; fh receives the open directory state.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
+
+	int ret = 0;
+	fs_ctx_lock(fs);
+	int ino_no = path_lookup(fs, path, false);
+	if (ino_no < 0) { ret = ino_no; goto end; }
+
+	open_dir *od = find_open_dir(fs, ino_no);
+	if (!od) {
+		od = malloc(sizeof(open_dir));
+		if (!od) { ret = -ENOMEM; goto end; }
+		od->ino = ino_no;
+		od->opens = 0;
+		od->has_tombstones = false;
+		od->next = fs->open_dirs;
+		fs->open_dirs = od;
+	}
+	od->opens += 1;
+	fi->fh = (uintptr_t)od;
+
+end:
+	fs_ctx_unlock(fs);
+	return ret;
+}
+
+/**
+ * Release an open directory.
+ *
+ * When the last handle of the directory is released, the tombstones left in it
+ * are compacted.
+ *
+ * @param path  path to the directory.
+ * @param fi    file info; fh holds the open directory state.
+ * @return      0 (the return value is ignored).
+ */
+static int a1fs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
+	open_dir *od = (open_dir *)(uintptr_t)fi->fh;
+	if (!od) { return 0; }
+
+	fs_ctx_lock(fs);
+	od->opens -= 1;
+	if (od->opens == 0) {
+		if (od->has_tombstones) {
+			ino_write_begin(fs, od->ino);
+			compact_dentries(fs, get_ino(fs, od->ino));
+			ino_write_end(fs, od->ino);
+			end_op(fs, od->ino, -1);
+			// The kernel doesn't know that the size of the dir changed
+			kcache_invalidate(fs, path);
+		}
+		open_dir **p = &fs->open_dirs;
+		while (*p != od) { p = &(*p)->next; }
+		*p = od->next;
+		free(od);
+	}
+	fs_ctx_unlock(fs);
+	fi->fh = 0;
+	return 0;
 }
 
 
@@ -794,20 +1464,24 @@ static int a1fs_mkdir(const char *path, mode_t mode)
 	fs_ctx *fs = get_fs();
 
 	//TODO: create a directory at given path with given mode
+	int ret = 0;
+	fs_ctx_lock(fs);
 
-	// 1. Initialize inode for the new directory
-	int dir_ino_no = allocate_ino(fs, mode, 2);
-	if (dir_ino_no < 0) {	return dir_ino_no; }
-
-	// 2. Get parent directory inode and new directory name
-	int parent_ino_no = path_lookup(fs, path, true);
+	// 1. Get parent directory inode and new directory name
+	path_info pi;
+	resolve_path(fs, path, &pi);
+	int parent_ino_no = pi.parent_ino_no;
 	a1fs_inode *parent_ino = get_ino(fs, parent_ino_no);
-	char dir_name[A1FS_NAME_MAX];
-	path_lookup_for_last_dentry(path, dir_name);
+	// The new inode is only reachable through the parent
+	ino_write_begin(fs, parent_ino_no);
+
+	// 2. Initialize inode for the new directory
+	int dir_ino_no = allocate_ino(fs, mode, 2);
+	if (dir_ino_no < 0) {	ret = dir_ino_no; goto end; }
 
 	// 3. Initialize ext blk for parent dir inode if needed
 	if (parent_ino->extents_blk == -1) {
-		if (initialize_ext_blk_for_ino(fs, parent_ino) < 0) {	return -ENOSPC; }
+		if (initialize_ext_blk_for_ino(fs, parent_ino) < 0) {	ret = -ENOSPC; goto end; }
 	}
 
 	// 4. Add new dentry to parent dir inode
@@ -816,21 +1490,27 @@ static int a1fs_mkdir(const char *path, mode_t mode)
 
 			// find the next available db following parent_ino's last db to reduce file fragmentation
 		int new_db_no = find_contiguous_dbs_start_from_index(fs, last_db_no + 1, 1);
-		if (new_db_no == -ENOSPC) { return -ENOSPC; }
+		if (new_db_no == -ENOSPC) { ret = -ENOSPC; goto end; }
 		initialize_dbs_at_index_for_ino(fs, parent_ino, new_db_no, 1);	// 4.1. Allocate new db
-		add_to_dentries_blk_for_ino(fs, parent_ino, new_db_no, dir_ino_no, dir_name);	// 4.2. Add dentry
+		add_to_dentries_blk_for_ino(fs, parent_ino, new_db_no, dir_ino_no, pi.name, pi.name_len);	// 4.2. Add dentry
 		add_to_ext_blk_for_ino(fs, parent_ino, new_db_no, 1);	// 4.3. Add extent
 
 	} else {	// Means the dentry can add to parent_ino's last dentries blk
-		add_to_dentries_blk_for_ino(fs, parent_ino, last_db_no, dir_ino_no, dir_name);	// 4.1. Only need to add dentry
+		add_to_dentries_blk_for_ino(fs, parent_ino, last_db_no, dir_ino_no, pi.name, pi.name_len);	// 4.1. Only need to add dentry
 	}
 
 	// 5. Update metadata p.s. some metadata has been updated by helper functions
 	parent_ino->links += 1;
 	clock_gettime(CLOCK_REALTIME, &(parent_ino->mtime));
 	fs->sb->used_dirs_count += 1;
-
-	return 0;
+	mark_meta_dirty(fs, parent_ino, sizeof(*parent_ino));
+	mark_meta_dirty(fs, fs->sb, sizeof(*fs->sb));
+
+end:
+	ino_write_end(fs, parent_ino_no);
+	end_op(fs, parent_ino_no, dir_ino_no);
+	fs_ctx_unlock(fs);
+	return ret;
 }
 
 
@@ -854,17 +1534,20 @@ static int a1fs_rmdir(const char *path)
 	fs_ctx *fs = get_fs();
 
 	//TODO: remove the directory at given path (only if it's empty)
+	fs_ctx_lock(fs);
 
-	int dir_ino_no = path_lookup(fs, path, false);
+	path_info pi;
+	int dir_ino_no = resolve_path(fs, path, &pi);
 	a1fs_inode *dir_ino = get_ino(fs, dir_ino_no); 	// directory inode to be removed
-	int parent_ino_no = path_lookup(fs, path, true);
+	int parent_ino_no = pi.parent_ino_no;
 	a1fs_inode *parent_ino = get_ino(fs, parent_ino_no);	// parent directory inode
-	char dir_name[A1FS_NAME_MAX];
-	path_lookup_for_last_dentry(path, dir_name);
 
-	if (dir_ino->size != 0) {
+	if (!dir_is_empty(fs, dir_ino)) {
+		fs_ctx_unlock(fs);
 		return -ENOTEMPTY;
 	}
+	ino_write_begin(fs, parent_ino_no);
+	ino_write_begin(fs, dir_ino_no);
 
 	// 1. Deallocaste all data blks related to the dir inode
 	traverse_exts_to_deallocate_dbs(fs, dir_ino);
@@ -872,22 +1555,25 @@ static int a1fs_rmdir(const char *path)
 	// 2. Deallocate its inode
 	deallocate_ino_at_index(fs, dir_ino_no);
 
-	// 3. Remove dentry from parent dir inode
-	if (parent_ino->size % A1FS_BLOCK_SIZE == sizeof(a1fs_dentry)) {	// Means the last db needs to be deallocated after the removal
-
-		traverse_exts_to_replace_dentry(fs, parent_ino, dir_name);	// 3.1. Replace dentry with the last dentry
-		deallocate_db_for_ino(fs, parent_ino, get_last_data_blk_no(fs, parent_ino));	// 3.2. Deallocate last db
-		shrink_ext_for_ino(fs, parent_ino);	// 3.3. Shrink extent
+	// Handles still open on the removed dir have nothing left to compact
+	open_dir *od = find_open_dir(fs, dir_ino_no);
+	if (od) { od->has_tombstones = false; }
 
-	} else {	// Means the last db doesn't need to be deallocated
-		traverse_exts_to_replace_dentry(fs, parent_ino, dir_name);	// 3.1. Only need to replace dentry with the last dentry
-	}
+	// 3. Remove dentry from parent dir inode
+	remove_dentry(fs, parent_ino, parent_ino_no, pi.dentry);
 
 	// 4. Update metadata p.s. some metadata has been updated by helper functions
 	parent_ino->links -= 1;
 	clock_gettime(CLOCK_REALTIME, &(parent_ino->mtime));
 	fs->sb->used_dirs_count -= 1;
-
+	mark_meta_dirty(fs, parent_ino, sizeof(*parent_ino));
+	mark_meta_dirty(fs, fs->sb, sizeof(*fs->sb));
+
+	ino_write_end(fs, dir_ino_no);
+	ino_write_end(fs, parent_ino_no);
+	dirty_forget(fs, dir_ino_no);
+	end_op(fs, parent_ino_no, -1);
+	fs_ctx_unlock(fs);
 	return 0;
 }
 
@@ -908,29 +1594,37 @@ static int a1fs_rmdir(const char *path)
  *
  * @param path  path to the file to create.
  * @param mode  file mode bits.
- * @param fi    unused.
+ * @param fi    file info; fh receives the open file state.
  * @return      0 on success; -errno on error.
  */
 static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
 	assert(S_ISREG(mode));
 	fs_ctx *fs = get_fs();
 
-	//TODO: create a file at given path with given mode
-	// 1. Initialize inode for the new file
-	int file_ino_no = allocate_ino(fs, mode, 1);
-	if (file_ino_no < 0) { return file_ino_no; }
+	// The new file is also opened; see a1fs_open()
+	readahead *ra = malloc(sizeof(readahead));
+	if (!ra) { return -ENOMEM; }
 
-	// 2. Get parent directory inode and new file name
-	int parent_ino_no = path_lookup(fs, path, true);
+	//TODO: create a file at given path with given mode
+	int ret = 0;
+	fs_ctx_lock(fs);
+	readahead_init(ra, fs->readahead_max);
+
+	// 1. Get parent directory inode and new file name
+	path_info pi;
+	resolve_path(fs, path, &pi);
+	int parent_ino_no = pi.parent_ino_no;
 	a1fs_inode *parent_ino = get_ino(fs, parent_ino_no);
-	char dir_name[A1FS_NAME_MAX];
-	path_lookup_for_last_dentry(path, dir_name);
+	ino_write_begin(fs, parent_ino_no);
+
+	// 2. Initialize inode for the new file
+	int file_ino_no = allocate_ino(fs, mode, 1);
+	if (file_ino_no < 0) { ret = file_ino_no; goto end; }
 
 	// 3. Initialize ext blk for parent dir inode if needed
 	if (parent_ino->extents_blk == -1) {
-		if (initialize_ext_blk_for_ino(fs, parent_ino) < 0) {	return -ENOSPC; }
+		if (initialize_ext_blk_for_ino(fs, parent_ino) < 0) {	ret = -ENOSPC; goto end; }
 	}
 
 	// 4. Add new dentry to parent dir inode
@@ -939,19 +1633,29 @@ static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 
 		// find the next available db following parent_ino's last db to reduce file fragmentation
 		int new_db_no = find_contiguous_dbs_start_from_index(fs, last_db_no + 1, 1);
-		if (new_db_no == -ENOSPC) { return -ENOSPC; }
+		if (new_db_no == -ENOSPC) { ret = -ENOSPC; goto end; }
 		initialize_dbs_at_index_for_ino(fs, parent_ino, new_db_no, 1);	// 4.1. Allocate new db
-		add_to_dentries_blk_for_ino(fs, parent_ino, new_db_no, file_ino_no, dir_name);	// 4.2. Add dentry
+		add_to_dentries_blk_for_ino(fs, parent_ino, new_db_no, file_ino_no, pi.name, pi.name_len);	// 4.2. Add dentry
 		add_to_ext_blk_for_ino(fs, parent_ino, new_db_no, 1);	// 4.3. Add extent
 
 	} else {	// Means the dentry can add to parent_ino's last dentries blk
-		add_to_dentries_blk_for_ino(fs, parent_ino, last_db_no, file_ino_no, dir_name);	// 4.1. Only need to add dentry
+		add_to_dentries_blk_for_ino(fs, parent_ino, last_db_no, file_ino_no, pi.name, pi.name_len);	// 4.1. Only need to add dentry
 	}
 
 	// 5. Update metadata p.s. some metadata has been updated by helper functions
 	clock_gettime(CLOCK_REALTIME, &(parent_ino->mtime));
-
-	return 0;
+	mark_meta_dirty(fs, parent_ino, sizeof(*parent_ino));
+
+end:
+	ino_write_end(fs, parent_ino_no);
+	end_op(fs, parent_ino_no, file_ino_no);
+	fs_ctx_unlock(fs);
+	if (ret == 0) {
+		fi->fh = (uintptr_t)ra;
+	} else {
+		free(ra);
+	}
+	return ret;
 }
 
 
@@ -973,33 +1677,30 @@ static int a1fs_unlink(const char *path)
 	fs_ctx *fs = get_fs();
 
 	//TODO: remove the file at given path
-	int file_ino_no = path_lookup(fs, path, false);
+	fs_ctx_lock(fs);
+	path_info pi;
+	int file_ino_no = resolve_path(fs, path, &pi);
 	a1fs_inode *file_ino = get_ino(fs, file_ino_no);	// inode for file to be removed
-	int parent_ino_no = path_lookup(fs, path, true);
+	int parent_ino_no = pi.parent_ino_no;
 	a1fs_inode *parent_ino = get_ino(fs, parent_ino_no);	// parent directory inode
-	char file_name[A1FS_NAME_MAX];
-	path_lookup_for_last_dentry(path, file_name);
+	ino_write_begin(fs, parent_ino_no);
+	ino_write_begin(fs, file_ino_no);
 
-	// 1. Deallocaste all data blks related to the file inode
-	traverse_exts_to_deallocate_dbs(fs, file_ino);
+	// 1. Put the file inode on the orphan list; its data blks and the inode itself
+	// are freed by a background task so that unlink doesn't depend on file size
+	add_orphan(fs, file_ino, file_ino_no);
 
-	// 2. Deallocate its inode
-	deallocate_ino_at_index(fs, file_ino_no);
-
-	// 3. Remove dentry from parent dir inode
-	if (parent_ino->size % A1FS_BLOCK_SIZE == sizeof(a1fs_dentry)) {	// Means the last db needs to be deallocated after the removal
+	// 2. Remove dentry from parent dir inode
+	remove_dentry(fs, parent_ino, parent_ino_no, pi.dentry);
 
-		traverse_exts_to_replace_dentry(fs, parent_ino, file_name);	// 3.1. Replace dentry with the last dentry
-		deallocate_db_for_ino(fs, parent_ino, get_last_data_blk_no(fs, parent_ino));	// 3.2. Deallocate last db
-		shrink_ext_for_ino(fs, parent_ino);	// 3.3. Shrink extent
-
-	} else {	// Means the last db doesn't need to be deallocated
-		traverse_exts_to_replace_dentry(fs, parent_ino, file_name);	// 3.1. Only need to replace dentry with the last dentry
-	}
-
-	// 4. Update metadata p.s. some metadata has been updated by helper functions
+	// 3. Update metadata p.s. some metadata has been updated by helper functions
 	clock_gettime(CLOCK_REALTIME, &(parent_ino->mtime));
+	mark_meta_dirty(fs, parent_ino, sizeof(*parent_ino));
 
+	ino_write_end(fs, file_ino_no);
+	ino_write_end(fs, parent_ino_no);
+	end_op(fs, parent_ino_no, -1);
+	fs_ctx_unlock(fs);
 	return 0;
 }
 
@@ -1029,15 +1730,21 @@ static int a1fs_utimens(const char *path, const struct timespec times[2])
 	// path with either the time passed as argument or the current time,
 	// according to the utimensat man page
 
+	fs_ctx_lock(fs);
 	int ino_no = path_lookup(fs, path, false);
 	a1fs_inode *inode_table = fs->inode_table;
 	a1fs_inode *inode = &inode_table[ino_no];
 
+	ino_write_begin(fs, ino_no);
 	if(times[1].tv_nsec == UTIME_NOW) {
 		clock_gettime(CLOCK_REALTIME, &(inode->mtime));
-	} else {
+	} else if (times[1].tv_nsec != UTIME_OMIT) {
 		inode->mtime = times[1];
 	}
+	ino_write_end(fs, ino_no);
+	mark_meta_dirty(fs, inode, sizeof(*inode));
+	end_op(fs, ino_no, -1);
+	fs_ctx_unlock(fs);
 
 	return 0;
 }
@@ -1066,13 +1773,67 @@ static int a1fs_truncate(const char *path, off_t size)
 	fs_ctx *fs = get_fs();
 
 	//TODO: set new file size, possibly "zeroing out" the uninitialized range
+	fs_ctx_lock(fs);
 	int ino_no = path_lookup(fs, path, false);
 	a1fs_inode *file_ino = get_ino(fs, ino_no);
 
 	int additional_bytes = size - file_ino->size;
-	return (additional_bytes >= 0)
+	ino_write_begin(fs, ino_no);
+	int ret = (additional_bytes >= 0)
 		? extend_file(fs, file_ino, additional_bytes)
 		: shrink_file(fs, file_ino, additional_bytes*(-1));
+	ino_write_end(fs, ino_no);
+	end_op(fs, ino_no, -1);
+	writeback_throttle(fs);
+	fs_ctx_unlock(fs);
+	return ret;
+}
+
+
+/**
+ * Open a file.
+ *
+ * Implements the open() system call. Sets up the per-open-file state used for
+ * readahead; no permission checks are done.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "path" exists and is a file.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param path  path to the file to open.
+ * @param fi    file info; fh receives the open file state.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_open(const char *path, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	fs_ctx *fs = get_fs();
+
+	readahead *ra = malloc(sizeof(readahead));
+	if (!ra) { return -ENOMEM; }
+	readahead_init(ra, fs->readahead_max);
+	fi->fh = (uintptr_t)ra;
+	return 0;
+}
+
+/**
+ * Release an open file.
+ *
+ * Called when the last file descriptor of an open file is closed. Frees the
+ * state set up by a1fs_open() or a1fs_create().
+ *
+ * @param path  path to the file.
+ * @param fi    file info; fh holds the open file state.
+ * @return      0 (the return value is ignored).
+ */
+static int a1fs_release(const char *path, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	free((readahead *)(uintptr_t)fi->fh);
+	fi->fh = 0;
+	return 0;
 }
 
 
@@ -1093,35 +1854,42 @@ static int a1fs_truncate(const char *path, off_t size)
  * @param buf     pointer to the buffer that receives the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to read from.
- * @param fi      unused.
+ * @param fi      file info; fh holds the open file state.
  * @return        number of bytes read on success; 0 if offset is beyond EOF;
  *                -errno on error.
  */
 static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
                      struct fuse_file_info *fi)
 {
-	(void)fi;// unused
 	fs_ctx *fs = get_fs();
+	readahead *ra = (readahead *)(uintptr_t)fi->fh;
 
 	//TODO: read data from the file at given offset into the buffer
+	fs_ctx_lock(fs);
 	a1fs_inode *file_ino = get_ino(fs, path_lookup(fs, path, false));
 
 	if (offset > (int)file_ino->size || file_ino->size == 0 ||
 	 		file_ino->extents_blk == -1 || file_ino->extents_count == 0) {
+		fs_ctx_unlock(fs);
 		return 0;
 	}
 
-	void *ptr_to_eof = get_ptr_to_end_of_file(fs, file_ino);
-	void *ptr_to_offset = get_ptr_to_byte_in_file(fs, file_ino, offset);
-	int readable_size = ptr_to_eof - ptr_to_offset;
-
+	int readable_size = file_ino->size - offset;
 	if (readable_size > (int)size) {
-		memcpy(buf, ptr_to_offset, size);
-		return size;
-	} else {
-		memcpy(buf, ptr_to_offset, readable_size);
-		return readable_size;
+		readable_size = size;
+	}
+	// A large file read from the start is likely to be read to the end
+	if (offset == 0 && fs->seq_size > 0 && file_ino->size >= fs->seq_size) {
+		advise_file(fs, file_ino, MADV_SEQUENTIAL);
+	}
+	// Start reading ahead first so that it overlaps with this read
+	if (ra) {
+		readahead_file(fs, file_ino, ra, readable_size, offset);
 	}
+	prefetch_file_bytes(fs, file_ino, readable_size, offset);
+	copy_file_bytes(fs, file_ino, buf, readable_size, offset, false);
+	fs_ctx_unlock(fs);
+	return readable_size;
 }
 
 /**
@@ -1130,8 +1898,12 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
  * Implements the pwrite() system call. Must return exactly the number of bytes
  * requested except on error. If the offset is beyond EOF (end of file), the
  * file must be extended. If the write creates a "hole" of uninitialized data,
- * the new uninitialized range must filled with zeros. You can assume that the
- * byte range from offset to offset + size is contained within a single block.
+ * the new uninitialized range must filled with zeros.
+ *
+ * With the kernel writeback cache, writes arrive as page writebacks in any
+ * order, may overwrite data within the file and may span several blocks. The
+ * kernel then owns the file mtime, which it sets with utimens() when it flushes
+ * the cached attributes, so the time of the writeback is not recorded.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
@@ -1156,33 +1928,142 @@ static int a1fs_write(const char *path, const char *buf, size_t size,
 
 	//TODO: write data from the buffer into the file at given offset, possibly
 	// "zeroing out" the uninitialized range
-	a1fs_inode *file_ino = get_ino(fs, path_lookup(fs, path, false));
+	fs_ctx_lock(fs);
+	int ino_no = path_lookup(fs, path, false);
+	a1fs_inode *file_ino = get_ino(fs, ino_no);
 
-	int uninitialized_bytes = offset - file_ino->size;
-	if (extend_file(fs, file_ino, uninitialized_bytes) < 0) { return -ENOSPC;}
-	void *ptr_to_eof_before_write = get_ptr_to_end_of_file(fs, file_ino);
+	int ret = size;
+	ino_write_begin(fs, ino_no);
+	// New dbs are zeroed, and so is the rest of the last db, so extending
+	// the file to the end of the write also zero-fills any hole before it
+	off_t write_end = offset + size;
+	if (write_end > (off_t)file_ino->size) {
+		if (extend_file(fs, file_ino, write_end - file_ino->size) < 0) { ret = -ENOSPC; goto end; }
+	}
+	copy_file_bytes(fs, file_ino, (void *)buf, size, offset, true);
 
-	if (extend_file(fs, file_ino, size) < 0) { return -ENOSPC;}
-	memcpy(ptr_to_eof_before_write, buf, size);
+	if (!fs->writeback_cache) {
+		clock_gettime(CLOCK_REALTIME, &(file_ino->mtime));
+		mark_meta_dirty(fs, file_ino, sizeof(*file_ino));
+	}
 
-	clock_gettime(CLOCK_REALTIME, &(file_ino->mtime));
-	return size;
+end:
+	ino_write_end(fs, ino_no);
+	end_op(fs, ino_no, -1);
+	writeback_throttle(fs);
+	fs_ctx_unlock(fs);
+	return ret;
+}
+
+
+/**
+ * Synchronize the contents of a file with the image.
+ *
+ * Implements the fsync() system call. Flushes the data pages written to the
+ * file since the last fsync and commits the metadata changes made on its
+ * behalf. datasync is treated like fsync since the inode is small.
+ *
+ * Errors:
+ *   ENOENT  the file no longer exists.
+ *   EIO     failed to write the image.
+ *
+ * @param path      path to the file.
+ * @param datasync  nonzero to only synchronize the file data.
+ * @param fi        file info. Can be ignored.
+ * @return          0 on success; -errno on error.
+ */
+static int a1fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void)datasync;// unused
+	(void)fi;// unused
+	fs_ctx *fs = get_fs();
+	io_class prev = iosched_set_class(IO_SYNC);
+
+	fs_ctx_lock(fs);
+	int ino_no = path_lookup(fs, path, false);
+	if (ino_no < 0) {
+		fs_ctx_unlock(fs);
+		iosched_set_class(prev);
+		return ino_no;
+	}
+	fold_free_counts(fs);
+	end_op(fs, ino_no, -1);
+	int ret = dirty_sync(fs, ino_no);
+	fs_ctx_unlock(fs);
+	iosched_set_class(prev);
+	return ret;
+}
+
+/**
+ * Called on each close() of a file descriptor.
+ *
+ * Starts asynchronous writeback of the dirty data pages of the file so that a
+ * later fsync() has less to wait for. Does not wait for the writeback.
+ *
+ * Errors:
+ *   ENOENT  the file no longer exists.
+ *
+ * @param path  path to the file.
+ * @param fi    file info. Can be ignored.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_flush(const char *path, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	fs_ctx *fs = get_fs();
+	io_class prev = iosched_set_class(IO_SYNC);
+
+	fs_ctx_lock(fs);
+	int ino_no = path_lookup(fs, path, false);
+	if (ino_no >= 0) {
+		dirty_writeback(fs, ino_no);
+	}
+	fs_ctx_unlock(fs);
+	iosched_set_class(prev);
+	return (ino_no < 0) ? ino_no : 0;
+}
+
+/**
+ * Synchronize the contents of a directory with the image.
+ *
+ * Commits the changes made to the directory entries and inode.
+ *
+ * Errors:
+ *   EIO  failed to write the image.
+ *
+ * @param path      path to the directory.
+ * @param datasync  nonzero to only synchronize the directory contents.
+ * @param fi        file info. Can be ignored.
+ * @return          0 on success; -errno on error.
+ */
+static int a1fs_fsyncdir(const char *path, int datasync,
+                         struct fuse_file_info *fi)
+{
+	return a1fs_fsync(path, datasync, fi);
 }
 
 
 static struct fuse_operations a1fs_ops = {
+	.init     = a1fs_start,
 	.destroy  = a1fs_destroy,
 	.statfs   = a1fs_statfs,
 	.getattr  = a1fs_getattr,
+	.opendir  = a1fs_opendir,
 	.readdir  = a1fs_readdir,
+	.releasedir = a1fs_releasedir,
 	.mkdir    = a1fs_mkdir,
 	.rmdir    = a1fs_rmdir,
 	.create   = a1fs_create,
 	.unlink   = a1fs_unlink,
 	.utimens  = a1fs_utimens,
 	.truncate = a1fs_truncate,
+	.open     = a1fs_open,
+	.release  = a1fs_release,
 	.read     = a1fs_read,
 	.write    = a1fs_write,
+	.fsync    = a1fs_fsync,
+	.flush    = a1fs_flush,
+	.fsyncdir = a1fs_fsyncdir,
 };
 
 int main(int argc, char *argv[])
@@ -1199,5 +2080,14 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	return fuse_main(args.argc, args.argv, &a1fs_ops, &fs);
+	char *mountpoint;
+	int multithreaded;// a1fs uses its own session loop either way
+	struct fuse *fuse = fuse_setup(args.argc, args.argv, &a1fs_ops, sizeof(a1fs_ops),
+	                               &mountpoint, &multithreaded, &fs);
+	if (!fuse) {
+		return 1;
+	}
+	int ret = session_loop(fuse, opts.queues);
+	fuse_teardown(fuse, mountpoint);
+	return (ret == 0) ? 0 : 1;
 }
@@ -74,6 +74,16 @@ typedef struct a1fs_superblock {
 	uint64_t inode_size;
 	/** Directories count. */
 	a1fs_blk_t used_dirs_count;
+	/** Head of the list of unlinked inodes whose blocks are not freed yet (0 if empty). */
+	a1fs_ino_t orphan_head;
+	/** Block number for the journal header (journal follows the prefetch list). */
+	a1fs_blk_t journal_blk;
+	/** Number of journal blocks including the header; 0 if there is no journal. */
+	a1fs_blk_t journal_blks_count;
+	/** Block number for the prefetch list (prefetch list follows the inode table). */
+	a1fs_blk_t prefetch_blk;
+	/** Number of prefetch list blocks; 0 if there is no prefetch list. */
+	a1fs_blk_t prefetch_blks_count;
 } a1fs_superblock;
 
 // Superblock must fit into a single block
@@ -127,6 +137,8 @@ typedef struct a1fs_inode {
 	int32_t extents_blk;
 	/** Number of extents used by this file. */
 	a1fs_blk_t extents_count;
+	/** Next inode in the orphan list (0 terminates the list). */
+	a1fs_ino_t next_orphan;
 
 	// NOTE: You might have to add padding (e.g. a dummy char array field)
 	// at the end of the struct in order to satisfy the assertion below.
@@ -163,3 +175,73 @@ typedef struct a1fs_dentry {
 } a1fs_dentry;
 
 static_assert(sizeof(a1fs_dentry) == 256, "invalid dentry size");
+
+
+/** Magic values that identify journal blocks. */
+#define A1FS_JOURNAL_MAGIC        0xC5C369A1A1A10001ul
+#define A1FS_JOURNAL_DESC_MAGIC   0xC5C369A1A1A10002ul
+#define A1FS_JOURNAL_COMMIT_MAGIC 0xC5C369A1A1A10003ul
+
+/**
+ * Journal header, stored in the first journal block.
+ *
+ * The rest of the journal holds committed transactions starting at the tail.
+ * Each transaction is a descriptor block, a copy of every metadata block it
+ * changed, and a commit block. A transaction with more entries than fit in one
+ * descriptor has several, each followed by the copies of its blocks.
+ * Transactions are replayed in sequence order at mount until the first one
+ * that is incomplete.
+ */
+typedef struct a1fs_journal_header {
+	/** Must match A1FS_JOURNAL_MAGIC. */
+	uint64_t magic;
+	/** Sequence number of the transaction at the tail. */
+	uint64_t seq;
+	/** Offset of the tail transaction from the journal header block. */
+	a1fs_blk_t tail;
+} a1fs_journal_header;
+
+/** Journal descriptor block - first block of a transaction. */
+typedef struct a1fs_journal_desc {
+	/** Must match A1FS_JOURNAL_DESC_MAGIC. */
+	uint64_t magic;
+	/** Transaction sequence number. */
+	uint64_t seq;
+	/** Number of logged blocks that follow the descriptor. */
+	uint32_t blocks_count;
+	/** Number of blocks freed by this transaction that must not be replayed. */
+	uint32_t revokes_count;
+	/** Home block numbers of logged blocks, followed by revoked block numbers. */
+	a1fs_blk_t blocks[];
+} a1fs_journal_desc;
+
+/** Maximum number of logged plus revoked blocks in one transaction. */
+#define A1FS_JOURNAL_DESC_MAX \
+	((A1FS_BLOCK_SIZE - sizeof(a1fs_journal_desc)) / sizeof(a1fs_blk_t))
+
+/** Journal commit block - last block of a transaction. */
+typedef struct a1fs_journal_commit {
+	/** Must match A1FS_JOURNAL_COMMIT_MAGIC. */
+	uint64_t magic;
+	/** Transaction sequence number. */
+	uint64_t seq;
+	/** Checksum of the descriptors and the logged blocks. */
+	uint64_t checksum;
+} a1fs_journal_commit;
+
+
+/** Magic value that identifies a saved prefetch list. */
+#define A1FS_PREFETCH_MAGIC 0xC5C369A1A1A20001ul
+
+/**
+ * Prefetch list header, stored at the start of the prefetch list blocks.
+ *
+ * The header is followed by runs of data blocks read soon after a mount, in
+ * the order they were first read, as extents (data block numbers).
+ */
+typedef struct a1fs_prefetch_header {
+	/** Must match A1FS_PREFETCH_MAGIC; the list is empty otherwise. */
+	uint64_t magic;
+	/** Number of runs that follow the header. */
+	uint32_t count;
+} a1fs_prefetch_header;
@@ -0,0 +1,197 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Inode and block allocation magazines implementation.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "fs_ctx.h"
+
+
+/** Magazine of the calling thread; -1 until its first allocation. */
+static __thread int alloc_slot = -1;
+/** Next slot to hand out. */
+static unsigned next_slot;
+
+static alloc_magazine *get_mag(fs_ctx *fs)
+{
+	if (alloc_slot < 0) {
+		alloc_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % ALLOC_SLOTS;
+	}
+	return &fs->alloc.mags[alloc_slot];
+}
+
+static bool bit_is_set(const unsigned char *bitmap, uint32_t index)
+{
+	return bitmap[index / 8] & (1 << (7 - index % 8));
+}
+
+/** Whether a data block is free and can be reused now. */
+static bool blk_is_free(fs_ctx *fs, a1fs_blk_t blk)
+{
+	return !bit_is_set(fs->data_bitmap, blk) && !journal_pinned(fs, fs->sb->first_data_blk + blk);
+}
+
+static uint32_t count_set_bits(const unsigned char *bitmap, uint32_t count)
+{
+	uint32_t set = 0;
+	for (uint32_t i = 0; i < count / 8; i++) {
+		set += __builtin_popcount(bitmap[i]);
+	}
+	for (uint32_t i = count - count % 8; i < count; i++) {
+		set += bit_is_set(bitmap, i);
+	}
+	return set;
+}
+
+
+void alloc_init(fs_ctx *fs)
+{
+	alloc_state *as = &fs->alloc;
+	memset(as, 0, sizeof(*as));
+
+	// The counts on the image are only folded now and then
+	a1fs_superblock *sb = fs->sb;
+	sb->free_inodes_count = sb->inodes_count - count_set_bits(fs->inode_bitmap, sb->inodes_count);
+	sb->free_data_blocks_count = sb->data_blocks_count - count_set_bits(fs->data_bitmap, sb->data_blocks_count);
+}
+
+int alloc_pop_ino(fs_ctx *fs)
+{
+	alloc_state *as = &fs->alloc;
+	alloc_magazine *mag = get_mag(fs);
+	a1fs_ino_t count = fs->sb->inodes_count;
+
+	for (;;) {
+		// Another thread may have taken a cached inode since
+		while (mag->inode_count > 0) {
+			a1fs_ino_t ino = mag->inodes[--mag->inode_count];
+			if (!bit_is_set(fs->inode_bitmap, ino)) {
+				return ino;
+			}
+		}
+		if (alloc_free_inodes(fs) == 0) {
+			return -ENOSPC;
+		}
+
+		// Refill with the next free inodes after the cursor, in reverse so
+		// that they are handed out in order
+		a1fs_ino_t found[ALLOC_MAG_INODES];
+		unsigned nfound = 0;
+		a1fs_ino_t ino = as->inode_cursor;
+		for (a1fs_ino_t i = 0; i < count && nfound < ALLOC_MAG_INODES; i++) {
+			if (!bit_is_set(fs->inode_bitmap, ino)) {
+				found[nfound++] = ino;
+			}
+			ino = (ino + 1 == count) ? 0 : ino + 1;
+		}
+		if (nfound == 0) {
+			return -ENOSPC;
+		}
+		as->inode_cursor = ino;
+		while (nfound > 0) {
+			mag->inodes[mag->inode_count++] = found[--nfound];
+		}
+	}
+}
+
+void alloc_push_ino(fs_ctx *fs, a1fs_ino_t ino)
+{
+	alloc_magazine *mag = get_mag(fs);
+	if (mag->inode_count < ALLOC_MAG_INODES) {
+		mag->inodes[mag->inode_count++] = ino;
+	}
+}
+
+int alloc_pop_blk(fs_ctx *fs)
+{
+	alloc_state *as = &fs->alloc;
+	alloc_magazine *mag = get_mag(fs);
+	a1fs_blk_t count = fs->sb->data_blocks_count;
+
+	for (;;) {
+		while (mag->run_count > 0) {
+			a1fs_blk_t blk = mag->run_start++;
+			mag->run_count--;
+			if (blk_is_free(fs, blk)) {
+				return blk;
+			}
+		}
+		if (alloc_free_blks(fs) == 0) {
+			return -ENOSPC;
+		}
+
+		// Refill with the first run of free blocks after the cursor
+		a1fs_blk_t blk = as->blk_cursor;
+		a1fs_blk_t i = 0;
+		while (i < count && !blk_is_free(fs, blk)) {
+			blk = (blk + 1 == count) ? 0 : blk + 1;
+			i++;
+		}
+		if (i == count) {
+			return -ENOSPC;
+		}
+		mag->run_start = blk;
+		while (blk < count && mag->run_count < ALLOC_RUN_BLKS && blk_is_free(fs, blk)) {
+			mag->run_count++;
+			blk++;
+		}
+		as->blk_cursor = (blk == count) ? 0 : blk;
+	}
+}
+
+void alloc_count(fs_ctx *fs, int inodes, int blks)
+{
+	alloc_magazine *mag = get_mag(fs);
+	mag->free_inodes_delta += inodes;
+	mag->free_blks_delta += blks;
+}
+
+a1fs_ino_t alloc_free_inodes(fs_ctx *fs)
+{
+	int64_t count = fs->sb->free_inodes_count;
+	for (int i = 0; i < ALLOC_SLOTS; i++) {
+		count += fs->alloc.mags[i].free_inodes_delta;
+	}
+	return count;
+}
+
+a1fs_blk_t alloc_free_blks(fs_ctx *fs)
+{
+	int64_t count = fs->sb->free_data_blocks_count;
+	for (int i = 0; i < ALLOC_SLOTS; i++) {
+		count += fs->alloc.mags[i].free_blks_delta;
+	}
+	return count;
+}
+
+bool alloc_fold(fs_ctx *fs)
+{
+	a1fs_ino_t free_inodes = alloc_free_inodes(fs);
+	a1fs_blk_t free_blks = alloc_free_blks(fs);
+	for (int i = 0; i < ALLOC_SLOTS; i++) {
+		fs->alloc.mags[i].free_inodes_delta = 0;
+		fs->alloc.mags[i].free_blks_delta = 0;
+	}
+	if (free_inodes == fs->sb->free_inodes_count && free_blks == fs->sb->free_data_blocks_count) {
+		return false;
+	}
+	fs->sb->free_inodes_count = free_inodes;
+	fs->sb->free_data_blocks_count = free_blks;
+	return true;
+}
@@ -0,0 +1,116 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Inode and block allocation magazines header file.
+ *
+ * Each thread that allocates gets a magazine: a few free inode numbers and a
+ * run of free blocks found by one batched scan of the bitmaps, so that most
+ * allocations don't scan at all and concurrent creates of different threads
+ * land in different parts of the image. Entries are only hints - the bitmaps
+ * stay authoritative and a bit is set when an entry is handed out - so one
+ * thread can take an entry cached by another, and nothing is lost on a crash.
+ *
+ * The free inode and block counts are kept as per-thread deltas and folded
+ * into the superblock on statfs, fsync and unmount instead of rewriting the
+ * superblock on every allocation. The counts on the image are recomputed from
+ * the bitmaps at mount. All functions must be called with the fs lock held.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+struct fs_ctx;
+
+
+/** Number of magazines; threads beyond this share them. */
+#define ALLOC_SLOTS 16
+
+/** Free inode numbers cached per magazine. */
+#define ALLOC_MAG_INODES 32
+
+/** Longest run of free blocks cached per magazine. */
+#define ALLOC_RUN_BLKS 64
+
+
+/** Free inodes and blocks cached for one thread. */
+typedef struct alloc_magazine {
+	/** Free inode numbers, taken from the end. */
+	a1fs_ino_t inodes[ALLOC_MAG_INODES];
+	unsigned inode_count;
+	/** Run of free blocks, taken from the start. */
+	a1fs_blk_t run_start, run_count;
+	/** Changes to the free counts not yet folded into the superblock. */
+	int64_t free_inodes_delta, free_blks_delta;
+} alloc_magazine;
+
+/** Runtime state of the allocator. */
+typedef struct alloc_state {
+	alloc_magazine mags[ALLOC_SLOTS];
+	/** Where the next refill scans start, so that refills take disjoint ranges. */
+	a1fs_ino_t inode_cursor;
+	a1fs_blk_t blk_cursor;
+} alloc_state;
+
+/**
+ * Initialize the allocator. Must be called after journal replay; recomputes
+ * the free counts in the superblock from the bitmaps.
+ */
+void alloc_init(struct fs_ctx *fs);
+
+/**
+ * Get a free inode number from the magazine of the calling thread. The bit is
+ * not set.
+ *
+ * @return  inode number on success; -ENOSPC if there are no free inodes.
+ */
+int alloc_pop_ino(struct fs_ctx *fs);
+
+/**
+ * Cache an inode number that was just freed in the magazine of the calling
+ * thread.
+ */
+void alloc_push_ino(struct fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Get a free data block number from the magazine of the calling thread. The
+ * bit is not set. Blocks freed by the running journal transaction are skipped.
+ *
+ * @return  data block number on success; -ENOSPC if there are no free blocks.
+ */
+int alloc_pop_blk(struct fs_ctx *fs);
+
+/**
+ * Record allocated (negative) or freed (positive) inodes and data blocks in
+ * the deltas of the calling thread.
+ */
+void alloc_count(struct fs_ctx *fs, int inodes, int blks);
+
+/** Get the number of free inodes, including deltas not yet folded. */
+a1fs_ino_t alloc_free_inodes(struct fs_ctx *fs);
+
+/** Get the number of free data blocks, including deltas not yet folded. */
+a1fs_blk_t alloc_free_blks(struct fs_ctx *fs);
+
+/**
+ * Fold the deltas of all threads into the superblock. The caller records the
+ * superblock change.
+ *
+ * @return  true if the superblock changed; false if there were no deltas.
+ */
+bool alloc_fold(struct fs_ctx *fs);
@@ -0,0 +1,153 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Set of block numbers implementation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "blkset.h"
+
+
+static size_t slot_of(const blkset *set, a1fs_blk_t blk)
+{
+	// Fibonacci hashing spreads consecutive block numbers across the table
+	return (size_t)(((uint64_t)blk * 0x9E3779B97F4A7C15ull) >> 32) & (set->cap - 1);
+}
+
+static bool grow(blkset *set)
+{
+	size_t new_cap = set->cap ? set->cap * 2 : 64;
+	a1fs_blk_t *new_slots = calloc(new_cap, sizeof(a1fs_blk_t));
+	if (!new_slots) {
+		return false;
+	}
+
+	a1fs_blk_t *old_slots = set->slots;
+	size_t old_cap = set->cap;
+	set->slots = new_slots;
+	set->cap = new_cap;
+	for (size_t i = 0; i < old_cap; i++) {
+		if (old_slots[i]) {
+			size_t j = slot_of(set, old_slots[i] - 1);
+			while (set->slots[j]) {
+				j = (j + 1) & (set->cap - 1);
+			}
+			set->slots[j] = old_slots[i];
+		}
+	}
+	free(old_slots);
+	return true;
+}
+
+
+void blkset_init(blkset *set)
+{
+	memset(set, 0, sizeof(*set));
+}
+
+void blkset_destroy(blkset *set)
+{
+	free(set->slots);
+	memset(set, 0, sizeof(*set));
+}
+
+void blkset_clear(blkset *set)
+{
+	if (set->count) {
+		memset(set->slots, 0, set->cap * sizeof(a1fs_blk_t));
+		set->count = 0;
+	}
+}
+
+bool blkset_add(blkset *set, a1fs_blk_t blk)
+{
+	// Keep the load factor under 1/2
+	if ((set->count + 1) * 2 > set->cap && !grow(set)) {
+		return false;
+	}
+	size_t i = slot_of(set, blk);
+	while (set->slots[i]) {
+		if (set->slots[i] == blk + 1) {
+			return false;
+		}
+		i = (i + 1) & (set->cap - 1);
+	}
+	set->slots[i] = blk + 1;
+	set->count++;
+	return true;
+}
+
+bool blkset_contains(const blkset *set, a1fs_blk_t blk)
+{
+	if (!set->count) {
+		return false;
+	}
+	size_t i = slot_of(set, blk);
+	while (set->slots[i]) {
+		if (set->slots[i] == blk + 1) {
+			return true;
+		}
+		i = (i + 1) & (set->cap - 1);
+	}
+	return false;
+}
+
+bool blkset_remove(blkset *set, a1fs_blk_t blk)
+{
+	if (!set->count) {
+		return false;
+	}
+	size_t i = slot_of(set, blk);
+	while (set->slots[i] != blk + 1) {
+		if (!set->slots[i]) {
+			return false;
+		}
+		i = (i + 1) & (set->cap - 1);
+	}
+
+	// Backward-shift deletion: move later entries of the probe run into the hole
+	size_t hole = i;
+	for (size_t j = (i + 1) & (set->cap - 1); set->slots[j]; j = (j + 1) & (set->cap - 1)) {
+		size_t home = slot_of(set, set->slots[j] - 1);
+		// Entry at j can fill the hole if its home slot is not in (hole, j]
+		if (((j - home) & (set->cap - 1)) >= ((j - hole) & (set->cap - 1))) {
+			set->slots[hole] = set->slots[j];
+			hole = j;
+		}
+	}
+	set->slots[hole] = 0;
+	set->count--;
+	return true;
+}
+
+static int cmp_blk(const void *a, const void *b)
+{
+	a1fs_blk_t x = *(const a1fs_blk_t *)a, y = *(const a1fs_blk_t *)b;
+	return (x > y) - (x < y);
+}
+
+size_t blkset_to_sorted_array(const blkset *set, a1fs_blk_t *out)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < set->cap; i++) {
+		if (set->slots[i]) {
+			out[n++] = set->slots[i] - 1;
+		}
+	}
+	qsort(out, n, sizeof(a1fs_blk_t), cmp_blk);
+	return n;
+}
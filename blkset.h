@@ -0,0 +1,70 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Set of block numbers header file.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "a1fs.h"
+
+
+/** Hash set of block numbers (open addressing, linear probing). */
+typedef struct blkset {
+	/** Slots hold block number + 1; 0 marks an empty slot. */
+	a1fs_blk_t *slots;
+	/** Number of slots, always a power of 2 (0 before the first insertion). */
+	size_t cap;
+	/** Number of block numbers in the set. */
+	size_t count;
+} blkset;
+
+/** Initialize an empty set. */
+void blkset_init(blkset *set);
+
+/** Free the memory used by the set. */
+void blkset_destroy(blkset *set);
+
+/** Remove all block numbers from the set. */
+void blkset_clear(blkset *set);
+
+/**
+ * Add a block number to the set.
+ *
+ * @return  true if the block was added; false if it was already in the set or
+ *          memory allocation failed.
+ */
+bool blkset_add(blkset *set, a1fs_blk_t blk);
+
+/** Check if the set contains a block number. */
+bool blkset_contains(const blkset *set, a1fs_blk_t blk);
+
+/**
+ * Remove a block number from the set.
+ *
+ * @return  true if the block was in the set.
+ */
+bool blkset_remove(blkset *set, a1fs_blk_t blk);
+
+/**
+ * Copy the block numbers into an array in ascending order.
+ *
+ * @param out  array of at least set->count elements.
+ * @return     number of block numbers copied.
+ */
+size_t blkset_to_sorted_array(const blkset *set, a1fs_blk_t *out);
@@ -0,0 +1,826 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Block cache storage backend implementation.
+ */
+
+// for sync_file_range()
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "fs_ctx.h"
+#include "uring.h"
+
+
+/** Bytes in a chunk; chunks are aligned to their size. */
+#define CHUNK_BYTES (CACHE_CHUNK_BLKS * A1FS_BLOCK_SIZE)
+/** Number of Am slots looked at for a data block before evicting metadata. */
+#define AM_SCAN 16
+/** Number of zero blocks written at once. */
+#define ZERO_BLKS 16
+
+
+int cache_pio(int fd, void *buf, size_t len, off_t off, bool write)
+{
+	while (len > 0) {
+		ssize_t n = write ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			perror(write ? "pwrite" : "pread");
+			return -1;
+		}
+		if (n == 0) {
+			// Past the end of the image
+			memset(buf, 0, len);
+			return 0;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static off_t blk_off(a1fs_blk_t blk)
+{
+	return (off_t)blk * A1FS_BLOCK_SIZE;
+}
+
+
+/* pread()/pwrite() engine */
+static int pio_rw(fs_ctx *fs, const cache_req *reqs, size_t n, bool write)
+{
+	int ret = 0;
+	for (size_t i = 0; i < n; i++) {
+		ret |= cache_pio(fs->fd, reqs[i].buf, reqs[i].len, reqs[i].off, write);
+	}
+	return ret;
+}
+
+static const cache_io pio_io = {
+	.name         = "pread",
+	.init         = NULL,
+	.destroy      = NULL,
+	.bufs_changed = NULL,
+	.rw           = pio_rw,
+};
+
+
+/* Request batches */
+typedef struct req_batch {
+	cache_req *reqs;
+	size_t n, cap;
+} req_batch;
+
+static void redirty(fs_ctx *fs, const cache_req *req);
+
+/** Add a request to a batch; performs it right away if out of memory. */
+static void batch_add(fs_ctx *fs, req_batch *b, void *buf, size_t len, off_t off,
+                      int buf_index, bool write, int *ret)
+{
+	cache_req req = {buf, len, off, buf_index};
+	if (b->n == b->cap) {
+		size_t cap = b->cap ? b->cap * 2 : 16;
+		cache_req *reqs = realloc(b->reqs, cap * sizeof(cache_req));
+		if (!reqs) {
+			if (fs->cache.io->rw(fs, &req, 1, write) < 0) {
+				*ret = -1;
+				if (write) {
+					redirty(fs, &req);
+				}
+			}
+			return;
+		}
+		b->reqs = reqs;
+		b->cap = cap;
+	}
+	b->reqs[b->n++] = req;
+}
+
+/**
+ * Perform all requests in a batch and free it. Which writes of a failed batch
+ * failed isn't known, so the cached blocks of all of them are dirty again.
+ */
+static int batch_run(fs_ctx *fs, req_batch *b, bool write)
+{
+	int ret = (b->n > 0) ? fs->cache.io->rw(fs, b->reqs, b->n, write) : 0;
+	for (size_t k = 0; ret < 0 && write && k < b->n; k++) {
+		redirty(fs, &b->reqs[k]);
+	}
+	free(b->reqs);
+	return ret;
+}
+
+static int slot_rw(fs_ctx *fs, cache_slot *s, bool write)
+{
+	cache_req req = {s->data, A1FS_BLOCK_SIZE, blk_off(s->blk), s->buf_index};
+	return fs->cache.io->rw(fs, &req, 1, write);
+}
+
+/**
+ * Read a block into its slot. On error the slot is zeroed rather than left
+ * with whatever block it held before, and read again on its next use.
+ */
+static void slot_read(fs_ctx *fs, cache_slot *s)
+{
+	s->valid = slot_rw(fs, s, false) == 0;
+	if (!s->valid) {
+		memset(s->data, 0, A1FS_BLOCK_SIZE);
+	}
+}
+
+
+/* Queues */
+static void q_init(cache_queue *q)
+{
+	q->head = q->tail = -1;
+	q->len = 0;
+}
+
+static void q_push(block_cache *c, cache_queue *q, int i)
+{
+	cache_slot *s = &c->slots[i];
+	s->prev = -1;
+	s->next = q->head;
+	if (q->head >= 0) {
+		c->slots[q->head].prev = i;
+	} else {
+		q->tail = i;
+	}
+	q->head = i;
+	q->len++;
+}
+
+static void q_remove(block_cache *c, cache_queue *q, int i)
+{
+	cache_slot *s = &c->slots[i];
+	if (s->prev >= 0) {
+		c->slots[s->prev].next = s->next;
+	} else {
+		q->head = s->next;
+	}
+	if (s->next >= 0) {
+		c->slots[s->next].prev = s->prev;
+	} else {
+		q->tail = s->prev;
+	}
+	q->len--;
+}
+
+static cache_queue *queue_of(block_cache *c, int i)
+{
+	switch (c->slots[i].queue) {
+		case CACHE_A1IN: return &c->a1in;
+		case CACHE_AM:   return &c->am;
+		default:         return &c->free;
+	}
+}
+
+static void move_to(block_cache *c, int i, unsigned char queue)
+{
+	q_remove(c, queue_of(c, i), i);
+	c->slots[i].queue = queue;
+	q_push(c, queue_of(c, i), i);
+}
+
+
+/* Hash table */
+static int *hash_head(block_cache *c, a1fs_blk_t blk)
+{
+	return &c->hash[(uint32_t)(blk * 2654435769u) >> (32 - c->hash_bits)];
+}
+
+static int hash_find(block_cache *c, a1fs_blk_t blk)
+{
+	for (int i = *hash_head(c, blk); i >= 0; i = c->slots[i].hnext) {
+		if (c->slots[i].blk == blk) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void hash_remove(block_cache *c, int i)
+{
+	for (int *p = hash_head(c, c->slots[i].blk); *p >= 0; p = &c->slots[*p].hnext) {
+		if (*p == i) {
+			*p = c->slots[i].hnext;
+			return;
+		}
+	}
+}
+
+
+/* Ghost list (A1out) */
+static void ghost_add(block_cache *c, a1fs_blk_t blk)
+{
+	if (c->ghost_cap == 0) {
+		return;
+	}
+	a1fs_blk_t old = c->ghost[c->ghost_pos];
+	if (old != (a1fs_blk_t)-1) {
+		blkset_remove(&c->ghost_set, old);
+	}
+	c->ghost[c->ghost_pos] = blk;
+	c->ghost_pos = (c->ghost_pos + 1) % c->ghost_cap;
+	blkset_add(&c->ghost_set, blk);
+}
+
+static bool ghost_take(block_cache *c, a1fs_blk_t blk)
+{
+	return blkset_remove(&c->ghost_set, blk);
+}
+
+
+/* Slots */
+static bool grow(fs_ctx *fs)
+{
+	block_cache *c = &fs->cache;
+	void *data = aligned_alloc(CHUNK_BYTES, CHUNK_BYTES);
+	cache_slot *slots = realloc(c->slots, (c->slots_count + CACHE_CHUNK_BLKS) * sizeof(cache_slot));
+	cache_chunk *chunks = realloc(c->chunks, (c->chunks_count + 1) * sizeof(cache_chunk));
+	if (slots) {
+		c->slots = slots;
+	}
+	if (chunks) {
+		c->chunks = chunks;
+	}
+	if (!data || !slots || !chunks) {
+		free(data);
+		return false;
+	}
+
+	// Keep chunks sorted by address for blk_of()
+	size_t pos = c->chunks_count;
+	while (pos > 0 && c->chunks[pos - 1].data > data) {
+		c->chunks[pos] = c->chunks[pos - 1];
+		pos--;
+	}
+	int buf_index = c->chunks_count + 1;
+	c->chunks[pos].data = data;
+	c->chunks[pos].first_slot = c->slots_count;
+	c->chunks[pos].buf_index = buf_index;
+	c->chunks_count++;
+
+	for (size_t k = 0; k < CACHE_CHUNK_BLKS; k++) {
+		int i = c->slots_count++;
+		cache_slot *s = &c->slots[i];
+		s->data = data + k * A1FS_BLOCK_SIZE;
+		s->hnext = -1;
+		s->queue = CACHE_FREE;
+		s->dirty = false;
+		s->valid = false;
+		s->meta = false;
+		s->pin = c->epoch - 1;
+		s->buf_index = buf_index;
+		q_push(c, &c->free, i);
+	}
+	if (c->io->bufs_changed) {
+		c->io->bufs_changed(fs);
+	}
+	return true;
+}
+
+static int unpinned_from_tail(block_cache *c, cache_queue *q, bool data_only, size_t limit)
+{
+	size_t n = 0;
+	for (int i = q->tail; i >= 0 && n < limit; i = c->slots[i].prev, n++) {
+		cache_slot *s = &c->slots[i];
+		if (s->pin != c->epoch && !(data_only && s->meta)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/** Choose a slot to evict; -1 if all cached blocks are pinned. */
+static int victim(block_cache *c)
+{
+	size_t kin = c->cap / 4;
+	int i = -1;
+	if (c->a1in.len > kin || c->am.len == 0) {
+		i = unpinned_from_tail(c, &c->a1in, false, SIZE_MAX);
+	}
+	if (i < 0) {
+		i = unpinned_from_tail(c, &c->am, true, AM_SCAN);
+	}
+	if (i < 0) {
+		i = unpinned_from_tail(c, &c->am, false, SIZE_MAX);
+	}
+	if (i < 0) {
+		i = unpinned_from_tail(c, &c->a1in, false, SIZE_MAX);
+	}
+	return i;
+}
+
+/**
+ * Remove a block from the cache, writing it back first if needed.
+ *
+ * @return  0 on success; -1 if the block couldn't be written, in which case it
+ *          stays cached and dirty.
+ */
+static int evict(fs_ctx *fs, int i, bool writeback)
+{
+	block_cache *c = &fs->cache;
+	cache_slot *s = &c->slots[i];
+	if (writeback && s->dirty && slot_rw(fs, s, true) < 0) {
+		return -1;
+	}
+	if (writeback && s->queue == CACHE_A1IN) {
+		ghost_add(c, s->blk);
+	}
+	hash_remove(c, i);
+	move_to(c, i, CACHE_FREE);
+	s->dirty = false;
+	s->valid = false;
+	s->meta = false;
+	return 0;
+}
+
+static int alloc_slot(fs_ctx *fs)
+{
+	block_cache *c = &fs->cache;
+	size_t used = c->a1in.len + c->am.len;
+	if (used >= c->cap) {
+		int i = victim(c);
+		// Grow instead of losing a block that can't be written back
+		if (i >= 0 && evict(fs, i, true) == 0) {
+			return i;
+		}
+	}
+	if (c->free.len == 0 && !grow(fs)) {
+		fprintf(stderr, "Out of memory for the block cache\n");
+		abort();
+	}
+	return c->free.tail;
+}
+
+
+/* Backend operations */
+static bool open_with(fs_ctx *fs, const a1fs_opts *opts, const cache_io *io)
+{
+	block_cache *c = &fs->cache;
+	memset(c, 0, sizeof(*c));
+	c->io = &pio_io;
+	q_init(&c->a1in);
+	q_init(&c->am);
+	q_init(&c->free);
+	blkset_init(&c->ghost_set);
+
+	// All transfers are whole blocks to and from block-aligned memory, which
+	// is what O_DIRECT requires
+	fs->fd = open(opts->img_path, O_RDWR | (opts->odirect ? O_DIRECT : 0));
+	if (fs->fd < 0 && opts->odirect && errno == EINVAL) {
+		fprintf(stderr, "%s: O_DIRECT is not supported, using buffered I/O\n",
+		        opts->img_path);
+		fs->fd = open(opts->img_path, O_RDWR);
+	}
+	if (fs->fd < 0) {
+		perror(opts->img_path);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fs->fd, &st) < 0) {
+		perror("fstat");
+		goto fail;
+	}
+	if (st.st_size == 0 || st.st_size % A1FS_BLOCK_SIZE != 0) {
+		fprintf(stderr, "Image file size is not a multiple of block size\n");
+		goto fail;
+	}
+	fs->size = st.st_size;
+
+	// Find out how large the metadata region is; an invalid superblock is
+	// reported by fs_ctx_init()
+	c->meta = aligned_alloc(A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE);
+	if (!c->meta) {
+		perror("malloc");
+		goto fail;
+	}
+	if (cache_pio(fs->fd, c->meta, A1FS_BLOCK_SIZE, 0, false) < 0) {
+		goto fail;
+	}
+	const a1fs_superblock *sb = c->meta;
+	c->meta_count = 1;
+	if (sb->magic == A1FS_MAGIC && sb->first_data_blk > 0 &&
+	    sb->first_data_blk <= fs->size / A1FS_BLOCK_SIZE) {
+		c->meta_count = sb->first_data_blk;
+	}
+	free(c->meta);
+	c->meta = aligned_alloc(A1FS_BLOCK_SIZE, (size_t)c->meta_count * A1FS_BLOCK_SIZE);
+	c->meta_dirty = calloc(c->meta_count, 1);
+	if (!c->meta || !c->meta_dirty) {
+		perror("malloc");
+		goto fail;
+	}
+	if (cache_pio(fs->fd, c->meta, (size_t)c->meta_count * A1FS_BLOCK_SIZE, 0, false) < 0) {
+		goto fail;
+	}
+
+	c->cap = (size_t)opts->cache_size * (1024 * 1024 / A1FS_BLOCK_SIZE);
+	if (c->cap < CACHE_CHUNK_BLKS) {
+		c->cap = CACHE_CHUNK_BLKS;
+	}
+	c->hash_bits = 6;
+	while (((size_t)1 << c->hash_bits) < 2 * c->cap && c->hash_bits < 31) {
+		c->hash_bits++;
+	}
+	c->hash = malloc(((size_t)1 << c->hash_bits) * sizeof(int));
+	c->ghost_cap = c->cap / 2;
+	c->ghost = malloc(c->ghost_cap * sizeof(a1fs_blk_t));
+	if (!c->hash || !c->ghost) {
+		perror("malloc");
+		goto fail;
+	}
+	memset(c->hash, -1, ((size_t)1 << c->hash_bits) * sizeof(int));
+	memset(c->ghost, -1, c->ghost_cap * sizeof(a1fs_blk_t));
+
+	if (io != &pio_io) {
+		c->io = io;
+		if (!io->init(fs)) {
+			fprintf(stderr, "Can't use %s, falling back to pread\n", io->name);
+			c->io = &pio_io;
+		}
+	}
+	return true;
+
+fail:
+	free(c->meta);
+	free(c->meta_dirty);
+	free(c->hash);
+	free(c->ghost);
+	blkset_destroy(&c->ghost_set);
+	close(fs->fd);
+	fs->fd = -1;
+	return false;
+}
+
+static bool cache_open(fs_ctx *fs, const a1fs_opts *opts)
+{
+	return open_with(fs, opts, &pio_io);
+}
+
+static bool uring_open(fs_ctx *fs, const a1fs_opts *opts)
+{
+	return open_with(fs, opts, &uring_io);
+}
+
+static int cache_flush(fs_ctx *fs, a1fs_blk_t blk, size_t count, int flags);
+
+static void cache_close(fs_ctx *fs)
+{
+	block_cache *c = &fs->cache;
+	cache_flush(fs, 0, fs->size / A1FS_BLOCK_SIZE, MS_SYNC);
+	if (c->io->destroy) {
+		c->io->destroy(fs);
+	}
+	for (size_t k = 0; k < c->chunks_count; k++) {
+		free(c->chunks[k].data);
+	}
+	free(c->chunks);
+	free(c->slots);
+	free(c->hash);
+	free(c->ghost);
+	blkset_destroy(&c->ghost_set);
+	free(c->meta);
+	free(c->meta_dirty);
+	close(fs->fd);
+	fs->fd = -1;
+}
+
+/** Put a block into a new pinned slot; the caller reads its contents. */
+static int insert(fs_ctx *fs, a1fs_blk_t blk, int flags)
+{
+	block_cache *c = &fs->cache;
+	int i = alloc_slot(fs);
+	cache_slot *s = &c->slots[i];
+	s->blk = blk;
+	s->dirty = false;
+	s->valid = false;
+	s->meta = (flags & STORAGE_META) != 0;
+	s->pin = c->epoch;
+
+	s->hnext = *hash_head(c, blk);
+	*hash_head(c, blk) = i;
+	move_to(c, i, (s->meta || ghost_take(c, blk)) ? CACHE_AM : CACHE_A1IN);
+	return i;
+}
+
+static void *cache_get(fs_ctx *fs, a1fs_blk_t blk, int flags)
+{
+	block_cache *c = &fs->cache;
+	if (blk < c->meta_count) {
+		return c->meta + (size_t)blk * A1FS_BLOCK_SIZE;
+	}
+
+	int i = hash_find(c, blk);
+	if (i >= 0) {
+		cache_slot *s = &c->slots[i];
+		s->pin = c->epoch;
+		s->meta |= (flags & STORAGE_META) != 0;
+		// 2Q: a hit in A1in doesn't count as reuse, except for metadata
+		if (s->queue == CACHE_AM || s->meta) {
+			move_to(c, i, CACHE_AM);
+		}
+		// Retry a failed read unless the zeros were written over since
+		if (!s->valid && !s->dirty) {
+			slot_read(fs, s);
+		}
+		return s->data;
+	}
+
+	i = insert(fs, blk, flags);
+	slot_read(fs, &c->slots[i]);
+	return c->slots[i].data;
+}
+
+static void cache_prefetch(fs_ctx *fs, const storage_run *runs, size_t n)
+{
+	block_cache *c = &fs->cache;
+	// Don't let a single read push out more than the A1in share of the cache
+	size_t budget = c->cap / 4;
+
+	req_batch b = {0};
+	int ret = 0;
+	for (size_t r = 0; r < n && budget > 0; r++) {
+		a1fs_blk_t blk = runs[r].blk;
+		size_t count = (runs[r].count < budget) ? runs[r].count : budget;
+		budget -= count;
+		for (a1fs_blk_t end = blk + count; blk < end; blk++) {
+			if (blk < c->meta_count || hash_find(c, blk) >= 0) {
+				continue;
+			}
+			int i = insert(fs, blk, 0);
+			cache_slot *s = &c->slots[i];
+			batch_add(fs, &b, s->data, A1FS_BLOCK_SIZE, blk_off(blk), s->buf_index, false, &ret);
+		}
+	}
+	if (b.n > 0) {
+		ret |= c->io->rw(fs, b.reqs, b.n, false);
+	}
+	// Which requests failed isn't known; drop all of them so that they are
+	// read again when used
+	for (size_t k = 0; k < b.n; k++) {
+		int i = hash_find(c, b.reqs[k].off / A1FS_BLOCK_SIZE);
+		if (ret < 0) {
+			evict(fs, i, false);
+		} else {
+			c->slots[i].valid = true;
+		}
+	}
+	free(b.reqs);
+}
+
+static a1fs_blk_t cache_blk_of(fs_ctx *fs, const void *ptr)
+{
+	block_cache *c = &fs->cache;
+	if (ptr >= c->meta && ptr < c->meta + (size_t)c->meta_count * A1FS_BLOCK_SIZE) {
+		return (ptr - c->meta) / A1FS_BLOCK_SIZE;
+	}
+
+	const void *base = (const void *)((uintptr_t)ptr & ~(uintptr_t)(CHUNK_BYTES - 1));
+	size_t lo = 0, hi = c->chunks_count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (c->chunks[mid].data < base) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	assert(lo < c->chunks_count && c->chunks[lo].data == base);
+	size_t i = c->chunks[lo].first_slot + (ptr - base) / A1FS_BLOCK_SIZE;
+	return c->slots[i].blk;
+}
+
+static void cache_dirty(fs_ctx *fs, a1fs_blk_t blk)
+{
+	block_cache *c = &fs->cache;
+	if (blk < c->meta_count) {
+		c->meta_dirty[blk] = 1;
+		return;
+	}
+	int i = hash_find(c, blk);
+	if (i >= 0) {
+		c->slots[i].dirty = true;
+	}
+}
+
+/** Mark the cached blocks written by a failed request dirty again. */
+static void redirty(fs_ctx *fs, const cache_req *req)
+{
+	// Zeros written straight to the file have no cached blocks
+	if (req->buf_index < 0) {
+		return;
+	}
+	a1fs_blk_t blk = req->off / A1FS_BLOCK_SIZE;
+	for (size_t k = 0; k < req->len / A1FS_BLOCK_SIZE; k++) {
+		cache_dirty(fs, blk + k);
+	}
+}
+
+static void cache_zero(fs_ctx *fs, a1fs_blk_t blk, size_t count)
+{
+	// Aligned for O_DIRECT
+	static const char zeros[ZERO_BLKS * A1FS_BLOCK_SIZE]
+		__attribute__((aligned(A1FS_BLOCK_SIZE)));
+	block_cache *c = &fs->cache;
+
+	for (; count > 0 && blk < c->meta_count; blk++, count--) {
+		memset(cache_get(fs, blk, 0), 0, A1FS_BLOCK_SIZE);
+		c->meta_dirty[blk] = 1;
+	}
+	// New blocks are usually written right away, so keep them as dirty zero
+	// slots instead of writing zeros and reading them back; as with a read,
+	// up to the A1in share of the cache
+	size_t budget = c->cap / 4;
+	for (; count > 0; blk++, count--) {
+		int i = hash_find(c, blk);
+		if (i < 0) {
+			if (budget == 0) {
+				break;
+			}
+			budget--;
+			i = insert(fs, blk, 0);
+		}
+		cache_slot *s = &c->slots[i];
+		memset(s->data, 0, A1FS_BLOCK_SIZE);
+		s->valid = true;
+		s->dirty = true;
+	}
+	if (count == 0) {
+		return;
+	}
+
+	// Write zeros to the file directly for the rest
+	req_batch b = {0};
+	int ret = 0;
+	for (a1fs_blk_t k = blk, left = count; left > 0;) {
+		size_t n = (left < ZERO_BLKS) ? left : ZERO_BLKS;
+		batch_add(fs, &b, (void *)zeros, n * A1FS_BLOCK_SIZE, blk_off(k), -1, true, &ret);
+		k += n;
+		left -= n;
+	}
+	ret |= batch_run(fs, &b, true);
+	// Cached copies are stale; if the zeros didn't make it to the file, keep
+	// them in the cache so that a flush retries and reports the error
+	for (size_t k = 0; k < count; k++) {
+		int i = hash_find(c, blk + k);
+		if (ret < 0) {
+			if (i < 0) {
+				i = insert(fs, blk + k, 0);
+				c->slots[i].pin = c->epoch - 1;
+			}
+			memset(c->slots[i].data, 0, A1FS_BLOCK_SIZE);
+			c->slots[i].valid = true;
+			c->slots[i].dirty = true;
+		} else if (i >= 0) {
+			evict(fs, i, false);
+		}
+	}
+}
+
+static int cache_sync(fs_ctx *fs)
+{
+	if (fdatasync(fs->fd) < 0) {
+		perror("fdatasync");
+		return -1;
+	}
+	return 0;
+}
+
+static int cache_flush(fs_ctx *fs, a1fs_blk_t blk, size_t count, int flags)
+{
+	block_cache *c = &fs->cache;
+	a1fs_blk_t end = blk + count;
+	req_batch b = {0};
+	int ret = 0;
+
+	// Runs of dirty metadata blocks
+	for (a1fs_blk_t m = blk; m < end && m < c->meta_count;) {
+		if (!c->meta_dirty[m]) {
+			m++;
+			continue;
+		}
+		a1fs_blk_t run = 0;
+		while (m + run < end && m + run < c->meta_count && c->meta_dirty[m + run]) {
+			c->meta_dirty[m + run] = 0;
+			run++;
+		}
+		batch_add(fs, &b, c->meta + (size_t)m * A1FS_BLOCK_SIZE,
+		          (size_t)run * A1FS_BLOCK_SIZE, blk_off(m), 0, true, &ret);
+		m += run;
+	}
+
+	// Dirty cached blocks; look at whichever is smaller, the range or the cache
+	if (end > c->meta_count) {
+		if (count > c->slots_count) {
+			for (size_t i = 0; i < c->slots_count; i++) {
+				cache_slot *s = &c->slots[i];
+				if (s->dirty && s->blk >= blk && s->blk < end) {
+					s->dirty = false;
+					batch_add(fs, &b, s->data, A1FS_BLOCK_SIZE, blk_off(s->blk), s->buf_index, true, &ret);
+				}
+			}
+		} else {
+			for (a1fs_blk_t k = blk; k < end; k++) {
+				int i = hash_find(c, k);
+				if (i >= 0 && c->slots[i].dirty) {
+					cache_slot *s = &c->slots[i];
+					s->dirty = false;
+					batch_add(fs, &b, s->data, A1FS_BLOCK_SIZE, blk_off(k), s->buf_index, true, &ret);
+				}
+			}
+		}
+	}
+
+	// One batch for all dirty blocks in the range
+	ret |= batch_run(fs, &b, true);
+
+	if (flags & MS_SYNC) {
+		ret |= cache_sync(fs);
+	}
+#ifdef SYNC_FILE_RANGE_WRITE
+	else if (sync_file_range(fs->fd, blk_off(blk), blk_off(count), SYNC_FILE_RANGE_WRITE) < 0) {
+		perror("sync_file_range");
+		ret = -1;
+	}
+#endif
+	return ret;
+}
+
+static void cache_release(fs_ctx *fs)
+{
+	block_cache *c = &fs->cache;
+	c->epoch++;
+	// Give back memory used past the cache size while everything was pinned
+	while (c->a1in.len + c->am.len > c->cap) {
+		int i = victim(c);
+		if (i < 0) {
+			break;
+		}
+		if (evict(fs, i, true) < 0) {
+			break;
+		}
+		madvise(c->slots[i].data, A1FS_BLOCK_SIZE, MADV_DONTNEED);
+	}
+}
+
+const storage_ops cache_storage = {
+	.name     = "cache",
+	.stable   = false,
+	.open     = cache_open,
+	.close    = cache_close,
+	.get      = cache_get,
+	.blk_of   = cache_blk_of,
+	.dirty    = cache_dirty,
+	.zero     = cache_zero,
+	.flush    = cache_flush,
+	.sync     = cache_sync,
+	.prefetch = cache_prefetch,
+	.advise   = NULL,
+	.copy     = NULL,
+	.release  = cache_release,
+};
+
+const storage_ops uring_storage = {
+	.name     = "uring",
+	.stable   = false,
+	.open     = uring_open,
+	.close    = cache_close,
+	.get      = cache_get,
+	.blk_of   = cache_blk_of,
+	.dirty    = cache_dirty,
+	.zero     = cache_zero,
+	.flush    = cache_flush,
+	.sync     = cache_sync,
+	.prefetch = cache_prefetch,
+	.advise   = NULL,
+	.copy     = NULL,
+	.release  = cache_release,
+};
@@ -0,0 +1,171 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Block cache storage backend header file.
+ *
+ * Reads and writes the image file with pread()/pwrite() through a user-space
+ * cache of a configurable number of blocks, instead of mapping the whole
+ * image. The metadata region is always resident. Other blocks are managed
+ * with 2Q replacement: blocks seen once go through a small FIFO queue (A1in)
+ * so that a large sequential read doesn't flush the cache, blocks evicted from
+ * it are remembered (A1out), and blocks hit again go to an LRU queue (Am).
+ * Extent and directory blocks skip A1in and are evicted from Am last.
+ *
+ * Blocks used by the current fs lock holder are pinned; if all blocks are
+ * pinned the cache grows past its size until the lock is released.
+ *
+ * The cache reads and writes the image file in batches through an I/O engine:
+ * plain pread()/pwrite() calls, or io_uring (see uring.h).
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "a1fs.h"
+#include "blkset.h"
+#include "storage.h"
+
+struct fs_ctx;
+
+
+/** Number of blocks allocated at once when the cache grows. */
+#define CACHE_CHUNK_BLKS 64
+
+/** Cache slot queues. */
+enum { CACHE_FREE, CACHE_A1IN, CACHE_AM };
+
+/** A cached block. */
+typedef struct cache_slot {
+	/** Block number. */
+	a1fs_blk_t blk;
+	/** Block contents. */
+	void *data;
+	/** Next slot in the hash chain; -1 if none. */
+	int hnext;
+	/** Neighbours in the queue; -1 if none. */
+	int prev, next;
+	/** Queue the slot is on. */
+	unsigned char queue;
+	/** Whether the block was changed since it was last written. */
+	bool dirty;
+	/** Whether data holds the block contents; false if reading it failed. */
+	bool valid;
+	/** Whether the block holds metadata. */
+	bool meta;
+	/** Pinned if equal to the cache epoch. */
+	unsigned pin;
+	/** Registered buffer index of the slot memory, see cache_req. */
+	int buf_index;
+} cache_slot;
+
+/** Doubly linked list of slots; head is the most recently inserted. */
+typedef struct cache_queue {
+	int head, tail;
+	size_t len;
+} cache_queue;
+
+/** Memory holding CACHE_CHUNK_BLKS consecutive slots. */
+typedef struct cache_chunk {
+	void *data;
+	size_t first_slot;
+	/** Registered buffer index; chunks are numbered from 1 in allocation order. */
+	int buf_index;
+} cache_chunk;
+
+/** One read or write of the image file. */
+typedef struct cache_req {
+	void *buf;
+	size_t len;
+	off_t off;
+	/**
+	 * Index of the cache memory region that contains buf, for I/O engines that
+	 * register buffers: 0 for the metadata region, cache_chunk.buf_index for a
+	 * chunk; -1 for other memory.
+	 */
+	int buf_index;
+} cache_req;
+
+/** How the block cache reads and writes the image file. */
+typedef struct cache_io {
+	/** Engine name for messages. */
+	const char *name;
+	/**
+	 * Set up the engine once the image file is open; NULL if not needed.
+	 *
+	 * @return  true on success; false if the engine can't be used.
+	 */
+	bool (*init)(struct fs_ctx *fs);
+	/** Release engine resources; NULL if not needed. */
+	void (*destroy)(struct fs_ctx *fs);
+	/** Called when chunks were added to the cache; NULL if not needed. */
+	void (*bufs_changed)(struct fs_ctx *fs);
+	/**
+	 * Perform a batch of reads or writes and wait for all of them. Reads past
+	 * the end of the file return zeros.
+	 *
+	 * @return  0 on success; -1 if any request failed.
+	 */
+	int (*rw)(struct fs_ctx *fs, const cache_req *reqs, size_t n, bool write);
+} cache_io;
+
+/** Runtime state of the block cache. */
+typedef struct block_cache {
+	/** Resident blocks from the superblock up to the first data block. */
+	void *meta;
+	a1fs_blk_t meta_count;
+	/** Dirty flag of each metadata block. */
+	unsigned char *meta_dirty;
+
+	/** Cache size in blocks. */
+	size_t cap;
+	cache_slot *slots;
+	size_t slots_count;
+	/** Chunks sorted by address. */
+	cache_chunk *chunks;
+	size_t chunks_count;
+	/** Hash table of slot chains indexed by block number. */
+	int *hash;
+	unsigned hash_bits;
+	cache_queue a1in, am, free;
+
+	/** Ring of blocks recently evicted from A1in. */
+	a1fs_blk_t *ghost;
+	size_t ghost_cap, ghost_pos;
+	blkset ghost_set;
+
+	/** Incremented each time the fs lock is released. */
+	unsigned epoch;
+
+	/** I/O engine and its private state. */
+	const cache_io *io;
+	void *io_data;
+} block_cache;
+
+/** pread()/pwrite() backend with a block cache. */
+extern const storage_ops cache_storage;
+
+/** io_uring backend with a block cache. */
+extern const storage_ops uring_storage;
+
+/**
+ * Read or write a buffer with pread()/pwrite(), retrying short transfers.
+ * Reads past the end of the file return zeros.
+ *
+ * @return  0 on success; -1 on error.
+ */
+int cache_pio(int fd, void *buf, size_t len, off_t off, bool write);
@@ -0,0 +1,203 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Per-inode dirty block tracking implementation.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "dirty.h"
+#include "fs_ctx.h"
+
+
+static dirty_ino **bucket(fs_ctx *fs, a1fs_ino_t ino)
+{
+	return &fs->dirty.buckets[ino % DIRTY_BUCKETS];
+}
+
+static dirty_ino *find(fs_ctx *fs, a1fs_ino_t ino)
+{
+	for (dirty_ino *d = *bucket(fs, ino); d; d = d->next) {
+		if (d->ino == ino) {
+			return d;
+		}
+	}
+	return NULL;
+}
+
+static dirty_ino *find_or_add(fs_ctx *fs, a1fs_ino_t ino)
+{
+	dirty_ino *d = find(fs, ino);
+	if (d) {
+		return d;
+	}
+	d = malloc(sizeof(*d));
+	if (!d) {
+		return NULL;
+	}
+	d->ino = ino;
+	blkset_init(&d->data);
+	blkset_init(&d->meta);
+	d->next = *bucket(fs, ino);
+	*bucket(fs, ino) = d;
+	return d;
+}
+
+static void add_range(fs_ctx *fs, blkset *set, const void *ptr, size_t len)
+{
+	a1fs_blk_t first, last;
+	fs_ctx_blk_range(fs, ptr, len, &first, &last);
+	for (a1fs_blk_t blk = first; blk <= last; blk++) {
+		blkset_add(set, blk);
+	}
+}
+
+static void add_all(blkset *dst, const blkset *src)
+{
+	for (size_t i = 0; i < src->cap; i++) {
+		if (src->slots[i]) {
+			blkset_add(dst, src->slots[i] - 1);
+		}
+	}
+}
+
+
+void dirty_init(fs_ctx *fs)
+{
+	memset(&fs->dirty, 0, sizeof(fs->dirty));
+	blkset_init(&fs->dirty.op_meta);
+}
+
+void dirty_destroy(fs_ctx *fs)
+{
+	for (size_t i = 0; i < DIRTY_BUCKETS; i++) {
+		while (fs->dirty.buckets[i]) {
+			dirty_ino *d = fs->dirty.buckets[i];
+			fs->dirty.buckets[i] = d->next;
+			blkset_destroy(&d->data);
+			blkset_destroy(&d->meta);
+			free(d);
+		}
+	}
+	blkset_destroy(&fs->dirty.op_meta);
+}
+
+void dirty_meta(fs_ctx *fs, const void *ptr, size_t len)
+{
+	if (len > 0) {
+		add_range(fs, &fs->dirty.op_meta, ptr, len);
+	}
+}
+
+void dirty_data(fs_ctx *fs, a1fs_ino_t ino, a1fs_blk_t blk, size_t count)
+{
+	if (count == 0) {
+		return;
+	}
+	dirty_ino *d = find_or_add(fs, ino);
+	if (d) {
+		for (a1fs_blk_t b = blk; b < blk + count; b++) {
+			blkset_add(&d->data, b);
+		}
+	}
+}
+
+void dirty_end_op(fs_ctx *fs, int ino1, int ino2)
+{
+	blkset *op_meta = &fs->dirty.op_meta;
+	if (op_meta->count == 0) {
+		return;
+	}
+	int owners[2] = {ino1, ino2};
+	for (int i = 0; i < 2; i++) {
+		if (owners[i] < 0) {
+			continue;
+		}
+		dirty_ino *d = find_or_add(fs, owners[i]);
+		if (d) {
+			add_all(&d->meta, op_meta);
+		}
+	}
+	blkset_clear(op_meta);
+}
+
+void dirty_forget(fs_ctx *fs, a1fs_ino_t ino)
+{
+	for (dirty_ino **p = bucket(fs, ino); *p; p = &(*p)->next) {
+		if ((*p)->ino == ino) {
+			dirty_ino *d = *p;
+			*p = d->next;
+			blkset_destroy(&d->data);
+			blkset_destroy(&d->meta);
+			free(d);
+			return;
+		}
+	}
+}
+
+int dirty_sync(fs_ctx *fs, a1fs_ino_t ino)
+{
+	int ret = 0;
+	dirty_ino *d = find(fs, ino);
+
+	// Data first, so that committed metadata never points to stale data
+	if (d && fs_ctx_flush_set(fs, &d->data, MS_SYNC) < 0) {
+		ret = -EIO;
+	}
+	if (fs->journal.start) {
+		if (journal_commit(fs) < 0) {
+			ret = -EIO;
+		}
+	} else if (d && fs_ctx_flush_set(fs, &d->meta, MS_SYNC) < 0) {
+		ret = -EIO;
+	}
+
+	if (ret == 0) {
+		dirty_forget(fs, ino);
+	}
+	return ret;
+}
+
+void dirty_writeback(fs_ctx *fs, a1fs_ino_t ino)
+{
+	dirty_ino *d = find(fs, ino);
+	if (d) {
+		fs_ctx_flush_set(fs, &d->data, MS_ASYNC);
+	}
+}
+
+int dirty_sync_all(fs_ctx *fs)
+{
+	int ret = 0;
+	if (journal_commit(fs) < 0 || !journal_checkpoint(fs)) {
+		ret = -EIO;
+	}
+	if (fs_ctx_flush(fs, 0, fs->size / A1FS_BLOCK_SIZE, MS_SYNC) < 0) {
+		ret = -EIO;
+	}
+	if (ret < 0) {
+		return ret;
+	}
+
+	for (size_t i = 0; i < DIRTY_BUCKETS; i++) {
+		while (fs->dirty.buckets[i]) {
+			dirty_forget(fs, fs->dirty.buckets[i]->ino);
+		}
+	}
+	return 0;
+}
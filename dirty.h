@@ -0,0 +1,110 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Per-inode dirty block tracking header file.
+ *
+ * Remembers which blocks of the image were changed on behalf of each inode so
+ * that fsync() only has to flush those pages instead of the whole image. All
+ * functions must be called with the fs lock held.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "a1fs.h"
+#include "blkset.h"
+
+struct fs_ctx;
+
+
+/** Number of hash buckets for per-inode dirty state. */
+#define DIRTY_BUCKETS 256
+
+/** Dirty blocks of one inode. */
+typedef struct dirty_ino {
+	/** Inode number. */
+	a1fs_ino_t ino;
+	/** File data blocks written since the last fsync. */
+	blkset data;
+	/** Metadata blocks changed on behalf of the inode since the last fsync. */
+	blkset meta;
+	/** Next entry in the hash bucket. */
+	struct dirty_ino *next;
+} dirty_ino;
+
+/** Dirty block tracking state. */
+typedef struct dirty_tracker {
+	/** Per-inode dirty state, hashed by inode number. */
+	dirty_ino *buckets[DIRTY_BUCKETS];
+	/** Metadata blocks changed by the current callback, not yet attributed. */
+	blkset op_meta;
+} dirty_tracker;
+
+/** Initialize dirty tracking. */
+void dirty_init(struct fs_ctx *fs);
+
+/** Free all dirty tracking state. */
+void dirty_destroy(struct fs_ctx *fs);
+
+/**
+ * Record a metadata change made by the current callback.
+ *
+ * @param ptr  pointer into fs_ctx_blk() memory.
+ * @param len  length of the changed range in bytes.
+ */
+void dirty_meta(struct fs_ctx *fs, const void *ptr, size_t len);
+
+/**
+ * Record a file data change.
+ *
+ * @param ino    inode number of the file.
+ * @param blk    first changed block number.
+ * @param count  number of changed blocks.
+ */
+void dirty_data(struct fs_ctx *fs, a1fs_ino_t ino, a1fs_blk_t blk, size_t count);
+
+/**
+ * Finish a callback: attribute its metadata changes to up to two inodes.
+ *
+ * @param ino1  first inode the callback worked on; -1 if none.
+ * @param ino2  second inode the callback worked on; -1 if none.
+ */
+void dirty_end_op(struct fs_ctx *fs, int ino1, int ino2);
+
+/** Drop the dirty state of an inode that no longer exists. */
+void dirty_forget(struct fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Make the changes to an inode durable.
+ *
+ * Flushes the dirty data pages of the inode, then commits the journal. If the
+ * image has no journal, flushes the metadata blocks the inode changed instead.
+ *
+ * @return  0 on success; -errno on error.
+ */
+int dirty_sync(struct fs_ctx *fs, a1fs_ino_t ino);
+
+/** Start asynchronous writeback of the dirty data pages of an inode. */
+void dirty_writeback(struct fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Make the whole image durable and forget all dirty state. On error the dirty
+ * state is kept, so that a later sync tries again.
+ *
+ * @return  0 on success; -EIO on error.
+ */
+int dirty_sync_all(struct fs_ctx *fs);
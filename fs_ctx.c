@@ -18,32 +18,274 @@
 
 #include "fs_ctx.h"
 #include "a1fs.h"
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
 
 
-bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
+/**
+ * Populate and lock in memory the superblock, bitmaps and inode table, as much
+ * of them as fits in the budget, so that they never take a page fault.
+ *
+ * @param budget  budget in MiB.
+ */
+static void lock_meta(fs_ctx *fs, unsigned budget)
+{
+	// Everything before the journal, which is only read on replay; with a
+	// journal, the working copy of everything before the prefetch list
+	size_t len = (size_t)(fs->journal.meta ? fs->journal.meta_count : fs->sb->journal_blk) * A1FS_BLOCK_SIZE;
+	size_t max = (size_t)budget * 1024 * 1024;
+	if (len > max) {
+		fprintf(stderr, "Metadata takes %zu KiB, only locking the first %u MiB\n",
+		        len / 1024, budget);
+		len = max;
+	}
+	if (mlock(fs->sb, len) < 0) {
+		perror("mlock");
+		return;
+	}
+	fs->meta_locked = len;
+}
+
+bool fs_ctx_init(fs_ctx *fs, const a1fs_opts *opts)
 {
-	fs->image = image;
-	fs->size = size;
+	const char *backend = opts->backend;
+	if (opts->odirect && !backend) {
+		backend = "cache";
+	}
+	fs->storage = storage_find(backend);
+	if (!fs->storage) {
+		fprintf(stderr, "Unknown storage backend %s\n", backend);
+		return false;
+	}
+	// Only the block cache backends do their own caching; a mapping is
+	// backed by the host page cache by definition
+	if (opts->odirect && fs->storage != &cache_storage && fs->storage != &uring_storage) {
+		fprintf(stderr, "odirect requires a block cache backend\n");
+		return false;
+	}
+	// Other backends drop changes they can't keep in memory
+	if (opts->ephemeral && fs->storage != &mmap_storage) {
+		fprintf(stderr, "ephemeral requires the mmap backend\n");
+		return false;
+	}
+	fs->fd = -1;
+	if (!fs->storage->open(fs, opts)) {
+		return false;
+	}
 
 	//TODO: check if the file system image is valid and can be mounted,
 	//      and initialize its runtime state
-	const struct a1fs_superblock *sb = (const struct a1fs_superblock *)image;
+	const struct a1fs_superblock *sb = fs_ctx_blk(fs, 0, 0);
 	if (sb->magic != A1FS_MAGIC) {
-		return false;
+		goto fail;
 	}
 
+	// The metadata region is resident and contiguous in all backends
 	fs->sb = (struct a1fs_superblock *)sb;
-	fs->inode_bitmap = (unsigned char *)(image + A1FS_BLOCK_SIZE * sb->inode_bitmap_blk);
-	fs->data_bitmap = (unsigned char *)(image + A1FS_BLOCK_SIZE * sb->data_bitmap_blk);
-	fs->inode_table = (struct a1fs_inode *)(image + A1FS_BLOCK_SIZE * sb->inode_table_blk);
-	fs->first_data_blk = image + A1FS_BLOCK_SIZE * sb->first_data_blk;
+	fs->inode_bitmap = fs_ctx_blk(fs, sb->inode_bitmap_blk, 0);
+	fs->data_bitmap = fs_ctx_blk(fs, sb->data_bitmap_blk, 0);
+	fs->inode_table = fs_ctx_blk(fs, sb->inode_table_blk, 0);
+	// Bitmaps and inode table are accessed at random; don't read ahead
+	if (opts->random_meta) {
+		fs_ctx_advise(fs, 0, sb->first_data_blk, MADV_RANDOM);
+	}
+	fs->seq_size = (size_t)opts->seq_size * 1024 * 1024;
+	fs->readahead_max = (size_t)opts->readahead * 1024 / A1FS_BLOCK_SIZE;
+	// Confirmed or turned off once the kernel reports its capabilities
+	fs->writeback_cache = opts->writeback_cache;
 
+	if (!journal_init(fs)) {
+		journal_destroy(fs);
+		goto fail;
+	}
+	// Callbacks work on the working copy of the metadata if there is a journal
+	fs->sb = fs_ctx_blk(fs, 0, 0);
+	fs->inode_bitmap = fs_ctx_blk(fs, sb->inode_bitmap_blk, 0);
+	fs->data_bitmap = fs_ctx_blk(fs, sb->data_bitmap_blk, 0);
+	fs->inode_table = fs_ctx_blk(fs, sb->inode_table_blk, 0);
+	dirty_init(fs);
+	alloc_init(fs);
+	// Nothing is ever written back in ephemeral mode, and file data goes
+	// straight to memory with non-temporal stores in pmem mode
+	bool no_writeback = opts->ephemeral || fs->storage == &pmem_storage;
+	writeback_init(fs, no_writeback ? 0 : opts->dirty_budget);
+	fs->meta_locked = 0;
+	if (opts->mlock_meta > 0) {
+		lock_meta(fs, opts->mlock_meta);
+	}
+	prefetch_list_init(fs, opts->record, !opts->noreplay);
+	kcache_init(fs, opts->kcache > 0);
+	if (!taskpool_init(fs, opts->workers)) {
+		goto fail;
+	}
+	iosched_init(fs, opts->bg_rate, opts->fg_target);
+	// getattr only skips the lock if block pointers stay valid without it
+	fs->ino_seq = fs->storage->stable ? calloc(sb->inodes_count, sizeof(unsigned)) : NULL;
+	pthread_mutex_init(&fs->lock, NULL);
 	return true;
+
+fail:
+	fs->storage->close(fs);
+	fs->sb = NULL;
+	return false;
 }
 
 void fs_ctx_destroy(fs_ctx *fs)
 {
 	//TODO: cleanup any resources allocated in fs_ctx_init()
-	memset(fs, 0, fs->size);
+	writeback_destroy(fs);
+	dirty_destroy(fs);
+	prefetch_list_destroy(fs);
+	kcache_destroy(fs);
+	taskpool_destroy(fs);
+	iosched_destroy(fs);
+	free(fs->ino_seq);
+	while (fs->open_dirs) {
+		open_dir *od = fs->open_dirs;
+		fs->open_dirs = od->next;
+		free(od);
+	}
+	if (fs->meta_locked > 0) {
+		munlock(fs->sb, fs->meta_locked);
+	}
+	journal_destroy(fs);
+	fs->storage->close(fs);
+	pthread_mutex_destroy(&fs->lock);
+	memset(fs, 0, sizeof(*fs));
+}
+
+void fs_ctx_lock(fs_ctx *fs)
+{
+	iosched_lock_begin(fs);
+	pthread_mutex_lock(&fs->lock);
+	iosched_lock_acquired(fs);
+}
+
+void fs_ctx_wait(fs_ctx *fs, pthread_cond_t *cond)
+{
+	iosched_wait_begin(fs);
+	pthread_cond_wait(cond, &fs->lock);
+	iosched_wait_end(fs);
+}
+
+void fs_ctx_unlock(fs_ctx *fs)
+{
+	if (fs->storage->release) {
+		fs->storage->release(fs);
+	}
+	iosched_lock_end(fs);
+	pthread_mutex_unlock(&fs->lock);
+}
+
+void *fs_ctx_blk(fs_ctx *fs, a1fs_blk_t blk, int flags)
+{
+	if (fs->plist.recording) {
+		prefetch_list_record(fs, blk);
+	}
+	void *copy = journal_get(fs, blk, flags);
+	return copy ? copy : fs->storage->get(fs, blk, flags);
+}
+
+void fs_ctx_blk_range(fs_ctx *fs, const void *ptr, size_t len,
+                      a1fs_blk_t *first, a1fs_blk_t *last)
+{
+	// Block memory is block-aligned in all backends
+	if (!journal_blk_of(fs, ptr, first)) {
+		*first = fs->storage->blk_of(fs, ptr);
+	}
+	*last = *first + ((uintptr_t)ptr % A1FS_BLOCK_SIZE + len - 1) / A1FS_BLOCK_SIZE;
+}
+
+void fs_ctx_dirty(fs_ctx *fs, const void *ptr, size_t len)
+{
+	a1fs_blk_t blk;
+	// Working copies only reach the image through the journal
+	if (len == 0 || journal_blk_of(fs, ptr, &blk)) {
+		return;
+	}
+	a1fs_blk_t first, last;
+	fs_ctx_blk_range(fs, ptr, len, &first, &last);
+	for (a1fs_blk_t blk = first; blk <= last; blk++) {
+		fs->storage->dirty(fs, blk);
+	}
+}
+
+void fs_ctx_prefetch(fs_ctx *fs, const storage_run *runs, size_t n)
+{
+	if (fs->storage->prefetch && n > 0) {
+		fs->storage->prefetch(fs, runs, n);
+	}
+}
+
+void fs_ctx_readahead(fs_ctx *fs, const storage_run *runs, size_t n)
+{
+	if (fs->storage->advise) {
+		for (size_t i = 0; i < n; i++) {
+			fs->storage->advise(fs, runs[i].blk, runs[i].count, MADV_WILLNEED);
+		}
+	} else {
+		fs_ctx_prefetch(fs, runs, n);
+	}
+}
+
+void fs_ctx_copy(fs_ctx *fs, void *dst, const void *src, size_t len)
+{
+	if (fs->storage->copy) {
+		fs->storage->copy(fs, dst, src, len);
+	} else {
+		memcpy(dst, src, len);
+	}
+}
+
+void fs_ctx_advise(fs_ctx *fs, a1fs_blk_t blk, size_t count, int advice)
+{
+	if (fs->storage->advise) {
+		fs->storage->advise(fs, blk, count, advice);
+	}
+}
+
+void fs_ctx_zero(fs_ctx *fs, a1fs_blk_t blk, size_t count)
+{
+	journal_zero(fs, blk, count);
+	fs->storage->zero(fs, blk, count);
+}
+
+int fs_ctx_flush(fs_ctx *fs, a1fs_blk_t blk, size_t count, int flags)
+{
+	return fs->storage->flush(fs, blk, count, flags);
+}
+
+int fs_ctx_flush_set(fs_ctx *fs, const blkset *set, int flags)
+{
+	if (set->count == 0) {
+		return 0;
+	}
+	a1fs_blk_t *blks = malloc(set->count * sizeof(a1fs_blk_t));
+	if (!blks) {
+		// Can't sort; flush the whole image instead
+		return fs_ctx_flush(fs, 0, fs->size / A1FS_BLOCK_SIZE, flags);
+	}
+
+	// Start all runs and wait once if the backend can
+	int run_flags = (fs->storage->sync && (flags & MS_SYNC)) ? MS_ASYNC : flags;
+	int ret = 0;
+	size_t n = blkset_to_sorted_array(set, blks);
+	for (size_t i = 0; i < n;) {
+		size_t run = 1;
+		while (i + run < n && blks[i + run] == blks[i] + run) {
+			run++;
+		}
+		if (fs_ctx_flush(fs, blks[i], run, run_flags) < 0) {
+			ret = -1;
+		}
+		i += run;
+	}
+	free(blks);
+	if (run_flags != flags && fs->storage->sync(fs) < 0) {
+		ret = -1;
+	}
+	return ret;
 }
@@ -18,21 +18,60 @@
 
 #pragma once
 
+#include <pthread.h>
 #include <stddef.h>
 
 #include "options.h"
 
 #include "a1fs.h"
+#include "alloc.h"
+#include "blkset.h"
+#include "cache.h"
+#include "dirty.h"
+#include "iosched.h"
+#include "journal.h"
+#include "kcache.h"
+#include "pmem.h"
+#include "prefetch_list.h"
+#include "storage.h"
+#include "taskpool.h"
+#include "window.h"
+#include "writeback.h"
 
 
+/**
+ * Directory with open handles. Entries removed from it are left as tombstones
+ * (empty names) so that the readdir offsets of the other entries don't change
+ * under a reader; they are compacted when the last handle is released.
+ */
+typedef struct open_dir {
+	/** Directory inode number. */
+	a1fs_ino_t ino;
+	/** Number of open handles. */
+	unsigned opens;
+	/** Whether the directory has tombstones to compact. */
+	bool has_tombstones;
+	struct open_dir *next;
+} open_dir;
+
 /**
  * Mounted file system runtime state - "fs context".
  */
 typedef struct fs_ctx {
-	/** Pointer to the start of the image. */
+	/** Storage backend used for all block access. */
+	const storage_ops *storage;
+	/** Pointer to the start of the image if it is mapped; used by the backend. */
 	void *image;
+	/** Block cache state; used by the backend. */
+	block_cache cache;
+	/** Windowed mapping state; used by the backend. */
+	window_map windows;
+	/** Persistent memory state; used by the backend. */
+	pmem_state pmem;
 	/** Image size in bytes. */
 	size_t size;
+	/** Open image file descriptor. */
+	int fd;
 
 	//TODO: useful runtime state of the mounted file system should be cached
 	// here (NOT in global variables in a1fs.c)
@@ -40,18 +79,53 @@ typedef struct fs_ctx {
 	unsigned char *inode_bitmap;
 	unsigned char *data_bitmap;
 	a1fs_inode *inode_table;	// inode_table[0] is the root inode
-	void *first_data_blk;
+	/** Metadata journal. */
+	journal journal;
+	/** Blocks changed since the last fsync, per inode. */
+	dirty_tracker dirty;
+	/** Background writeback of file data. */
+	writeback wb;
+	/** Files at least this large are read sequentially; 0 to disable. */
+	size_t seq_size;
+	/** Bytes of metadata from the superblock on locked in memory. */
+	size_t meta_locked;
+	/** Largest readahead window in blocks; 0 to disable readahead. */
+	size_t readahead_max;
+	/** Whether the kernel writeback cache is on; the kernel then owns file mtimes. */
+	bool writeback_cache;
+	/** Blocks read after mount, saved to be prefetched at the next mount. */
+	prefetch_list plist;
+	/** Directories with open handles. */
+	open_dir *open_dirs;
+	/** Kernel cache invalidation. */
+	kcache kcache;
+	/** Inode and block allocation magazines. */
+	alloc_state alloc;
+	/** Per-inode sequence counters for lock-free getattr; NULL unless the backend is stable. */
+	unsigned *ino_seq;
+
+	/** Serializes FUSE callbacks with background threads touching the image. */
+	pthread_mutex_t lock;
+	/** Background task pool. */
+	taskpool pool;
+	/** Foreground/background scheduling. */
+	iosched sched;
+	/** Whether a task freeing the blocks of orphaned inodes is queued or running. */
+	bool orphans_queued;
+	/** Set on unmount to ask background threads to exit. */
+	bool stopping;
 } fs_ctx;
 
 /**
  * Initialize file system context.
  *
+ * Opens the image with the storage backend selected in the options.
+ *
  * @param fs     pointer to the context to initialize.
- * @param image  pointer to the start of the image.
- * @param size   image size in bytes.
+ * @param opts   command line options.
  * @return       true on success; false on failure (e.g. invalid superblock).
  */
-bool fs_ctx_init(fs_ctx *fs, void *image, size_t size);
+bool fs_ctx_init(fs_ctx *fs, const a1fs_opts *opts);
 
 /**
  * Destroy file system context.
@@ -59,3 +133,117 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size);
  * Must cleanup all the resources created in fs_ctx_init().
  */
 void fs_ctx_destroy(fs_ctx *fs);
+
+/** Acquire exclusive access to the file system state. */
+void fs_ctx_lock(fs_ctx *fs);
+
+/**
+ * Wait on a condition variable with the fs lock, which is released meanwhile.
+ * The wait doesn't count towards the request's lock latency.
+ */
+void fs_ctx_wait(fs_ctx *fs, pthread_cond_t *cond);
+
+/**
+ * Release access acquired with fs_ctx_lock().
+ *
+ * Pointers returned by fs_ctx_blk() become invalid.
+ */
+void fs_ctx_unlock(fs_ctx *fs);
+
+/**
+ * Get a pointer to the contents of an image block.
+ *
+ * @param blk    block number.
+ * @param flags  STORAGE_* hints.
+ * @return       pointer valid until the fs lock is released.
+ */
+void *fs_ctx_blk(fs_ctx *fs, a1fs_blk_t blk, int flags);
+
+/**
+ * Get the image blocks of a byte range within fs_ctx_blk() memory.
+ *
+ * The range must not extend past the block of ptr, except within the
+ * metadata region which is contiguous.
+ *
+ * @param ptr    pointer returned by fs_ctx_blk() plus an offset.
+ * @param len    length of the range in bytes; must be positive.
+ * @param first  pointer to the variable that receives the first block number.
+ * @param last   pointer to the variable that receives the last block number.
+ */
+void fs_ctx_blk_range(fs_ctx *fs, const void *ptr, size_t len,
+                      a1fs_blk_t *first, a1fs_blk_t *last);
+
+/**
+ * Record that a byte range within fs_ctx_blk() memory was changed.
+ *
+ * @param ptr  pointer to the start of the range.
+ * @param len  length of the range in bytes.
+ */
+void fs_ctx_dirty(fs_ctx *fs, const void *ptr, size_t len);
+
+/**
+ * Read runs of image blocks that are about to be accessed in one batch, if the
+ * storage backend supports it.
+ *
+ * @param runs  runs of block numbers.
+ * @param n     number of runs.
+ */
+void fs_ctx_prefetch(fs_ctx *fs, const storage_run *runs, size_t n);
+
+/**
+ * Start reading runs of image blocks ahead of a sequential stream: in the
+ * background if the storage backend maps the image; otherwise in one batch.
+ *
+ * @param runs  runs of block numbers.
+ * @param n     number of runs.
+ */
+void fs_ctx_readahead(fs_ctx *fs, const storage_run *runs, size_t n);
+
+/**
+ * Copy file data into fs_ctx_blk() memory the way the storage backend prefers.
+ * Doesn't mark the range dirty.
+ *
+ * @param dst  destination within fs_ctx_blk() memory.
+ * @param src  source buffer.
+ * @param len  number of bytes.
+ */
+void fs_ctx_copy(fs_ctx *fs, void *dst, const void *src, size_t len);
+
+/**
+ * Apply an madvise() hint to a range of image blocks, if the storage backend
+ * maps the image.
+ *
+ * @param blk     first block number.
+ * @param count   number of blocks.
+ * @param advice  MADV_* value.
+ */
+void fs_ctx_advise(fs_ctx *fs, a1fs_blk_t blk, size_t count, int advice);
+
+/**
+ * Fill a range of image blocks with zeros.
+ *
+ * @param blk    first block number.
+ * @param count  number of blocks.
+ */
+void fs_ctx_zero(fs_ctx *fs, a1fs_blk_t blk, size_t count);
+
+/**
+ * Write a range of image blocks back to the image file.
+ *
+ * @param blk    first block number.
+ * @param count  number of blocks.
+ * @param flags  MS_SYNC to wait for the write to finish; MS_ASYNC to only
+ *               start it.
+ * @return       0 on success; -1 on error.
+ */
+int fs_ctx_flush(fs_ctx *fs, a1fs_blk_t blk, size_t count, int flags);
+
+/**
+ * Write a set of image blocks back to the image file, one call per run of
+ * adjacent blocks.
+ *
+ * @param set    block numbers to flush.
+ * @param flags  MS_SYNC or MS_ASYNC, see fs_ctx_flush().
+ * @return       0 on success; -1 on error.
+ */
+int fs_ctx_flush_set(fs_ctx *fs, const blkset *set, int flags);
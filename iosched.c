@@ -0,0 +1,201 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Foreground/background scheduling implementation.
+ */
+
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs_ctx.h"
+#include "iosched.h"
+
+
+/** Class of the calling thread. */
+static __thread io_class thread_class = IO_FOREGROUND;
+/** When the calling thread started waiting for the fs lock, in microseconds. */
+static __thread uint64_t lock_start;
+/** Lock latency of the current request before its last condition wait. */
+static __thread uint64_t lock_charged;
+
+static uint64_t now_us(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static void sleep_us(uint64_t us)
+{
+	struct timespec t = { us / 1000000, (us % 1000000) * 1000 };
+	nanosleep(&t, NULL);
+}
+
+
+void iosched_init(fs_ctx *fs, unsigned bg_rate_mb, unsigned target_ms)
+{
+	iosched *s = &fs->sched;
+	memset(s, 0, sizeof(*s));
+	s->rate = (double)bg_rate_mb * 1024 * 1024 / A1FS_BLOCK_SIZE;
+	s->target_us = (uint64_t)target_ms * 1000;
+	s->window_start = now_us();
+	s->refill = s->window_start;
+	s->tokens = s->rate * IOSCHED_BURST_MS / 1000;
+	pthread_mutex_init(&s->lock, NULL);
+}
+
+void iosched_destroy(fs_ctx *fs)
+{
+	pthread_mutex_destroy(&fs->sched.lock);
+}
+
+io_class iosched_set_class(io_class c)
+{
+	io_class prev = thread_class;
+	thread_class = c;
+	return prev;
+}
+
+void iosched_lock_begin(fs_ctx *fs)
+{
+	iosched *s = &fs->sched;
+	if (thread_class == IO_FOREGROUND) {
+		lock_start = now_us();
+		lock_charged = 0;
+		__atomic_add_fetch(&s->fg_waiting, 1, __ATOMIC_RELAXED);
+	} else if (thread_class == IO_SYNC) {
+		__atomic_add_fetch(&s->sync_active, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void iosched_lock_acquired(fs_ctx *fs)
+{
+	if (thread_class == IO_FOREGROUND) {
+		__atomic_sub_fetch(&fs->sched.fg_waiting, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void iosched_wait_begin(fs_ctx *fs)
+{
+	(void)fs;// unused
+	if (thread_class == IO_FOREGROUND) {
+		lock_charged += now_us() - lock_start;
+	}
+}
+
+void iosched_wait_end(fs_ctx *fs)
+{
+	(void)fs;// unused
+	if (thread_class == IO_FOREGROUND) {
+		lock_start = now_us();
+	}
+}
+
+/** Upper bound of the bucket holding the 99th percentile of the window. */
+static uint64_t window_p99(const iosched *s)
+{
+	if (s->hist_count == 0) {
+		return 0;
+	}
+	uint64_t rank = s->hist_count - s->hist_count / 100;
+	uint64_t seen = 0;
+	int b = 0;
+	for (; b < IOSCHED_BUCKETS - 1; b++) {
+		seen += s->hist[b];
+		if (seen >= rank) {
+			break;
+		}
+	}
+	return (uint64_t)2 << b;
+}
+
+void iosched_lock_end(fs_ctx *fs)
+{
+	iosched *s = &fs->sched;
+	if (thread_class == IO_SYNC) {
+		__atomic_sub_fetch(&s->sync_active, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (thread_class != IO_FOREGROUND) {
+		return;
+	}
+
+	uint64_t now = now_us();
+	uint64_t lat = lock_charged + (now - lock_start);
+	int b = (lat > 1) ? 63 - __builtin_clzll(lat) : 0;
+	s->hist[(b < IOSCHED_BUCKETS) ? b : IOSCHED_BUCKETS - 1]++;
+	s->hist_count++;
+
+	if (now - s->window_start >= IOSCHED_WINDOW_MS * 1000) {
+		__atomic_store_n(&s->p99_us, window_p99(s), __ATOMIC_RELAXED);
+		memset(s->hist, 0, sizeof(s->hist));
+		s->hist_count = 0;
+		__atomic_store_n(&s->window_start, now, __ATOMIC_RELAXED);
+	}
+}
+
+void iosched_bg_wait(fs_ctx *fs, size_t blks)
+{
+	iosched *s = &fs->sched;
+	uint64_t now = now_us();
+	uint64_t delay = 0;
+
+	// A window that never completed means there were no requests since
+	uint64_t window_start = __atomic_load_n(&s->window_start, __ATOMIC_RELAXED);
+	uint64_t p99 = (now - window_start < 2 * IOSCHED_WINDOW_MS * 1000)
+		? __atomic_load_n(&s->p99_us, __ATOMIC_RELAXED) : 0;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->rate > 0) {
+		double burst = s->rate * IOSCHED_BURST_MS / 1000;
+		s->tokens += (double)(now - s->refill) * s->rate / 1000000;
+		if (s->tokens > burst) {
+			s->tokens = burst;
+		}
+		s->refill = now;
+		// Debt is paid off by later waits
+		s->tokens -= (double)blks;
+		if (s->tokens < 0) {
+			delay = (uint64_t)(-s->tokens / s->rate * 1000000);
+		}
+	}
+	if (s->target_us > 0 && p99 > s->target_us) {
+		s->backoff_ms = (s->backoff_ms == 0) ? IOSCHED_BACKOFF_MIN_MS
+		              : (s->backoff_ms * 2 > IOSCHED_BACKOFF_MAX_MS) ? IOSCHED_BACKOFF_MAX_MS
+		              : s->backoff_ms * 2;
+		delay += (uint64_t)s->backoff_ms * 1000;
+	} else {
+		s->backoff_ms = 0;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if (delay > IOSCHED_MAX_WAIT_MS * 1000) {
+		delay = IOSCHED_MAX_WAIT_MS * 1000;
+	}
+	if (delay > 0) {
+		sleep_us(delay);
+	}
+
+	// Let requests and syncs waiting for the lock go first
+	for (int i = 0; i < IOSCHED_YIELDS; i++) {
+		if (__atomic_load_n(&s->fg_waiting, __ATOMIC_RELAXED) == 0 &&
+		    __atomic_load_n(&s->sync_active, __ATOMIC_RELAXED) == 0) {
+			break;
+		}
+		sleep_us(IOSCHED_YIELD_US);
+	}
+	sched_yield();
+}
@@ -0,0 +1,140 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Foreground/background scheduling header file.
+ *
+ * Every thread that takes the fs lock belongs to a class: FUSE requests are
+ * foreground, fsync() and flush() are sync, and the background threads and
+ * tasks (orphan freeing, prefetch list replay, writeback, journal commits)
+ * are background. The time a foreground request spends waiting for
+ * and holding the fs lock is collected in a histogram, and the p99 of each
+ * one-second window is kept. Time spent in fs_ctx_wait() isn't counted.
+ *
+ * Background work calls iosched_bg_wait() between batches, with the fs lock
+ * released. It is paced by a token bucket of blocks per second, backs off
+ * exponentially while the foreground p99 is above the target, and lets
+ * foreground and sync threads waiting for the lock go first. A single wait is
+ * bounded, so background work is slowed down but never starved.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct fs_ctx;
+
+
+/** Length of a latency window in milliseconds. */
+#define IOSCHED_WINDOW_MS 1000
+
+/** Number of power of two microsecond latency buckets. */
+#define IOSCHED_BUCKETS 32
+
+/** Background work can run ahead of the rate by this much, in milliseconds. */
+#define IOSCHED_BURST_MS 100
+
+/** First and largest backoff while the foreground p99 is above the target. */
+#define IOSCHED_BACKOFF_MIN_MS 5
+#define IOSCHED_BACKOFF_MAX_MS 80
+
+/** Longest single iosched_bg_wait() sleep, in milliseconds. */
+#define IOSCHED_MAX_WAIT_MS 100
+
+/** Background work waits up to this many times this long for requests waiting for the lock. */
+#define IOSCHED_YIELDS 10
+#define IOSCHED_YIELD_US 100
+
+/** Scheduling class of a thread. */
+typedef enum io_class {
+	/** FUSE requests; the default. */
+	IO_FOREGROUND,
+	/** fsync() and flush(). */
+	IO_SYNC,
+	/** Background threads and tasks. */
+	IO_BACKGROUND,
+} io_class;
+
+/** Runtime state of the scheduler. */
+typedef struct iosched {
+	/** Background budget in blocks per second; 0 for no limit. */
+	double rate;
+	/** Foreground p99 target in microseconds; 0 to never back off. */
+	uint64_t target_us;
+
+	/** Foreground threads waiting for the fs lock. */
+	unsigned fg_waiting;
+	/** Sync threads waiting for or holding the fs lock. */
+	unsigned sync_active;
+
+	/** Foreground latencies in the current window; updated under the fs lock. */
+	uint32_t hist[IOSCHED_BUCKETS];
+	uint32_t hist_count;
+	/** Start of the current window in microseconds. */
+	uint64_t window_start;
+	/** p99 of the last complete window in microseconds. */
+	uint64_t p99_us;
+
+	/** Protects the token bucket and the backoff. */
+	pthread_mutex_t lock;
+	double tokens;
+	/** When tokens were last added, in microseconds. */
+	uint64_t refill;
+	unsigned backoff_ms;
+} iosched;
+
+/**
+ * Initialize the scheduler.
+ *
+ * @param bg_rate_mb  background budget in MiB/s; 0 for no limit.
+ * @param target_ms   foreground p99 target in milliseconds; 0 to disable.
+ */
+void iosched_init(struct fs_ctx *fs, unsigned bg_rate_mb, unsigned target_ms);
+
+/** Free the scheduler state. */
+void iosched_destroy(struct fs_ctx *fs);
+
+/**
+ * Set the class of the calling thread.
+ *
+ * @return  previous class.
+ */
+io_class iosched_set_class(io_class c);
+
+/** Called by fs_ctx_lock() before taking the fs lock. */
+void iosched_lock_begin(struct fs_ctx *fs);
+
+/** Called by fs_ctx_lock() once the fs lock is taken. */
+void iosched_lock_acquired(struct fs_ctx *fs);
+
+/**
+ * Called by fs_ctx_wait() before waiting on a condition. The time until
+ * iosched_wait_end(), with the fs lock released, isn't counted as latency.
+ */
+void iosched_wait_begin(struct fs_ctx *fs);
+
+/** Called by fs_ctx_wait() once the fs lock is taken again. */
+void iosched_wait_end(struct fs_ctx *fs);
+
+/** Called by fs_ctx_unlock() before releasing the fs lock. */
+void iosched_lock_end(struct fs_ctx *fs);
+
+/**
+ * Pace background work. Must be called without the fs lock held.
+ *
+ * @param blks  blocks of I/O done since the last call.
+ */
+void iosched_bg_wait(struct fs_ctx *fs, size_t blks);
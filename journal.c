@@ -0,0 +1,691 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Metadata journal implementation.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "fs_ctx.h"
+#include "journal.h"
+
+
+/** Commit once this many callbacks are batched in the running transaction. */
+#define JOURNAL_BATCH_OPS 64
+/** Commit once the running transaction has this many blocks. */
+#define JOURNAL_BATCH_BLKS (A1FS_JOURNAL_DESC_MAX / 2)
+/** Maximum time a callback stays uncommitted, in milliseconds. */
+#define JOURNAL_COMMIT_INTERVAL_MS 1000
+
+
+/** Position of a committed transaction in the journal. */
+typedef struct txn_pos {
+	/** Offset of the first descriptor block. */
+	a1fs_blk_t start;
+	/** Offset of the commit block. */
+	a1fs_blk_t commit;
+} txn_pos;
+
+/** Pointer to a block in the image, bypassing the working copies. */
+static void *blk_ptr(fs_ctx *fs, a1fs_blk_t blk)
+{
+	return fs->storage->get(fs, blk, STORAGE_META);
+}
+
+static a1fs_journal_header *header(fs_ctx *fs)
+{
+	return (a1fs_journal_header *)blk_ptr(fs, fs->journal.start);
+}
+
+static bool is_shadowed(const journal *j, a1fs_blk_t db)
+{
+	return __atomic_load_n(&j->shadowed[db / 8], __ATOMIC_ACQUIRE) & (1 << (db % 8));
+}
+
+/** FNV-1a hash used as the transaction checksum. */
+static uint64_t checksum(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ p[i]) * 0x100000001B3ull;
+	}
+	return hash;
+}
+
+/** Checksum of the descriptor and logged blocks of a transaction, up to its commit block. */
+static uint64_t txn_checksum(fs_ctx *fs, a1fs_blk_t first, a1fs_blk_t count)
+{
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (a1fs_blk_t i = 0; i < count; i++) {
+		hash = checksum(hash, blk_ptr(fs, first + i), A1FS_BLOCK_SIZE);
+	}
+	return hash;
+}
+
+/** Number of journal blocks taken by a transaction, including descriptors and commit block. */
+static size_t txn_len(size_t blocks_count, size_t revokes_count)
+{
+	size_t entries = blocks_count + revokes_count;
+	size_t descs = (entries == 0) ? 1 : (entries + A1FS_JOURNAL_DESC_MAX - 1) / A1FS_JOURNAL_DESC_MAX;
+	return descs + blocks_count + 1;
+}
+
+static void write_header(fs_ctx *fs, uint64_t seq)
+{
+	a1fs_journal_header *hdr = header(fs);
+	hdr->seq = seq;
+	hdr->tail = 1;
+	fs_ctx_dirty(fs, hdr, sizeof(*hdr));
+	fs_ctx_flush(fs, fs->journal.start, 1, MS_SYNC);
+}
+
+/**
+ * Validate the transaction at given journal offset.
+ *
+ * @return  offset of its commit block; 0 if the transaction is incomplete.
+ */
+static a1fs_blk_t valid_txn(fs_ctx *fs, a1fs_blk_t pos, uint64_t seq)
+{
+	journal *j = &fs->journal;
+	a1fs_blk_t first = pos;
+	// Descriptors of a large transaction follow each other's logged blocks
+	for (;;) {
+		if (pos + 2 > j->count) {
+			return 0;
+		}
+		a1fs_journal_desc *desc = blk_ptr(fs, j->start + pos);
+		if (desc->magic != A1FS_JOURNAL_DESC_MAGIC || desc->seq != seq ||
+		    desc->blocks_count + desc->revokes_count > A1FS_JOURNAL_DESC_MAX ||
+		    pos + desc->blocks_count + 2 > j->count) {
+			return 0;
+		}
+		pos += desc->blocks_count + 1;
+		a1fs_journal_commit *commit = blk_ptr(fs, j->start + pos);
+		if (commit->magic == A1FS_JOURNAL_COMMIT_MAGIC && commit->seq == seq) {
+			return (commit->checksum == txn_checksum(fs, j->start + first, pos - first)) ? pos : 0;
+		}
+	}
+}
+
+/**
+ * Find the committed transactions from the tail.
+ *
+ * @param txns      pointer to the variable that receives the array of
+ *                  transactions, oldest first; the caller frees it.
+ * @param next_seq  pointer to the variable that receives the sequence number
+ *                  following the last transaction.
+ * @return          number of transactions; -1 if out of memory.
+ */
+static ssize_t find_txns(fs_ctx *fs, txn_pos **txns, uint64_t *next_seq)
+{
+	journal *j = &fs->journal;
+	a1fs_journal_header *hdr = header(fs);
+
+	*txns = malloc(j->count * sizeof(txn_pos));
+	if (!*txns) {
+		perror("malloc");
+		return -1;
+	}
+	size_t count = 0;
+	uint64_t seq = hdr->seq;
+	a1fs_blk_t pos = hdr->tail;
+	for (a1fs_blk_t commit; (commit = valid_txn(fs, pos, seq)) != 0; seq++) {
+		(*txns)[count].start = pos;
+		(*txns)[count].commit = commit;
+		count++;
+		pos = commit + 1;
+	}
+	*next_seq = seq;
+	return count;
+}
+
+/**
+ * Copy the latest committed contents of the logged blocks to their home
+ * locations.
+ *
+ * @param touched  set that receives the block numbers written.
+ * @return         true on success; false if out of memory.
+ */
+static bool apply_txns(fs_ctx *fs, const txn_pos *txns, size_t count, blkset *touched)
+{
+	journal *j = &fs->journal;
+	bool ret = true;
+
+	// Newest first, so that each block gets its latest copy and revoked blocks
+	// are skipped in all older transactions
+	blkset skip;
+	blkset_init(&skip);
+	for (size_t t = count; t-- > 0 && ret;) {
+		for (a1fs_blk_t pos = txns[t].start; pos < txns[t].commit && ret;) {
+			a1fs_journal_desc *desc = blk_ptr(fs, j->start + pos);
+			for (uint32_t i = 0; i < desc->revokes_count; i++) {
+				a1fs_blk_t blk = desc->blocks[desc->blocks_count + i];
+				if (!blkset_add(&skip, blk) && !blkset_contains(&skip, blk)) {
+					ret = false;
+				}
+			}
+			for (uint32_t i = 0; i < desc->blocks_count; i++) {
+				a1fs_blk_t home = desc->blocks[i];
+				bool in_journal = (home >= j->start) && (home < j->start + j->count);
+				if (!in_journal && home < fs->size / A1FS_BLOCK_SIZE && !blkset_contains(&skip, home)) {
+					void *dst = blk_ptr(fs, home);
+					memcpy(dst, blk_ptr(fs, j->start + pos + 1 + i), A1FS_BLOCK_SIZE);
+					fs_ctx_dirty(fs, dst, A1FS_BLOCK_SIZE);
+					if (!blkset_add(touched, home) || !blkset_add(&skip, home)) {
+						ret = false;
+					}
+				}
+			}
+			pos += desc->blocks_count + 1;
+		}
+	}
+	blkset_destroy(&skip);
+	return ret;
+}
+
+/**
+ * Replay committed transactions from the tail.
+ *
+ * @param next_seq  pointer to the variable that receives the sequence number
+ *                  following the last replayed transaction.
+ * @return          true on success; false on failure.
+ */
+static bool replay(fs_ctx *fs, uint64_t *next_seq)
+{
+	txn_pos *txns;
+	ssize_t count = find_txns(fs, &txns, next_seq);
+	if (count <= 0) {
+		free(txns);
+		return count == 0;
+	}
+
+	blkset touched;
+	blkset_init(&touched);
+	bool ret = apply_txns(fs, txns, count, &touched);
+	blkset_destroy(&touched);
+	free(txns);
+	if (!ret) {
+		fprintf(stderr, "Out of memory replaying the journal\n");
+		return false;
+	}
+
+	fs_ctx_flush(fs, 0, fs->size / A1FS_BLOCK_SIZE, MS_SYNC);
+	fprintf(stderr, "Replayed %zd journal transactions\n", count);
+	return true;
+}
+
+/** Set up the working copies of the metadata blocks and the shadow copies of dentry and extent blocks. */
+static bool init_working_copy(fs_ctx *fs)
+{
+	journal *j = &fs->journal;
+	const a1fs_superblock *sb = blk_ptr(fs, 0);
+	j->meta_count = sb->prefetch_blk;
+	j->first_data_blk = sb->first_data_blk;
+
+	size_t meta_len = (size_t)j->meta_count * A1FS_BLOCK_SIZE;
+	j->meta = mmap(NULL, meta_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (j->meta == MAP_FAILED) {
+		j->meta = NULL;
+		perror("mmap");
+		return false;
+	}
+	// The metadata region is contiguous in all backends
+	memcpy(j->meta, sb, meta_len);
+
+	// Only the pages of blocks that get shadowed take memory
+	size_t shadow_len = (size_t)sb->data_blocks_count * A1FS_BLOCK_SIZE;
+	j->shadow = mmap(NULL, shadow_len, PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (j->shadow == MAP_FAILED) {
+		j->shadow = NULL;
+		perror("mmap");
+		return false;
+	}
+	j->shadowed = calloc(sb->data_blocks_count / 8 + 1, 1);
+	if (!j->shadowed) {
+		perror("calloc");
+		return false;
+	}
+	return true;
+}
+
+
+bool journal_init(fs_ctx *fs)
+{
+	journal *j = &fs->journal;
+	blkset_init(&j->running);
+	blkset_init(&j->revoked);
+	blkset_init(&j->freed);
+	blkset_init(&j->logged);
+	pthread_cond_init(&j->cond, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &j->last_commit);
+
+	if (fs->sb->journal_blks_count == 0) {
+		return true;
+	}
+	j->start = fs->sb->journal_blk;
+	j->count = fs->sb->journal_blks_count;
+	if (header(fs)->magic != A1FS_JOURNAL_MAGIC) {
+		fprintf(stderr, "Invalid journal header\n");
+		return false;
+	}
+
+	if (!replay(fs, &j->seq)) {
+		return false;
+	}
+	j->head = 1;
+	write_header(fs, j->seq);
+	return init_working_copy(fs);
+}
+
+void journal_destroy(fs_ctx *fs)
+{
+	journal *j = &fs->journal;
+	blkset_destroy(&j->running);
+	blkset_destroy(&j->revoked);
+	blkset_destroy(&j->freed);
+	blkset_destroy(&j->logged);
+	pthread_cond_destroy(&j->cond);
+	if (j->shadow) {
+		munmap(j->shadow, (size_t)fs->sb->data_blocks_count * A1FS_BLOCK_SIZE);
+	}
+	free(j->shadowed);
+	if (j->meta) {
+		munmap(j->meta, (size_t)j->meta_count * A1FS_BLOCK_SIZE);
+	}
+}
+
+void *journal_get(fs_ctx *fs, a1fs_blk_t blk, int flags)
+{
+	journal *j = &fs->journal;
+	if (!j->meta) {
+		return NULL;
+	}
+	if (blk < j->meta_count) {
+		return j->meta + (size_t)blk * A1FS_BLOCK_SIZE;
+	}
+	if (!(flags & STORAGE_META) || blk < j->first_data_blk) {
+		return NULL;
+	}
+
+	a1fs_blk_t db = blk - j->first_data_blk;
+	unsigned char *shadow = j->shadow + (size_t)db * A1FS_BLOCK_SIZE;
+	if (!is_shadowed(j, db)) {
+		memcpy(shadow, fs->storage->get(fs, blk, STORAGE_META), A1FS_BLOCK_SIZE);
+		// Lock-free readers only look at the copy once the bit is set
+		__atomic_fetch_or(&j->shadowed[db / 8], 1 << (db % 8), __ATOMIC_RELEASE);
+	}
+	return shadow;
+}
+
+const void *journal_peek(fs_ctx *fs, a1fs_blk_t blk)
+{
+	journal *j = &fs->journal;
+	if (!j->meta) {
+		return NULL;
+	}
+	if (blk < j->meta_count) {
+		return j->meta + (size_t)blk * A1FS_BLOCK_SIZE;
+	}
+	if (blk < j->first_data_blk || !is_shadowed(j, blk - j->first_data_blk)) {
+		return NULL;
+	}
+	return j->shadow + (size_t)(blk - j->first_data_blk) * A1FS_BLOCK_SIZE;
+}
+
+bool journal_blk_of(fs_ctx *fs, const void *ptr, a1fs_blk_t *blk)
+{
+	journal *j = &fs->journal;
+	const unsigned char *p = ptr;
+	if (!j->meta) {
+		return false;
+	}
+	if (p >= j->meta && p < j->meta + (size_t)j->meta_count * A1FS_BLOCK_SIZE) {
+		*blk = (p - j->meta) / A1FS_BLOCK_SIZE;
+		return true;
+	}
+	if (p >= j->shadow && p < j->shadow + (size_t)fs->sb->data_blocks_count * A1FS_BLOCK_SIZE) {
+		*blk = j->first_data_blk + (p - j->shadow) / A1FS_BLOCK_SIZE;
+		return true;
+	}
+	return false;
+}
+
+void journal_zero(fs_ctx *fs, a1fs_blk_t blk, size_t count)
+{
+	journal *j = &fs->journal;
+	if (!j->meta) {
+		return;
+	}
+	for (a1fs_blk_t b = blk; b < blk + count; b++) {
+		void *copy = (b >= j->first_data_blk) ? (void *)journal_peek(fs, b) : NULL;
+		if (copy) {
+			memset(copy, 0, A1FS_BLOCK_SIZE);
+		}
+	}
+}
+
+bool journal_pinned(fs_ctx *fs, a1fs_blk_t blk)
+{
+	journal *j = &fs->journal;
+	return j->freed.count > 0 && blkset_contains(&j->freed, blk);
+}
+
+void journal_dirty(fs_ctx *fs, const void *ptr, size_t len)
+{
+	journal *j = &fs->journal;
+	if (!j->start || len == 0) {
+		return;
+	}
+	a1fs_blk_t first, last;
+	fs_ctx_blk_range(fs, ptr, len, &first, &last);
+	for (a1fs_blk_t blk = first; blk <= last; blk++) {
+		if (!blkset_add(&j->running, blk) && !blkset_contains(&j->running, blk)) {
+			j->overflow = true;
+		}
+		blkset_remove(&j->revoked, blk);
+	}
+}
+
+void journal_revoke(fs_ctx *fs, a1fs_blk_t first, size_t count)
+{
+	journal *j = &fs->journal;
+	if (!j->start) {
+		return;
+	}
+	for (a1fs_blk_t blk = first; blk < first + count; blk++) {
+		blkset_remove(&j->running, blk);
+		if (blkset_contains(&j->logged, blk) && !blkset_add(&j->revoked, blk)) {
+			j->overflow = true;
+		}
+		// The image still has the block in use until the free commits
+		if (!blkset_add(&j->freed, blk) && !blkset_contains(&j->freed, blk)) {
+			j->overflow = true;
+		}
+		a1fs_blk_t db = blk - j->first_data_blk;
+		if (blk >= j->first_data_blk && is_shadowed(j, db)) {
+			__atomic_fetch_and(&j->shadowed[db / 8], ~(1 << (db % 8)), __ATOMIC_RELAXED);
+			madvise(j->shadow + (size_t)db * A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE, MADV_DONTNEED);
+		}
+	}
+}
+
+bool journal_checkpoint(fs_ctx *fs)
+{
+	journal *j = &fs->journal;
+	if (!j->start) {
+		return true;
+	}
+	txn_pos *txns;
+	uint64_t next_seq;
+	ssize_t count = find_txns(fs, &txns, &next_seq);
+	if (count < 0) {
+		return false;
+	}
+
+	blkset touched;
+	blkset_init(&touched);
+	bool ret = apply_txns(fs, txns, count, &touched);
+	free(txns);
+	if (ret) {
+		// Nothing can be dropped from the journal before its home locations are written
+		ret = fs_ctx_flush_set(fs, &touched, MS_SYNC) == 0;
+	}
+	blkset_destroy(&touched);
+	if (!ret) {
+		return false;
+	}
+	blkset_clear(&j->logged);
+	j->head = 1;
+	write_header(fs, j->seq);
+	return true;
+}
+
+/** Write the working copy of a block to its home location. */
+static void write_home(fs_ctx *fs, a1fs_blk_t blk)
+{
+	void *dst = blk_ptr(fs, blk);
+	memcpy(dst, fs_ctx_blk(fs, blk, STORAGE_META), A1FS_BLOCK_SIZE);
+	fs->storage->dirty(fs, blk);
+}
+
+/**
+ * Last resort for a running transaction that can't be logged: larger than the
+ * whole journal, or some of its blocks are unknown (out of memory). Its blocks
+ * are written to their home locations after everything committed before, which
+ * is not atomic.
+ *
+ * @return  0 on success; -EIO on failure, keeping the running transaction.
+ */
+static int commit_in_place(fs_ctx *fs)
+{
+	journal *j = &fs->journal;
+	if (!journal_checkpoint(fs)) {
+		return -EIO;
+	}
+	if (!j->warned) {
+		fprintf(stderr, "Journal is too small for a transaction of %zu blocks; "
+		        "writing it in place (use a larger mkfs -j)\n", j->running.count);
+		j->warned = true;
+	}
+
+	int ret = 0;
+	if (j->overflow) {
+		// Some changed blocks are unknown; write back every working copy
+		for (a1fs_blk_t blk = 0; blk < j->meta_count; blk++) {
+			write_home(fs, blk);
+		}
+		for (a1fs_blk_t db = 0; db < fs->sb->data_blocks_count; db++) {
+			if (is_shadowed(j, db)) {
+				write_home(fs, j->first_data_blk + db);
+			}
+		}
+		ret = fs_ctx_flush(fs, 0, fs->size / A1FS_BLOCK_SIZE, MS_SYNC);
+	} else {
+		a1fs_blk_t *blks = malloc(j->running.count * sizeof(a1fs_blk_t));
+		if (!blks) {
+			perror("malloc");
+			return -EIO;
+		}
+		size_t n = blkset_to_sorted_array(&j->running, blks);
+		for (size_t i = 0; i < n; i++) {
+			write_home(fs, blks[i]);
+		}
+		free(blks);
+		ret = fs_ctx_flush_set(fs, &j->running, MS_SYNC);
+	}
+	if (ret < 0) {
+		return -EIO;
+	}
+	blkset_clear(&j->running);
+	blkset_clear(&j->revoked);
+	blkset_clear(&j->freed);
+	j->overflow = false;
+	return 0;
+}
+
+int journal_commit(fs_ctx *fs)
+{
+	journal *j = &fs->journal;
+	if (!j->start) {
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &j->last_commit);
+	j->running_ops = 0;
+	if (j->running.count == 0 && j->revoked.count == 0 && !j->overflow) {
+		blkset_clear(&j->freed);
+		return 0;
+	}
+
+	size_t blocks_count = j->running.count;
+	size_t revokes_count = j->revoked.count;
+	size_t len = txn_len(blocks_count, revokes_count);
+	if (j->overflow || len + 1 > j->count) {
+		return commit_in_place(fs);
+	}
+	// On failure the running transaction stays in memory for the next commit
+	if (j->head + len > j->count && !journal_checkpoint(fs)) {
+		return -EIO;
+	}
+	a1fs_blk_t *blks = malloc((blocks_count + revokes_count) * sizeof(a1fs_blk_t));
+	if (!blks) {
+		perror("malloc");
+		return -EIO;
+	}
+	blkset_to_sorted_array(&j->running, blks);
+	blkset_to_sorted_array(&j->revoked, blks + blocks_count);
+
+	// Descriptors of up to A1FS_JOURNAL_DESC_MAX entries, each followed by the
+	// copies of its logged blocks; revoked blocks go after all logged ones
+	a1fs_blk_t first = j->start + j->head;
+	a1fs_blk_t pos = first;
+	size_t done = 0;
+	do {
+		size_t n = blocks_count + revokes_count - done;
+		if (n > A1FS_JOURNAL_DESC_MAX) {
+			n = A1FS_JOURNAL_DESC_MAX;
+		}
+		size_t n_logged = (done >= blocks_count) ? 0 : (n < blocks_count - done) ? n : blocks_count - done;
+
+		a1fs_journal_desc *desc = blk_ptr(fs, pos);
+		memset(desc, 0, A1FS_BLOCK_SIZE);
+		desc->magic = A1FS_JOURNAL_DESC_MAGIC;
+		desc->seq = j->seq;
+		desc->blocks_count = n_logged;
+		desc->revokes_count = n - n_logged;
+		memcpy(desc->blocks, blks + done, n * sizeof(a1fs_blk_t));
+		for (size_t i = 0; i < n_logged; i++) {
+			memcpy(blk_ptr(fs, pos + 1 + i), fs_ctx_blk(fs, blks[done + i], STORAGE_META), A1FS_BLOCK_SIZE);
+		}
+		pos += 1 + n_logged;
+		done += n;
+	} while (done < blocks_count + revokes_count);
+
+	a1fs_journal_commit *commit = blk_ptr(fs, pos);
+	memset(commit, 0, A1FS_BLOCK_SIZE);
+	commit->magic = A1FS_JOURNAL_COMMIT_MAGIC;
+	commit->seq = j->seq;
+	commit->checksum = txn_checksum(fs, first, pos - first);
+	for (a1fs_blk_t blk = first; blk <= pos; blk++) {
+		fs->storage->dirty(fs, blk);
+	}
+
+	// One flush for the whole batch; the checksum detects a torn transaction.
+	// Home locations are only written at checkpoint, so until then the
+	// transaction is either all there on replay or not at all. If the flush
+	// fails, the next commit writes the transaction over the same blocks.
+	if (fs_ctx_flush(fs, first, pos - first + 1, MS_SYNC) < 0) {
+		free(blks);
+		return -EIO;
+	}
+	j->head += pos - first + 1;
+	j->seq++;
+
+	for (size_t i = 0; i < blocks_count; i++) {
+		blkset_add(&j->logged, blks[i]);
+	}
+	for (size_t i = 0; i < revokes_count; i++) {
+		blkset_remove(&j->logged, blks[blocks_count + i]);
+	}
+	free(blks);
+	blkset_clear(&j->running);
+	blkset_clear(&j->revoked);
+	blkset_clear(&j->freed);
+	return 0;
+}
+
+void journal_end_op(fs_ctx *fs)
+{
+	journal *j = &fs->journal;
+	if (!j->start) {
+		return;
+	}
+	// Keep transactions well within the journal, so that one never has to be
+	// written in place
+	if (++j->running_ops >= JOURNAL_BATCH_OPS || j->running.count >= JOURNAL_BATCH_BLKS ||
+	    j->running.count >= (j->count - 1) / 4) {
+		journal_commit(fs);
+	}
+}
+
+
+static long ms_since(const struct timespec *t)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/** Commit thread: bounds how long a callback stays uncommitted when the file system is idle. */
+static void *journal_thread_main(void *arg)
+{
+	fs_ctx *fs = (fs_ctx *)arg;
+	journal *j = &fs->journal;
+	iosched_set_class(IO_BACKGROUND);
+
+	fs_ctx_lock(fs);
+	while (!fs->stopping) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += JOURNAL_COMMIT_INTERVAL_MS / 1000;
+		deadline.tv_nsec += (JOURNAL_COMMIT_INTERVAL_MS % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&j->cond, &fs->lock, &deadline);
+		if (!fs->stopping && ms_since(&j->last_commit) >= JOURNAL_COMMIT_INTERVAL_MS) {
+			journal_commit(fs);
+		}
+	}
+	fs_ctx_unlock(fs);
+	return NULL;
+}
+
+void journal_start(fs_ctx *fs)
+{
+	journal *j = &fs->journal;
+	if (!j->start) {
+		return;
+	}
+	if (pthread_create(&j->thread, NULL, journal_thread_main, fs) != 0) {
+		perror("pthread_create");
+		return;
+	}
+	j->thread_running = true;
+}
+
+void journal_stop(fs_ctx *fs)
+{
+	journal *j = &fs->journal;
+	if (j->thread_running) {
+		fs_ctx_lock(fs);
+		fs->stopping = true;
+		pthread_cond_signal(&j->cond);
+		fs_ctx_unlock(fs);
+		pthread_join(j->thread, NULL);
+		j->thread_running = false;
+	}
+
+	fs_ctx_lock(fs);
+	journal_commit(fs);
+	journal_checkpoint(fs);
+	fs_ctx_unlock(fs);
+}
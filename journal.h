@@ -0,0 +1,178 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Metadata journal header file.
+ *
+ * Metadata blocks changed by FUSE callbacks are collected into a running
+ * transaction. Several callbacks are batched into one transaction (group
+ * commit), which is written to the journal with a single flush. Home locations
+ * of committed blocks are only written (checkpointed) when the journal is full
+ * or on unmount. All functions must be called with the fs lock held, except
+ * journal_start(), journal_stop() and journal_peek().
+ *
+ * Callbacks never change metadata in the image itself: the superblock, bitmaps
+ * and inode table live in a working copy in memory, and dentry and extent
+ * blocks get a shadow copy on first access. Home blocks only receive contents
+ * that were committed, so a crash can't leave half of a callback there. Blocks
+ * freed by the running transaction are not reused until it commits.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "a1fs.h"
+#include "blkset.h"
+
+struct fs_ctx;
+
+
+/** Runtime state of the journal. */
+typedef struct journal {
+	/** Block number of the journal header; 0 if the image has no journal. */
+	a1fs_blk_t start;
+	/** Number of journal blocks including the header. */
+	a1fs_blk_t count;
+	/** Offset from the header where the next transaction will be written. */
+	a1fs_blk_t head;
+	/** Sequence number of the running transaction. */
+	uint64_t seq;
+
+	/** Metadata blocks changed by the running transaction. */
+	blkset running;
+	/** Previously committed blocks freed by the running transaction. */
+	blkset revoked;
+	/** Data blocks freed by the running transaction; not reused until it commits. */
+	blkset freed;
+	/** Blocks in committed transactions that are not checkpointed yet. */
+	blkset logged;
+	/** Set if the running transaction lost track of a block (out of memory). */
+	bool overflow;
+	/** Whether a transaction too large for the journal was already reported. */
+	bool warned;
+	/** Number of callbacks in the running transaction. */
+	unsigned running_ops;
+	/** Time of the last commit. */
+	struct timespec last_commit;
+
+	/** Working copy of the blocks before the prefetch list; NULL if there is no journal. */
+	unsigned char *meta;
+	/** Number of blocks in meta. */
+	a1fs_blk_t meta_count;
+	/** Shadow copies of dentry and extent blocks, at the offsets of their data blocks. */
+	unsigned char *shadow;
+	/** Bit per data block, set if it has a shadow copy. */
+	unsigned char *shadowed;
+	/** Block number of the first data block. */
+	a1fs_blk_t first_data_blk;
+
+	/** Thread that commits the running transaction periodically. */
+	pthread_t thread;
+	/** Whether thread has been started. */
+	bool thread_running;
+	/** Signalled to wake up the commit thread on unmount. */
+	pthread_cond_t cond;
+} journal;
+
+/**
+ * Initialize the journal, replay committed transactions left by a crash and
+ * set up the working copy of the metadata.
+ *
+ * @return  true on success; false if the journal header is invalid or there
+ *          is not enough memory.
+ */
+bool journal_init(struct fs_ctx *fs);
+
+/** Free the memory used by the journal. */
+void journal_destroy(struct fs_ctx *fs);
+
+/** Start the periodic commit thread. */
+void journal_start(struct fs_ctx *fs);
+
+/** Stop the commit thread, then commit and checkpoint everything. */
+void journal_stop(struct fs_ctx *fs);
+
+/**
+ * Get the working copy of a block, creating the shadow copy of a data block
+ * accessed with STORAGE_META.
+ *
+ * @param blk    block number.
+ * @param flags  STORAGE_* hints.
+ * @return       pointer to the working copy; NULL if the block is accessed in
+ *               the image.
+ */
+void *journal_get(struct fs_ctx *fs, a1fs_blk_t blk, int flags);
+
+/**
+ * Get the working copy of a block without the fs lock, if it has one. The
+ * contents may be changed or dropped concurrently.
+ *
+ * @return  pointer to the working copy; NULL if the block is in the image.
+ */
+const void *journal_peek(struct fs_ctx *fs, a1fs_blk_t blk);
+
+/**
+ * Get the block number of a pointer into a working copy.
+ *
+ * @param blk  pointer to the variable that receives the block number.
+ * @return     true if ptr is in a working copy; false otherwise.
+ */
+bool journal_blk_of(struct fs_ctx *fs, const void *ptr, a1fs_blk_t *blk);
+
+/** Fill the working copies of a range of blocks with zeros. */
+void journal_zero(struct fs_ctx *fs, a1fs_blk_t blk, size_t count);
+
+/** Whether a block was freed by the running transaction and can't be reused yet. */
+bool journal_pinned(struct fs_ctx *fs, a1fs_blk_t blk);
+
+/**
+ * Record that a metadata range was changed.
+ *
+ * @param ptr  pointer into fs_ctx_blk() memory.
+ * @param len  length of the changed range in bytes.
+ */
+void journal_dirty(struct fs_ctx *fs, const void *ptr, size_t len);
+
+/**
+ * Record that blocks were freed, so that older logged copies of them are not
+ * replayed over whatever the blocks are reused for. Drops their shadow copies.
+ *
+ * @param first  first freed block number.
+ * @param count  number of freed blocks.
+ */
+void journal_revoke(struct fs_ctx *fs, a1fs_blk_t first, size_t count);
+
+/** Finish a callback; commits the running transaction once the batch is full. */
+void journal_end_op(struct fs_ctx *fs);
+
+/**
+ * Commit the running transaction with a single flush.
+ *
+ * @return  0 on success; -EIO if the transaction isn't durable, in which case
+ *          it stays running for the next commit.
+ */
+int journal_commit(struct fs_ctx *fs);
+
+/**
+ * Write the committed contents of logged blocks to their home locations and
+ * empty the journal.
+ *
+ * @return  true on success; false if out of memory (the journal is kept).
+ */
+bool journal_checkpoint(struct fs_ctx *fs);
@@ -0,0 +1,166 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Kernel cache invalidation implementation.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Using 2.9.x FUSE API
+#define FUSE_USE_VERSION 29
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+#include "fs_ctx.h"
+#include "kcache.h"
+
+
+void kcache_init(fs_ctx *fs, bool enabled)
+{
+	kcache *kc = &fs->kcache;
+	memset(kc, 0, sizeof(*kc));
+	kc->enabled = enabled;
+	pthread_cond_init(&kc->cond, NULL);
+}
+
+void kcache_destroy(fs_ctx *fs)
+{
+	kcache *kc = &fs->kcache;
+	free(kc->names);
+	pthread_cond_destroy(&kc->cond);
+}
+
+void kcache_invalidate(fs_ctx *fs, const char *path)
+{
+	kcache *kc = &fs->kcache;
+	if (!kc->ch || !path) {
+		return;
+	}
+
+	while (*path == '/') {
+		path++;
+	}
+	size_t len = strcspn(path, "/");
+	// Entries directly in the root also change the attributes of the root
+	if (len == 0 || path[len + strspn(path + len, "/")] == '\0') {
+		kc->root = true;
+	}
+	if (len > 0 && len < A1FS_NAME_MAX) {
+		for (size_t i = 0; i < kc->count; i++) {
+			if (strncmp(kc->names[i], path, len) == 0 && kc->names[i][len] == '\0') {
+				return;
+			}
+		}
+		if (kc->count == kc->cap) {
+			size_t cap = kc->cap ? kc->cap * 2 : 16;
+			void *names = realloc(kc->names, cap * sizeof(*kc->names));
+			if (!names) {
+				return;
+			}
+			kc->names = names;
+			kc->cap = cap;
+		}
+		memcpy(kc->names[kc->count], path, len);
+		kc->names[kc->count][len] = '\0';
+		kc->count++;
+	}
+	pthread_cond_signal(&kc->cond);
+}
+
+static void *kcache_thread_main(void *arg)
+{
+	fs_ctx *fs = (fs_ctx *)arg;
+	kcache *kc = &fs->kcache;
+	char (*names)[A1FS_NAME_MAX] = NULL;
+	size_t cap = 0;
+	iosched_set_class(IO_BACKGROUND);
+
+	fs_ctx_lock(fs);
+	while (!fs->stopping) {
+		if (kc->count == 0 && !kc->root) {
+			pthread_cond_wait(&kc->cond, &fs->lock);
+			continue;
+		}
+
+		// Take the queue so that callbacks can go on while the kernel is
+		// notified; the kernel may need to wait for one of them to finish
+		char (*tmp)[A1FS_NAME_MAX] = names;
+		names = kc->names;
+		kc->names = tmp;
+		size_t count = kc->count;
+		kc->count = 0;
+		size_t tmp_cap = cap;
+		cap = kc->cap;
+		kc->cap = tmp_cap;
+		bool root = kc->root;
+		kc->root = false;
+		fs_ctx_unlock(fs);
+
+		for (size_t i = 0; i < count; i++) {
+			// ENOENT only means the kernel didn't have it cached
+			int ret = fuse_lowlevel_notify_inval_entry(kc->ch, FUSE_ROOT_ID,
+			                                           names[i], strlen(names[i]));
+			if (ret < 0 && ret != -ENOENT) {
+				fprintf(stderr, "Failed to invalidate /%s: %s\n", names[i], strerror(-ret));
+			}
+		}
+		if (root) {
+			fuse_lowlevel_notify_inval_inode(kc->ch, FUSE_ROOT_ID, -1, 0);
+		}
+
+		fs_ctx_lock(fs);
+	}
+	fs_ctx_unlock(fs);
+	free(names);
+	return NULL;
+}
+
+void kcache_start(fs_ctx *fs, struct fuse *f)
+{
+	kcache *kc = &fs->kcache;
+	if (!kc->enabled || !f) {
+		return;
+	}
+	struct fuse_chan *ch = fuse_session_next_chan(fuse_get_session(f), NULL);
+	if (!ch) {
+		return;
+	}
+	if (pthread_create(&kc->thread, NULL, kcache_thread_main, fs) != 0) {
+		perror("pthread_create");
+		return;
+	}
+	fs_ctx_lock(fs);
+	kc->ch = ch;
+	fs_ctx_unlock(fs);
+	kc->thread_running = true;
+}
+
+void kcache_stop(fs_ctx *fs)
+{
+	kcache *kc = &fs->kcache;
+	if (!kc->thread_running) {
+		return;
+	}
+	fs_ctx_lock(fs);
+	fs->stopping = true;
+	kc->ch = NULL;
+	pthread_cond_signal(&kc->cond);
+	fs_ctx_unlock(fs);
+	pthread_join(kc->thread, NULL);
+	kc->thread_running = false;
+}
@@ -0,0 +1,91 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Kernel cache invalidation header file.
+ *
+ * In kernel cache mode the kernel keeps entries, attributes and file pages for
+ * a long time instead of revalidating them on every access. This is safe since
+ * every change goes through the kernel, which updates its caches for the
+ * objects a request works on - except for changes a1fs makes on its own, such
+ * as compacting a directory after its last handle is closed. Those are queued
+ * here and a background thread tells the kernel to drop the stale state. The
+ * notifications can't be sent from a callback since the kernel may hold the
+ * locks they need while waiting for the reply.
+ *
+ * The high-level FUSE API doesn't expose node ids other than the root's, so a
+ * change anywhere below a top-level entry invalidates that entry, which makes
+ * the kernel look up the whole subtree again. All functions must be called
+ * with the fs lock held, except kcache_start() and kcache_stop().
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "a1fs.h"
+
+struct fs_ctx;
+struct fuse;
+
+
+/** Runtime state of kernel cache invalidation. */
+typedef struct kcache {
+	/** Whether kernel cache mode is on. */
+	bool enabled;
+	/** FUSE channel notifications are sent on. */
+	struct fuse_chan *ch;
+	/** Top-level entries to invalidate. */
+	char (*names)[A1FS_NAME_MAX];
+	size_t count, cap;
+	/** Whether to invalidate the attributes of the root directory. */
+	bool root;
+
+	/** Background thread that sends the notifications. */
+	pthread_t thread;
+	/** Whether thread has been started. */
+	bool thread_running;
+	/** Signalled when invalidations are queued or on unmount. */
+	pthread_cond_t cond;
+} kcache;
+
+/**
+ * Initialize kernel cache invalidation state.
+ *
+ * @param enabled  whether kernel cache mode is on.
+ */
+void kcache_init(struct fs_ctx *fs, bool enabled);
+
+/** Free kernel cache invalidation state. */
+void kcache_destroy(struct fs_ctx *fs);
+
+/**
+ * Start the background thread.
+ *
+ * @param f  FUSE instance the file system is mounted with.
+ */
+void kcache_start(struct fs_ctx *fs, struct fuse *f);
+
+/** Stop the background thread, dropping invalidations not yet sent. */
+void kcache_stop(struct fs_ctx *fs);
+
+/**
+ * Queue invalidation of the cached state of the file or directory at path and
+ * of the attributes of its parent directory.
+ *
+ * @param path  absolute path within the file system.
+ */
+void kcache_invalidate(struct fs_ctx *fs, const char *path);
@@ -26,10 +26,10 @@
 #include "util.h"
 
 
-void *map_file(const char *path, size_t block_size, size_t *size)
+void *map_file(const char *path, size_t block_size, bool private, size_t *size, int *fd_out)
 {
-	// Open the file for reading and writing
-	int fd = open(path, O_RDWR);
+	// Open the file for reading and writing, unless changes stay in memory
+	int fd = open(path, private ? O_RDONLY : O_RDWR);
 	if (fd < 0) {
 		perror(path);
 		return NULL;
@@ -54,18 +54,61 @@ void *map_file(const char *path, size_t block_size, size_t *size)
 	}
 
 	// Map file contents into memory
-	addr = mmap(NULL, s.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (addr == MAP_FAILED) {
-		perror("mmap");
-		addr = NULL;
+	addr = map_range(fd, 0, s.st_size, private ? MAP_PRIVATE : MAP_SHARED);
+	if (!addr) {
 		goto end;
 	}
 	assert(is_aligned((size_t)addr, block_size));
 	*size = s.st_size;
 
 end:
+	if (addr && fd_out) {
+		*fd_out = fd;
+		return addr;
+	}
 	//NOTE: memory mapping keeps a reference to the open file; can safely close
 	// the file descriptor now; a future munmap() will close the file
 	close(fd);
 	return addr;
 }
+
+void *map_range(int fd, off_t off, size_t len, int flags)
+{
+	void *hint = NULL;
+	void *reserved = MAP_FAILED;
+	size_t map_len = align_up(len, sysconf(_SC_PAGESIZE));
+	size_t reserved_len = map_len + MAP_HUGE_ALIGN;
+	if (len >= MAP_HUGE_ALIGN) {
+		// Reserve enough address space to find an aligned spot
+		reserved = mmap(NULL, reserved_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (reserved != MAP_FAILED) {
+		// First address in the reservation congruent to off; less than
+		// MAP_HUGE_ALIGN past its start, so the mapping fits
+		size_t phase = off % MAP_HUGE_ALIGN;
+		hint = (void *)(align_up((size_t)reserved - phase, MAP_HUGE_ALIGN) + phase);
+		assert(hint >= reserved && hint + map_len <= reserved + reserved_len);
+	}
+
+	void *addr = mmap(hint, len, PROT_READ | PROT_WRITE, flags | (hint ? MAP_FIXED : 0), fd, off);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		addr = NULL;
+	}
+	if (reserved != MAP_FAILED) {
+		// Give back whatever the mapping didn't replace
+		void *res_end = reserved + reserved_len;
+		if (!addr) {
+			munmap(reserved, reserved_len);
+		} else {
+			if (addr > reserved) {
+				munmap(reserved, addr - reserved);
+			}
+			void *map_end = addr + map_len;
+			if (map_end < res_end) {
+				munmap(map_end, res_end - map_end);
+			}
+		}
+	}
+	return addr;
+}
@@ -18,7 +18,13 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <sys/types.h>
+
+
+/** Mappings at least this large are aligned to it so that huge pages fit. */
+#define MAP_HUGE_ALIGN (2 * 1024 * 1024)
 
 
 /**
@@ -28,8 +34,27 @@
  *
  * @param path        image file path.
  * @param block_size  file system block size.
+ * @param private     true to open the file read-only and map it copy-on-write,
+ *                    so that changes are never written to the file.
  * @param size        pointer to the variable that will be set to file size.
+ * @param fd          pointer to the variable that receives the open file
+ *                    descriptor; NULL to close it.
  * @return            pointer to the file mapping in memory on success;
  *                    NULL on failure.
  */
-void *map_file(const char *path, size_t block_size, size_t *size);
+void *map_file(const char *path, size_t block_size, bool private, size_t *size, int *fd);
+
+/**
+ * Map a part of an open file into memory for reading and writing.
+ *
+ * Mappings of at least MAP_HUGE_ALIGN bytes are placed so that file offsets
+ * that are multiples of MAP_HUGE_ALIGN land on addresses aligned to it, which
+ * lets the kernel back them with transparent huge pages.
+ *
+ * @param fd     open file descriptor.
+ * @param off    file offset; must be a multiple of the page size.
+ * @param len    mapping size in bytes.
+ * @param flags  MAP_SHARED or MAP_PRIVATE.
+ * @return       pointer to the mapping on success; NULL on failure.
+ */
+void *map_range(int fd, off_t off, size_t len, int flags);
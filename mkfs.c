@@ -25,14 +25,26 @@
 
 #include "a1fs.h"
 #include "map.h"
+#include "util.h"
 #include <time.h>
 
+/** Upper limit for the default journal size in blocks. */
+#define MKFS_JOURNAL_BLKS_MAX 1024
+/** Upper limit for the default prefetch list size in blocks. */
+#define MKFS_PREFETCH_BLKS_MAX 16
+/** Data region alignment in blocks with -a, so that it can use huge pages. */
+#define MKFS_DATA_ALIGN_BLKS (MAP_HUGE_ALIGN / A1FS_BLOCK_SIZE)
+
 /** Command line options. */
 typedef struct mkfs_opts {
 	/** File system image file path. */
 	const char *img_path;
 	/** Number of inodes. */
 	size_t n_inodes;
+	/** Number of journal blocks; -1 picks a default based on image size. */
+	long n_journal_blks;
+	/** Number of prefetch list blocks; -1 picks a default based on image size. */
+	long n_prefetch_blks;
 
 	/** Print help and exit. */
 	bool help;
@@ -40,6 +52,8 @@ typedef struct mkfs_opts {
 	bool force;
 	/** Zero out image contents. */
 	bool zero;
+	/** Align the data region to MKFS_DATA_ALIGN_BLKS. */
+	bool align;
 
 } mkfs_opts;
 
@@ -51,6 +65,12 @@ its size must be a multiple of a1fs block size - %zu bytes.\n\
 \n\
 Options:\n\
     -i num  number of inodes; required argument\n\
+    -j num  number of journal blocks; 0 disables the journal\n\
+            (default: 1/16 of the image, at most %d blocks)\n\
+    -p num  number of prefetch list blocks; 0 disables recording the blocks\n\
+            read after mount (default: 1/256 of the image, at most %d blocks)\n\
+    -a      align the data region to 2 MiB so that it can be mapped with\n\
+            huge pages; the journal grows to fill the gap\n\
     -h      print help and exit\n\
     -f      force format - overwrite existing a1fs file system\n\
     -z      zero out image contents\n\
@@ -58,16 +78,19 @@ Options:\n\
 
 static void print_help(FILE *f, const char *progname)
 {
-	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE);
+	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE, MKFS_JOURNAL_BLKS_MAX, MKFS_PREFETCH_BLKS_MAX);
 }
 
 
 static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 {
 	char o;
-	while ((o = getopt(argc, argv, "i:hfvz")) != -1) {
+	while ((o = getopt(argc, argv, "i:j:p:ahfvz")) != -1) {
 		switch (o) {
 			case 'i': opts->n_inodes = strtoul(optarg, NULL, 10); break;
+			case 'j': opts->n_journal_blks = strtol(optarg, NULL, 10); break;
+			case 'p': opts->n_prefetch_blks = strtol(optarg, NULL, 10); break;
+			case 'a': opts->align = true; break;
 
 			case 'h': opts->help  = true; return true;// skip other arguments
 			case 'f': opts->force = true; break;
@@ -88,6 +111,14 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 		fprintf(stderr, "Missing or invalid number of inodes\n");
 		return false;
 	}
+	if (opts->n_journal_blks < -1) {
+		fprintf(stderr, "Invalid number of journal blocks\n");
+		return false;
+	}
+	if (opts->n_prefetch_blks < -1) {
+		fprintf(stderr, "Invalid number of prefetch list blocks\n");
+		return false;
+	}
 	return true;
 }
 
@@ -133,13 +164,31 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 
 	sb->free_inodes_count = sb->inodes_count - 1;		// reserve inodes_table[0] for root directory inode
 	sb->used_dirs_count = 1;		// root directory is in used
+	sb->orphan_head = 0;		// no unlinked inodes waiting to be freed
 	int inode_bitmap_blks_count = (sb->inodes_count % (A1FS_BLOCK_SIZE * 8) == 0)
 			? sb->inodes_count / (A1FS_BLOCK_SIZE * 8)
 			: (sb->inodes_count / (A1FS_BLOCK_SIZE * 8)) + 1;
 	int inode_table_blks_count = (sb->inodes_count * sb->inode_size % A1FS_BLOCK_SIZE == 0)
 			? sb->inodes_count * sb->inode_size / A1FS_BLOCK_SIZE
 			: (sb->inodes_count * sb->inode_size / A1FS_BLOCK_SIZE) + 1;
-	int remaining_blks_count = sb->blocks_count - 1 - inode_bitmap_blks_count - inode_table_blks_count;
+	int journal_blks_count = opts->n_journal_blks;
+	if (journal_blks_count < 0) {
+		journal_blks_count = sb->blocks_count / 16;
+		if (journal_blks_count > MKFS_JOURNAL_BLKS_MAX) {
+			journal_blks_count = MKFS_JOURNAL_BLKS_MAX;
+		}
+	}
+	if (journal_blks_count < 4) {
+		journal_blks_count = 0;		// header plus at least one single-block transaction
+	}
+	int prefetch_blks_count = opts->n_prefetch_blks;
+	if (prefetch_blks_count < 0) {
+		prefetch_blks_count = sb->blocks_count / 256;
+		if (prefetch_blks_count > MKFS_PREFETCH_BLKS_MAX) {
+			prefetch_blks_count = MKFS_PREFETCH_BLKS_MAX;
+		}
+	}
+	int remaining_blks_count = sb->blocks_count - 1 - inode_bitmap_blks_count - inode_table_blks_count - prefetch_blks_count - journal_blks_count;
 
 			// Check if the image file has room for at least 1 data block
 	if (remaining_blks_count <= 1) {
@@ -155,12 +204,29 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	sb->inode_bitmap_blk = 1;
 	sb->data_bitmap_blk = sb->inode_bitmap_blk + inode_bitmap_blks_count;
 	sb->inode_table_blk = sb->data_bitmap_blk + data_bitmap_blks_count;
-	sb->first_data_blk = sb->inode_table_blk + inode_table_blks_count;
+	sb->prefetch_blk = sb->inode_table_blk + inode_table_blks_count;
+	sb->prefetch_blks_count = prefetch_blks_count;
+	sb->journal_blk = sb->prefetch_blk + prefetch_blks_count;
+	sb->journal_blks_count = journal_blks_count;
+	sb->first_data_blk = sb->journal_blk + journal_blks_count;
+	if (opts->align) {
+		a1fs_blk_t aligned = align_up(sb->first_data_blk, MKFS_DATA_ALIGN_BLKS);
+		if (aligned + 1 >= sb->blocks_count) {
+			return false;
+		}
+		// Use the gap for the journal rather than leave it unused
+		if (journal_blks_count > 0) {
+			journal_blks_count += aligned - sb->first_data_blk;
+			sb->journal_blks_count = journal_blks_count;
+		}
+		sb->first_data_blk = aligned;
+		sb->free_data_blocks_count = sb->blocks_count - aligned;
+	}
 	sb->data_blocks_count = sb->blocks_count - sb->first_data_blk;
 
 
 			// Check if the image file is large enough to accommodate Superblock, bitmaps and inode table
-	if (size <= (size_t)(1 + inode_bitmap_blks_count + data_bitmap_blks_count + inode_table_blks_count) * A1FS_BLOCK_SIZE) {
+	if (size <= (size_t)(1 + inode_bitmap_blks_count + data_bitmap_blks_count + inode_table_blks_count + prefetch_blks_count + journal_blks_count) * A1FS_BLOCK_SIZE) {
 		return false;
 	}
 
@@ -188,13 +254,32 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	root_inode_ptr->extents_blk = -1;		// no extents block for empty root directory
 	root_inode_ptr->extents_count = 0;
 
+		// 5. Prefetch list - empty until a mount records one
+	memset(image + A1FS_BLOCK_SIZE * sb->prefetch_blk, 0, prefetch_blks_count * A1FS_BLOCK_SIZE);
+
+		// 6. Journal
+	if (journal_blks_count > 0) {
+		struct a1fs_journal_header *journal_header = (struct a1fs_journal_header *)(image + A1FS_BLOCK_SIZE * sb->journal_blk);
+		memset(journal_header, 0, A1FS_BLOCK_SIZE);
+		journal_header->magic = A1FS_JOURNAL_MAGIC;
+		// Start from the current time in ns so that transactions left over from
+		// a previous format of this image never match the expected sequence
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		journal_header->seq = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+		journal_header->tail = 1;
+		memset((void *)journal_header + A1FS_BLOCK_SIZE, 0, A1FS_BLOCK_SIZE);		// no valid transaction at the tail
+	}
+
 	return true;
 }
 
 
 int main(int argc, char *argv[])
 {
-	mkfs_opts opts = {0};// defaults are all 0
+	mkfs_opts opts = {0};// defaults are all 0, except for the journal and prefetch list sizes
+	opts.n_journal_blks = -1;
+	opts.n_prefetch_blks = -1;
 	if (!parse_args(argc, argv, &opts)) {
 		// Invalid arguments, print help to stderr
 		print_help(stderr, argv[0]);
@@ -208,7 +293,7 @@ int main(int argc, char *argv[])
 
 	// Map image file into memory
 	size_t size;
-	void *image = map_file(opts.img_path, A1FS_BLOCK_SIZE, &size);
+	void *image = map_file(opts.img_path, A1FS_BLOCK_SIZE, false, &size, NULL);
 	if (!image) {
 		return 1;
 	}
@@ -28,9 +28,44 @@
 
 #define A1FS_OPT(t, p) { t, offsetof(a1fs_opts, p), 1 }
 
+/** Default dirty data budget in MiB. */
+#define DEFAULT_DIRTY_BUDGET 32
+/** Default block cache size in MiB. */
+#define DEFAULT_CACHE_SIZE 64
+/** Default mapping window size in MiB. */
+#define DEFAULT_WINDOW_SIZE 1024
+/** Default number of mapped windows. */
+#define DEFAULT_WINDOWS 16
+/** Default largest readahead window in KiB. */
+#define DEFAULT_READAHEAD 1024
+/** Default number of request processing threads. */
+#define DEFAULT_QUEUES 1
+/** Default number of background task pool threads. */
+#define DEFAULT_WORKERS 2
+
 static const struct fuse_opt opt_spec[] = {
 	A1FS_OPT("-h"    , help),
 	A1FS_OPT("--help", help),
+	A1FS_OPT("dirty_budget=%u", dirty_budget),
+	A1FS_OPT("backend=%s"     , backend),
+	A1FS_OPT("cache_size=%u"  , cache_size),
+	A1FS_OPT("odirect"        , odirect),
+	A1FS_OPT("window_size=%u" , window_size),
+	A1FS_OPT("windows=%u"     , windows),
+	A1FS_OPT("hugepage"       , hugepage),
+	A1FS_OPT("random_meta"    , random_meta),
+	A1FS_OPT("seq_size=%u"    , seq_size),
+	A1FS_OPT("mlock_meta=%u"  , mlock_meta),
+	A1FS_OPT("ephemeral"      , ephemeral),
+	A1FS_OPT("readahead=%u"   , readahead),
+	A1FS_OPT("record=%u"      , record),
+	A1FS_OPT("noreplay"       , noreplay),
+	A1FS_OPT("kcache=%u"      , kcache),
+	A1FS_OPT("writeback_cache", writeback_cache),
+	A1FS_OPT("queues=%u"      , queues),
+	A1FS_OPT("workers=%u"     , workers),
+	A1FS_OPT("bg_rate=%u"     , bg_rate),
+	A1FS_OPT("fg_target=%u"   , fg_target),
 	FUSE_OPT_END
 };
 
@@ -38,12 +73,75 @@ static const char *help_str = "\
 Usage: %s image mountpoint [options]\n\
 \n\
 Mount a1fs image file under mount point directory. Use fusermount(1) to \n\
-unmount. Only single-threaded mount is supported; -s FUSE option is implied.\n\
+unmount. Requests are processed by the threads set with -o queues; the -s\n\
+FUSE option has no effect.\n\
 \n\
 general options:\n\
     -o opt,[opt...]        mount options\n\
     -h   --help            print help\n\
 \n\
+a1fs options:\n\
+    -o dirty_budget=N      dirty file data allowed before writers are\n\
+                           throttled, in MiB; 0 disables background\n\
+                           writeback (default: 32)\n\
+    -o backend=NAME        image access method: mmap maps the whole image,\n\
+                           cache uses pread/pwrite and a block cache,\n\
+                           uring uses io_uring and a block cache,\n\
+                           window maps the image in windows on demand,\n\
+                           pmem maps the image and persists changes with\n\
+                           CPU cache line flushes, for DAX file systems\n\
+                           (default: mmap)\n\
+    -o cache_size=N        block cache size in MiB, in addition to the\n\
+                           superblock, bitmaps, inode table and journal\n\
+                           which are always cached (default: 64)\n\
+    -o odirect             open the image with O_DIRECT so that its blocks\n\
+                           are only cached once, in the block cache; implies\n\
+                           backend=cache unless another cache backend is set\n\
+    -o window_size=N       mapping window size in MiB (default: 1024)\n\
+    -o windows=N           number of windows kept mapped; the least recently\n\
+                           used one is unmapped to map another (default: 16)\n\
+    -o hugepage            ask for transparent huge pages for the data region\n\
+                           with the mmap and window backends; see the -a\n\
+                           option of mkfs.a1fs\n\
+    -o random_meta         turn off kernel readahead for the bitmaps and\n\
+                           inode table with the mmap and window backends\n\
+    -o seq_size=N          with the mmap and window backends, tell the kernel\n\
+                           to read ahead aggressively in files of at least\n\
+                           N MiB that are read from the start; 0 disables\n\
+                           (default: 0)\n\
+    -o mlock_meta=N        load the superblock, bitmaps and inode table at\n\
+                           mount and lock them in memory, up to N MiB; needs\n\
+                           RLIMIT_MEMLOCK to allow it; 0 disables (default: 0)\n\
+    -o ephemeral           map the image copy-on-write and keep all changes\n\
+                           in memory; the image file is opened read-only and\n\
+                           is left as it was on unmount (mmap backend only)\n\
+    -o readahead=N         largest readahead window for files read\n\
+                           sequentially, in KiB; the window grows with the\n\
+                           length of the sequential run and shrinks on random\n\
+                           reads; 0 disables (default: 1024)\n\
+    -o record=N            record the data blocks read during the first N\n\
+                           seconds after mount and save them in the image's\n\
+                           prefetch list (see mkfs -p); 0 disables\n\
+                           (default: 0)\n\
+    -o noreplay            don't read ahead the saved prefetch list at mount\n\
+    -o kcache=N            let the kernel cache entries and attributes for N\n\
+                           seconds and keep file pages across opens; a1fs\n\
+                           invalidates what it changes on its own; 0 uses\n\
+                           the FUSE defaults (default: 0)\n\
+    -o writeback_cache     let the kernel cache writes and send them in\n\
+                           large page-aligned pieces; needs FUSE support\n\
+    -o queues=N            number of threads processing requests, each\n\
+                           reading from its own clone of the /dev/fuse fd;\n\
+                           all but the first are pinned to CPUs (default: 1)\n\
+    -o workers=N           number of low priority threads running background\n\
+                           work such as freeing deleted files (default: 2)\n\
+    -o bg_rate=N           limit background I/O (prefetch list replay,\n\
+                           age-based writeback, freeing deleted files) to\n\
+                           N MiB/s; 0 for no limit (default: 0)\n\
+    -o fg_target=N         back background work off while the p99 time\n\
+                           requests wait for and hold the fs lock is above\n\
+                           N ms; 0 disables (default: 0)\n\
+\n\
 ";
 
 // Callback for fuse_opt_parse()
@@ -62,6 +160,13 @@ static int opt_proc(void *data, const char *arg, int key, struct fuse_args *out)
 
 bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 {
+	opts->dirty_budget = DEFAULT_DIRTY_BUDGET;
+	opts->cache_size = DEFAULT_CACHE_SIZE;
+	opts->window_size = DEFAULT_WINDOW_SIZE;
+	opts->windows = DEFAULT_WINDOWS;
+	opts->readahead = DEFAULT_READAHEAD;
+	opts->queues = DEFAULT_QUEUES;
+	opts->workers = DEFAULT_WORKERS;
 	if (fuse_opt_parse(args, opts, opt_spec, opt_proc) != 0) {
 		return false;
 	}
@@ -76,13 +181,20 @@ bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 		return false;
 	}
 
-	// Only single-threaded mount is supported
-	fuse_opt_add_arg(args, "-s");
-	// Limit the size of reads and writes to 4K
+	// Limit the size of reads and writes to 4K, except for the writebacks
+	// merged by the kernel writeback cache
 	fuse_opt_add_arg(args, "-o");
 	fuse_opt_add_arg(args, "max_read=4096");
 	fuse_opt_add_arg(args, "-o");
-	fuse_opt_add_arg(args, "max_write=4096");
+	fuse_opt_add_arg(args, opts->writeback_cache ? "big_writes,max_write=131072" : "max_write=4096");
+	// a1fs is the only writer, so the kernel caches can be trusted
+	if (opts->kcache > 0) {
+		char buf[128];
+		snprintf(buf, sizeof(buf), "kernel_cache,entry_timeout=%u,attr_timeout=%u",
+		         opts->kcache, opts->kcache);
+		fuse_opt_add_arg(args, "-o");
+		fuse_opt_add_arg(args, buf);
+	}
 
 	return true;
 }
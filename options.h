@@ -29,6 +29,46 @@ typedef struct a1fs_opts {
 	const char *img_path;
 	/** Print help and exit. FUSE option. */
 	int help;
+	/** Dirty data budget for background writeback in MiB; 0 to disable. */
+	unsigned dirty_budget;
+	/** Storage backend name; NULL for the default. */
+	const char *backend;
+	/** Block cache size in MiB for the cache backend. */
+	unsigned cache_size;
+	/** Access the image with O_DIRECT, bypassing the host page cache. */
+	int odirect;
+	/** Mapping window size in MiB for the window backend. */
+	unsigned window_size;
+	/** Number of windows kept mapped by the window backend. */
+	unsigned windows;
+	/** Advise the kernel to use huge pages for the data region. */
+	int hugepage;
+	/** Advise the kernel not to read ahead in the metadata region. */
+	int random_meta;
+	/** Size in MiB from which files are advised to be read sequentially. */
+	unsigned seq_size;
+	/** Budget in MiB for metadata locked in memory; 0 to disable. */
+	unsigned mlock_meta;
+	/** Keep all changes in memory and never write to the image file. */
+	int ephemeral;
+	/** Largest readahead window in KiB; 0 to disable readahead. */
+	unsigned readahead;
+	/** Seconds after mount to record blocks read for the prefetch list. */
+	unsigned record;
+	/** Don't prefetch the saved list at mount. */
+	int noreplay;
+	/** Kernel entry and attribute cache timeout in seconds; 0 to disable. */
+	unsigned kcache;
+	/** Use the kernel writeback cache. */
+	int writeback_cache;
+	/** Number of threads processing requests, each with its own /dev/fuse fd. */
+	unsigned queues;
+	/** Number of background task pool threads. */
+	unsigned workers;
+	/** Background I/O budget in MiB/s; 0 for no limit. */
+	unsigned bg_rate;
+	/** Foreground p99 latency target in ms above which background work backs off; 0 to disable. */
+	unsigned fg_target;
 
 } a1fs_opts;
 
@@ -0,0 +1,299 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Persistent memory storage backend implementation.
+ */
+
+// for MAP_SYNC
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define PMEM_X86 1
+#endif
+
+#include "fs_ctx.h"
+#include "map.h"
+#include "pmem.h"
+
+
+/** CPU cache line size in bytes. */
+#define CACHE_LINE 64
+
+#ifdef PMEM_X86
+
+/** Cache line write-back instructions, best first. */
+typedef enum { FLUSH_CLWB, FLUSH_CLFLUSHOPT, FLUSH_CLFLUSH } flush_kind;
+
+static flush_kind flush_insn = FLUSH_CLFLUSH;
+
+static void detect_flush_insn(void)
+{
+	unsigned a, b, c, d;
+	if (__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+		if (b & (1u << 24)) {
+			flush_insn = FLUSH_CLWB;
+		} else if (b & (1u << 23)) {
+			flush_insn = FLUSH_CLFLUSHOPT;
+		}
+	}
+}
+
+__attribute__((target("clwb")))
+static void flush_clwb(uintptr_t p, uintptr_t end)
+{
+	for (; p < end; p += CACHE_LINE) {
+		_mm_clwb((void *)p);
+	}
+}
+
+__attribute__((target("clflushopt")))
+static void flush_clflushopt(uintptr_t p, uintptr_t end)
+{
+	for (; p < end; p += CACHE_LINE) {
+		_mm_clflushopt((void *)p);
+	}
+}
+
+/** Start writing back the cache lines that hold a byte range. */
+static void flush_lines(const void *ptr, size_t len)
+{
+	uintptr_t p = (uintptr_t)ptr & ~(uintptr_t)(CACHE_LINE - 1);
+	uintptr_t end = (uintptr_t)ptr + len;
+	switch (flush_insn) {
+		case FLUSH_CLWB      : flush_clwb(p, end); break;
+		case FLUSH_CLFLUSHOPT: flush_clflushopt(p, end); break;
+		case FLUSH_CLFLUSH:
+			// Ordered with other stores; no fence needed, but harmless
+			for (; p < end; p += CACHE_LINE) {
+				_mm_clflush((void *)p);
+			}
+			break;
+	}
+}
+
+/** Wait until all flushed lines and non-temporal stores reach memory. */
+static void drain(void)
+{
+	_mm_sfence();
+}
+
+/** Copy with non-temporal stores; the unaligned edges are flushed instead. */
+static void copy_nt(void *dst, const void *src, size_t len)
+{
+	size_t head = (16 - (uintptr_t)dst % 16) % 16;
+	if (head > len) {
+		head = len;
+	}
+	memcpy(dst, src, head);
+	flush_lines(dst, head);
+	dst += head;
+	src += head;
+	len -= head;
+
+	for (; len >= 64; dst += 64, src += 64, len -= 64) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)src);
+		__m128i v1 = _mm_loadu_si128((const __m128i *)src + 1);
+		__m128i v2 = _mm_loadu_si128((const __m128i *)src + 2);
+		__m128i v3 = _mm_loadu_si128((const __m128i *)src + 3);
+		_mm_stream_si128((__m128i *)dst, v0);
+		_mm_stream_si128((__m128i *)dst + 1, v1);
+		_mm_stream_si128((__m128i *)dst + 2, v2);
+		_mm_stream_si128((__m128i *)dst + 3, v3);
+	}
+	for (; len >= 16; dst += 16, src += 16, len -= 16) {
+		_mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+	}
+	memcpy(dst, src, len);
+	flush_lines(dst, len);
+}
+
+#endif// PMEM_X86
+
+
+/* Backend operations */
+static void *pmem_get(fs_ctx *fs, a1fs_blk_t blk, int flags)
+{
+	(void)flags;// unused
+	return fs->image + (size_t)blk * A1FS_BLOCK_SIZE;
+}
+
+static bool pmem_open(fs_ctx *fs, const a1fs_opts *opts)
+{
+#ifdef PMEM_X86
+	fs->image = map_file(opts->img_path, A1FS_BLOCK_SIZE, false, &fs->size, &fs->fd);
+	if (!fs->image) {
+		return false;
+	}
+	detect_flush_insn();
+	pmem_state *pm = &fs->pmem;
+	blkset_init(&pm->dirty);
+	pm->dax = false;
+
+#ifdef MAP_SYNC
+	// MAP_SYNC only succeeds on DAX; it makes the file system metadata for a
+	// page durable before the page can be written to
+	int flags = MAP_SHARED_VALIDATE | MAP_SYNC;
+	void *probe = mmap(NULL, A1FS_BLOCK_SIZE, PROT_READ | PROT_WRITE, flags, fs->fd, 0);
+	if (probe != MAP_FAILED) {
+		munmap(probe, A1FS_BLOCK_SIZE);
+		void *image = map_range(fs->fd, 0, fs->size, flags);
+		if (image) {
+			munmap(fs->image, fs->size);
+			fs->image = image;
+			pm->dax = true;
+		}
+	}
+#endif
+	if (!pm->dax) {
+		fprintf(stderr, "%s is not on a DAX file system; using msync() "
+		        "in addition to cache line flushes\n", opts->img_path);
+	}
+	return true;
+#else
+	(void)fs;// unused
+	(void)opts;// unused
+	fprintf(stderr, "The pmem backend is only supported on x86\n");
+	return false;
+#endif
+}
+
+static a1fs_blk_t pmem_blk_of(fs_ctx *fs, const void *ptr)
+{
+	return (ptr - fs->image) / A1FS_BLOCK_SIZE;
+}
+
+static void pmem_dirty(fs_ctx *fs, a1fs_blk_t blk)
+{
+	blkset_add(&fs->pmem.dirty, blk);
+}
+
+#ifdef PMEM_X86
+
+static int pmem_sync(fs_ctx *fs)
+{
+	drain();
+	if (!fs->pmem.dax && fdatasync(fs->fd) < 0) {
+		perror("fdatasync");
+		return -1;
+	}
+	return 0;
+}
+
+static void flush_blk(fs_ctx *fs, a1fs_blk_t blk)
+{
+	flush_lines(pmem_get(fs, blk, 0), A1FS_BLOCK_SIZE);
+	blkset_remove(&fs->pmem.dirty, blk);
+}
+
+static int pmem_flush(fs_ctx *fs, a1fs_blk_t blk, size_t count, int flags)
+{
+	pmem_state *pm = &fs->pmem;
+	a1fs_blk_t end = blk + count;
+	// Look at whichever is smaller, the range or the dirty set
+	if (count > pm->dirty.count) {
+		size_t n = pm->dirty.count;
+		a1fs_blk_t *blks = malloc(n * sizeof(a1fs_blk_t));
+		if (blks) {
+			blkset_to_sorted_array(&pm->dirty, blks);
+			for (size_t i = 0; i < n; i++) {
+				if (blks[i] >= blk && blks[i] < end) {
+					flush_blk(fs, blks[i]);
+				}
+			}
+			free(blks);
+			goto flushed;
+		}
+	}
+	for (a1fs_blk_t k = blk; k < end; k++) {
+		if (blkset_contains(&pm->dirty, k)) {
+			flush_blk(fs, k);
+		}
+	}
+
+flushed:
+	if (!pm->dax && msync(pmem_get(fs, blk, 0), count * A1FS_BLOCK_SIZE, flags) < 0) {
+		perror("msync");
+		return -1;
+	}
+	if (flags & MS_SYNC) {
+		drain();
+	}
+	return 0;
+}
+
+static void pmem_zero(fs_ctx *fs, a1fs_blk_t blk, size_t count)
+{
+	static const char zeros[A1FS_BLOCK_SIZE];
+	for (size_t k = 0; k < count; k++) {
+		copy_nt(pmem_get(fs, blk + k, 0), zeros, A1FS_BLOCK_SIZE);
+	}
+}
+
+static void pmem_copy(fs_ctx *fs, void *dst, const void *src, size_t len)
+{
+	(void)fs;// unused
+	copy_nt(dst, src, len);
+}
+
+static void pmem_close(fs_ctx *fs)
+{
+	pmem_flush(fs, 0, fs->size / A1FS_BLOCK_SIZE, MS_SYNC);
+	pmem_sync(fs);
+	blkset_destroy(&fs->pmem.dirty);
+	munmap(fs->image, fs->size);
+	close(fs->fd);
+	fs->image = NULL;
+	fs->fd = -1;
+}
+
+#else
+
+// Never called; open() fails on other architectures
+static int pmem_sync(fs_ctx *fs) { (void)fs; return -1; }
+static int pmem_flush(fs_ctx *fs, a1fs_blk_t blk, size_t count, int flags)
+{ (void)fs; (void)blk; (void)count; (void)flags; return -1; }
+static void pmem_zero(fs_ctx *fs, a1fs_blk_t blk, size_t count)
+{ (void)fs; (void)blk; (void)count; }
+static void pmem_copy(fs_ctx *fs, void *dst, const void *src, size_t len)
+{ (void)fs; memcpy(dst, src, len); }
+static void pmem_close(fs_ctx *fs) { (void)fs; }
+
+#endif// PMEM_X86
+
+const storage_ops pmem_storage = {
+	.name     = "pmem",
+	.stable   = true,
+	.open     = pmem_open,
+	.close    = pmem_close,
+	.get      = pmem_get,
+	.blk_of   = pmem_blk_of,
+	.dirty    = pmem_dirty,
+	.zero     = pmem_zero,
+	.flush    = pmem_flush,
+	.sync     = pmem_sync,
+	.prefetch = NULL,
+	.advise   = NULL,
+	.copy     = pmem_copy,
+	.release  = NULL,
+};
@@ -0,0 +1,50 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Persistent memory storage backend header file.
+ *
+ * Maps the whole image like the mmap backend, but makes changes durable with
+ * CPU cache line write-back instructions (clwb, or clflushopt/clflush on CPUs
+ * without it) and store fences instead of msync(). File data is copied into
+ * the image with non-temporal stores that bypass the CPU caches. Blocks are
+ * flushed in the order flush() is called for them, and each MS_SYNC flush()
+ * and sync() ends with a store fence, so the journal write ordering carries
+ * over unchanged.
+ *
+ * Cache line flushes only make changes durable on a DAX file system, where the
+ * image is mapped with MAP_SYNC. On other file systems the same flushes are
+ * executed, and msync() is used in addition for durability.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "a1fs.h"
+#include "blkset.h"
+#include "storage.h"
+
+
+/** Runtime state of the persistent memory backend. */
+typedef struct pmem_state {
+	/** Blocks changed through their pointers since they were last flushed. */
+	blkset dirty;
+	/** Whether the image is mapped with MAP_SYNC from a DAX file system. */
+	bool dax;
+} pmem_state;
+
+/** Image mapped from persistent memory. x86 only. */
+extern const storage_ops pmem_storage;
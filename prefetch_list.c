@@ -0,0 +1,235 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Recorded prefetch list implementation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "fs_ctx.h"
+#include "prefetch_list.h"
+
+
+/** Whether the superblock describes a usable prefetch list area. */
+static bool has_area(const a1fs_superblock *sb)
+{
+	return sb->prefetch_blks_count > 0 && sb->prefetch_blk > sb->inode_table_blk &&
+	       sb->prefetch_blk + sb->prefetch_blks_count <= sb->first_data_blk;
+}
+
+/** Pointer to the list header; the list area is resident and contiguous. */
+static a1fs_prefetch_header *header(fs_ctx *fs)
+{
+	return fs_ctx_blk(fs, fs->sb->prefetch_blk, 0);
+}
+
+static a1fs_extent *runs(fs_ctx *fs)
+{
+	return (void *)header(fs) + sizeof(a1fs_prefetch_header);
+}
+
+static size_t max_runs(fs_ctx *fs)
+{
+	size_t bytes = (size_t)fs->sb->prefetch_blks_count * A1FS_BLOCK_SIZE;
+	return (bytes - sizeof(a1fs_prefetch_header)) / sizeof(a1fs_extent);
+}
+
+void prefetch_list_init(fs_ctx *fs, unsigned record_secs, bool replay)
+{
+	prefetch_list *pl = &fs->plist;
+	memset(pl, 0, sizeof(*pl));
+	blkset_init(&pl->seen);
+	pthread_cond_init(&pl->cond, NULL);
+	pl->record_secs = has_area(fs->sb) ? record_secs : 0;
+	pl->replay = replay && has_area(fs->sb);
+}
+
+void prefetch_list_destroy(fs_ctx *fs)
+{
+	prefetch_list *pl = &fs->plist;
+	free(pl->blks);
+	blkset_destroy(&pl->seen);
+	pthread_cond_destroy(&pl->cond);
+}
+
+void prefetch_list_record(fs_ctx *fs, a1fs_blk_t blk)
+{
+	prefetch_list *pl = &fs->plist;
+	if (blk < fs->sb->first_data_blk || pl->count == PREFETCH_RECORD_MAX ||
+	    blkset_contains(&pl->seen, blk))
+	{
+		return;
+	}
+	if (pl->count == pl->cap) {
+		size_t cap = pl->cap ? pl->cap * 2 : 1024;
+		a1fs_blk_t *blks = realloc(pl->blks, cap * sizeof(a1fs_blk_t));
+		if (!blks) {
+			return;
+		}
+		pl->blks = blks;
+		pl->cap = cap;
+	}
+	if (blkset_add(&pl->seen, blk)) {
+		pl->blks[pl->count++] = blk;
+	}
+}
+
+/** Save the recorded blocks as runs in the image, replacing the saved list. */
+static void save(fs_ctx *fs)
+{
+	prefetch_list *pl = &fs->plist;
+	pl->recording = false;
+	// A mount that read nothing keeps the list of the last one that did
+	if (pl->count == 0) {
+		return;
+	}
+
+	// Blocks read one after another become one run
+	a1fs_extent *r = runs(fs);
+	size_t n = 0, max = max_runs(fs);
+	for (size_t i = 0; i < pl->count; i++) {
+		a1fs_blk_t db = pl->blks[i] - fs->sb->first_data_blk;
+		if (n > 0 && r[n - 1].start + r[n - 1].count == db) {
+			r[n - 1].count++;
+		} else if (n < max) {
+			r[n].start = db;
+			r[n].count = 1;
+			n++;
+		} else {
+			break;
+		}
+	}
+	a1fs_prefetch_header *h = header(fs);
+	size_t len = n * sizeof(a1fs_extent);
+	fs_ctx_dirty(fs, r, len);
+	fs_ctx_flush(fs, fs->sb->prefetch_blk, (sizeof(*h) + len - 1) / A1FS_BLOCK_SIZE + 1, MS_SYNC);
+	// The header goes last so that a torn save leaves the old count valid
+	// for runs that are still in bounds
+	h->magic = A1FS_PREFETCH_MAGIC;
+	h->count = n;
+	fs_ctx_dirty(fs, h, sizeof(*h));
+	fs_ctx_flush(fs, fs->sb->prefetch_blk, 1, MS_SYNC);
+
+	free(pl->blks);
+	pl->blks = NULL;
+	pl->count = pl->cap = 0;
+	blkset_clear(&pl->seen);
+}
+
+/** Read ahead the saved runs, letting callbacks in between batches. */
+static void replay(fs_ctx *fs)
+{
+	const a1fs_prefetch_header *h = header(fs);
+	if (h->magic != A1FS_PREFETCH_MAGIC) {
+		return;
+	}
+	size_t n = (h->count < max_runs(fs)) ? h->count : max_runs(fs);
+	// Callbacks may record a new list over this one meanwhile
+	a1fs_extent *r = malloc(n * sizeof(a1fs_extent));
+	if (!r) {
+		return;
+	}
+	memcpy(r, runs(fs), n * sizeof(a1fs_extent));
+
+	size_t batch = 0;
+	for (size_t i = 0; i < n && !fs->stopping; i++) {
+		// Skip runs made invalid by a torn save
+		if (r[i].count == 0 || r[i].start >= fs->sb->data_blocks_count ||
+		    r[i].count > fs->sb->data_blocks_count - r[i].start) {
+			continue;
+		}
+		storage_run run = {fs->sb->first_data_blk + r[i].start, r[i].count};
+		fs_ctx_readahead(fs, &run, 1);
+		batch += r[i].count;
+		if (batch >= PREFETCH_BATCH_BLKS) {
+			fs_ctx_unlock(fs);
+			iosched_bg_wait(fs, batch);
+			fs_ctx_lock(fs);
+			batch = 0;
+		}
+	}
+	free(r);
+}
+
+static void replay_task(fs_ctx *fs, void *arg)
+{
+	(void)arg;// unused
+	fs_ctx_lock(fs);
+	replay(fs);
+	fs_ctx_unlock(fs);
+}
+
+static void *prefetch_thread_main(void *arg)
+{
+	fs_ctx *fs = (fs_ctx *)arg;
+	prefetch_list *pl = &fs->plist;
+	iosched_set_class(IO_BACKGROUND);
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += pl->record_secs;
+
+	fs_ctx_lock(fs);
+	while (pl->recording && !fs->stopping) {
+		if (pthread_cond_timedwait(&pl->cond, &fs->lock, &deadline) != 0) {
+			save(fs);
+		}
+	}
+	if (pl->recording) {
+		save(fs);
+	}
+	fs_ctx_unlock(fs);
+	return NULL;
+}
+
+void prefetch_list_start(fs_ctx *fs)
+{
+	prefetch_list *pl = &fs->plist;
+	// Callbacks that need the blocks soon beat the orphan task to them
+	if (pl->replay) {
+		taskpool_submit(fs, TASK_HIGH, replay_task, NULL);
+	}
+	if (pl->record_secs == 0) {
+		return;
+	}
+	fs_ctx_lock(fs);
+	pl->recording = true;
+	fs_ctx_unlock(fs);
+	if (pthread_create(&pl->thread, NULL, prefetch_thread_main, fs) != 0) {
+		perror("pthread_create");
+		pl->recording = false;
+		return;
+	}
+	pl->thread_running = true;
+}
+
+void prefetch_list_stop(fs_ctx *fs)
+{
+	prefetch_list *pl = &fs->plist;
+	taskpool_cancel(fs, replay_task, NULL);
+	if (!pl->thread_running) {
+		return;
+	}
+	fs_ctx_lock(fs);
+	fs->stopping = true;
+	pthread_cond_signal(&pl->cond);
+	fs_ctx_unlock(fs);
+	pthread_join(pl->thread, NULL);
+	pl->thread_running = false;
+}
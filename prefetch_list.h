@@ -0,0 +1,94 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Recorded prefetch list header file.
+ *
+ * Services tend to read the same files in the same order every time they
+ * start. If asked to, a mount records the data blocks (file data, extent and
+ * directory blocks) read during its first seconds and saves them in the
+ * prefetch list area of the image, as runs in order of first access. At the
+ * next mount a background task reads the saved runs ahead of the callbacks
+ * that will need them. The inode table and bitmaps are always resident, so
+ * they are not recorded. All functions must be called with the fs lock held,
+ * except prefetch_list_start() and prefetch_list_stop().
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "a1fs.h"
+#include "blkset.h"
+
+struct fs_ctx;
+
+
+/** Maximum number of distinct blocks recorded. */
+#define PREFETCH_RECORD_MAX 65536
+/** Number of blocks read ahead at a time before letting callbacks in. */
+#define PREFETCH_BATCH_BLKS 256
+
+/** Runtime state of the prefetch list. */
+typedef struct prefetch_list {
+	/** Whether data block accesses are being recorded. */
+	bool recording;
+	/** Data block numbers in order of first access while recording. */
+	a1fs_blk_t *blks;
+	size_t count, cap;
+	/** Blocks in blks. */
+	blkset seen;
+
+	/** How long to record after mount in seconds; 0 to not record. */
+	unsigned record_secs;
+	/** Whether to read ahead the saved list at mount. */
+	bool replay;
+
+	/** Background thread that ends the recording. */
+	pthread_t thread;
+	/** Whether thread has been started. */
+	bool thread_running;
+	/** Signalled on unmount. */
+	pthread_cond_t cond;
+} prefetch_list;
+
+/**
+ * Initialize prefetch list state.
+ *
+ * @param record_secs  how long to record after mount in seconds; 0 to not
+ *                     record.
+ * @param replay       whether to read ahead the saved list at mount.
+ */
+void prefetch_list_init(struct fs_ctx *fs, unsigned record_secs, bool replay);
+
+/** Free prefetch list state. */
+void prefetch_list_destroy(struct fs_ctx *fs);
+
+/** Start recording and the background thread, and queue the replay task. */
+void prefetch_list_start(struct fs_ctx *fs);
+
+/**
+ * Stop the background thread, saving the list if still recording. Cancels the
+ * replay task if it hasn't started.
+ */
+void prefetch_list_stop(struct fs_ctx *fs);
+
+/**
+ * Record an access to a block while recording.
+ *
+ * @param blk  image block number.
+ */
+void prefetch_list_record(struct fs_ctx *fs, a1fs_blk_t blk);
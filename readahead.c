@@ -0,0 +1,66 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Sequential readahead implementation.
+ */
+
+#include <stdbool.h>
+
+#include "readahead.h"
+
+
+void readahead_init(readahead *ra, size_t max)
+{
+	ra->last = (size_t)-1;
+	ra->run = 0;
+	ra->window = 0;
+	ra->ahead = 0;
+	ra->max = max;
+}
+
+size_t readahead_next(readahead *ra, size_t first, size_t last, size_t file_blks,
+                      size_t *start)
+{
+	// A read may continue in the same block the previous one ended in
+	bool seq = (first == ra->last + 1) || (first == ra->last);
+	ra->last = last;
+	if (ra->max == 0) {
+		return 0;
+	}
+	if (!seq) {
+		ra->run = 0;
+		ra->window /= 4;
+		ra->ahead = 0;
+		return 0;
+	}
+	ra->run += last - first + 1;
+	size_t window = (2 * ra->run > READAHEAD_MIN_BLKS) ? 2 * ra->run : READAHEAD_MIN_BLKS;
+	if (window > ra->window) {
+		ra->window = (window < ra->max) ? window : ra->max;
+	}
+
+	size_t from = (ra->ahead > last + 1) ? ra->ahead : last + 1;
+	size_t to = last + 1 + ra->window;
+	if (to > file_blks) {
+		to = file_blks;
+	}
+	// Issue at least half a window at a time, except at the end of the file
+	if (to <= from || (to - from < ra->window / 2 && to < file_blks)) {
+		return 0;
+	}
+	*start = from;
+	ra->ahead = to;
+	return to - from;
+}
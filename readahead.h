@@ -0,0 +1,65 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Sequential readahead header file.
+ *
+ * Each open file keeps track of where its last read ended. Reads that
+ * continue from there form a sequential stream, and blocks ahead of the
+ * stream are read in the background. The readahead window starts small and
+ * grows to twice the length of the sequential run so far, up to a limit. It
+ * shrinks when the file is read at random. Reads at the start of a file count
+ * as sequential.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+
+/** Initial readahead window in blocks. */
+#define READAHEAD_MIN_BLKS 4
+
+/** Readahead state of an open file. */
+typedef struct readahead {
+	/** File block index of the last block read; (size_t)-1 before any read. */
+	size_t last;
+	/** Number of blocks read in the current sequential run. */
+	size_t run;
+	/** Current window in blocks; 0 if no sequential stream is detected. */
+	size_t window;
+	/** File block index after the last block read ahead. */
+	size_t ahead;
+	/** Largest window in blocks. */
+	size_t max;
+} readahead;
+
+/**
+ * Initialize readahead state for a newly opened file.
+ *
+ * @param max  largest window in blocks; 0 disables readahead.
+ */
+void readahead_init(readahead *ra, size_t max);
+
+/**
+ * Account for a read and decide what to read ahead of it.
+ *
+ * @param first      file block index of the first block read.
+ * @param last       file block index of the last block read.
+ * @param file_blks  number of blocks in the file.
+ * @param start      receives the file block index to read ahead from.
+ * @return           number of blocks to read ahead; 0 for none.
+ */
+size_t readahead_next(readahead *ra, size_t first, size_t last, size_t file_blks,
+                      size_t *start);
@@ -0,0 +1,244 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Multi-queue FUSE session loop implementation.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <linux/fuse.h>
+
+// Using 2.9.x FUSE API
+#define FUSE_USE_VERSION 29
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+#include "session.h"
+
+
+/** Worker thread and the fd it reads requests from. */
+typedef struct session_worker {
+	struct fuse_session *se;
+	/** Channel replies are sent on; wraps fd. */
+	struct fuse_chan *ch;
+	int fd;
+	size_t bufsize;
+	/** CPU the worker is pinned to; -1 if not pinned. */
+	int cpu;
+	pthread_t thread;
+} session_worker;
+
+
+// Clone fds aren't attached to the session (a 2.9 session holds one channel),
+// so they get their own channel operations instead of the kernel channel ones
+static int clone_chan_receive(struct fuse_chan **chp, char *buf, size_t size)
+{
+	ssize_t res = read(fuse_chan_fd(*chp), buf, size);
+	return (res < 0) ? -errno : (int)res;
+}
+
+static int clone_chan_send(struct fuse_chan *ch, const struct iovec iov[], size_t count)
+{
+	if (writev(fuse_chan_fd(ch), iov, count) < 0) {
+		// ENOENT only means that the request was interrupted
+		if (errno == ENOENT) {
+			return 0;
+		}
+		int err = errno;
+		perror("writev");
+		return -err;
+	}
+	return 0;
+}
+
+static void clone_chan_destroy(struct fuse_chan *ch)
+{
+	close(fuse_chan_fd(ch));
+}
+
+static struct fuse_chan_ops clone_chan_ops = {
+	.receive = clone_chan_receive,
+	.send    = clone_chan_send,
+	.destroy = clone_chan_destroy,
+};
+
+/**
+ * Read the next request into buf.
+ *
+ * @return  request size; 0 once unmounted or the session exits; -errno on error.
+ */
+static ssize_t receive(session_worker *w, char *buf)
+{
+	while (!fuse_session_exited(w->se)) {
+		ssize_t res = read(w->fd, buf, w->bufsize);
+		if (res > 0) {
+			return res;
+		}
+		// ENOENT: the request was interrupted before it was read
+		if (res == 0 || errno == EINTR || errno == EAGAIN || errno == ENOENT) {
+			continue;
+		}
+		if (errno == ENODEV) {
+			return 0;
+		}
+		int err = errno;
+		perror("read /dev/fuse");
+		return -err;
+	}
+	return 0;
+}
+
+/** Process requests until done; cancellation is only allowed while reading. */
+static void worker_loop(session_worker *w)
+{
+	char *buf = malloc(w->bufsize);
+	if (!buf) {
+		perror("malloc");
+		fuse_session_exit(w->se);
+		return;
+	}
+	pthread_cleanup_push(free, buf);
+	while (true) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		ssize_t res = receive(w, buf);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (res <= 0) {
+			break;
+		}
+		fuse_session_process(w->se, buf, res, w->ch);
+	}
+	pthread_cleanup_pop(1);
+	// Unmounted or failed; let the other workers stop too
+	fuse_session_exit(w->se);
+}
+
+static void *worker_main(void *arg)
+{
+	session_worker *w = (session_worker *)arg;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	if (w->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+	worker_loop(w);
+	return NULL;
+}
+
+/** Open a clone of the session fd for the worker. */
+static bool open_clone(session_worker *w, int session_fd)
+{
+	w->fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (w->fd < 0) {
+		perror("open /dev/fuse");
+		return false;
+	}
+	uint32_t master = session_fd;
+	if (ioctl(w->fd, FUSE_DEV_IOC_CLONE, &master) != 0) {
+		perror("FUSE_DEV_IOC_CLONE");
+		goto fail;
+	}
+	w->ch = fuse_chan_new(&clone_chan_ops, w->fd, w->bufsize, NULL);
+	if (!w->ch) {
+		goto fail;
+	}
+	return true;
+
+fail:
+	close(w->fd);
+	return false;
+}
+
+int session_loop(struct fuse *f, unsigned queues)
+{
+	struct fuse_session *se = fuse_get_session(f);
+	struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+	session_worker main_worker = {
+		.se = se, .ch = ch, .fd = fuse_chan_fd(ch), .bufsize = fuse_chan_bufsize(ch), .cpu = -1,
+	};
+
+	// The kernel sends INIT first. Handling it before the workers start keeps
+	// the background threads a1fs starts in its init callback unpinned.
+	char *buf = malloc(main_worker.bufsize);
+	if (!buf) {
+		perror("malloc");
+		return -1;
+	}
+	ssize_t res = receive(&main_worker, buf);
+	if (res > 0) {
+		fuse_session_process(se, buf, res, ch);
+	}
+	free(buf);
+	if (res <= 0) {
+		return (res < 0) ? -1 : 0;
+	}
+
+	session_worker *workers = calloc(queues > 1 ? queues - 1 : 1, sizeof(session_worker));
+	if (!workers) {
+		perror("calloc");
+		return -1;
+	}
+	// Signals must reach the main thread, which is the one that notices
+	// fuse_session_exit() called by the signal handlers
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned started = 0;
+	for (unsigned i = 1; i < queues; i++) {
+		session_worker *w = &workers[started];
+		w->se = se;
+		w->bufsize = main_worker.bufsize;
+		w->cpu = (ncpus > 0) ? (int)(i % ncpus) : -1;
+		if (!open_clone(w, main_worker.fd)) {
+			break;
+		}
+		if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+			perror("pthread_create");
+			fuse_chan_destroy(w->ch);
+			break;
+		}
+		started++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (started + 1 < queues) {
+		fprintf(stderr, "Only %u of %u queues started\n", started + 1, queues);
+	}
+
+	worker_loop(&main_worker);
+
+	for (unsigned i = 0; i < started; i++) {
+		pthread_cancel(workers[i].thread);
+		pthread_join(workers[i].thread, NULL);
+		fuse_chan_destroy(workers[i].ch);
+	}
+	free(workers);
+	fuse_session_reset(se);
+	return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Multi-queue FUSE session loop header file.
+ *
+ * Instead of one /dev/fuse fd read by every worker, each worker thread reads
+ * requests from its own clone of the fd (FUSE_DEV_IOC_CLONE) into its own
+ * buffer and replies on it, so request dispatch doesn't serialize on one fd.
+ * Workers other than the calling thread are pinned to CPUs in turn.
+ */
+
+#pragma once
+
+struct fuse;
+
+
+/**
+ * Process requests until the file system is unmounted or the session exits.
+ *
+ * @param f       FUSE instance returned by fuse_setup().
+ * @param queues  number of worker threads, each with its own fd; the calling
+ *                thread is one of them.
+ * @return        0 on success; -1 on error.
+ */
+int session_loop(struct fuse *f, unsigned queues);
@@ -0,0 +1,134 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Storage backends and the mmap backend implementation.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "fs_ctx.h"
+#include "map.h"
+#include "pmem.h"
+#include "storage.h"
+#include "window.h"
+
+
+static void mmap_advise(fs_ctx *fs, a1fs_blk_t blk, size_t count, int advice);
+
+static bool mmap_open(fs_ctx *fs, const a1fs_opts *opts)
+{
+	fs->image = map_file(opts->img_path, A1FS_BLOCK_SIZE, opts->ephemeral, &fs->size, &fs->fd);
+	if (!fs->image) {
+		return false;
+	}
+	// The mapping is aligned for huge pages; an invalid superblock is reported
+	// by fs_ctx_init()
+	const a1fs_superblock *sb = fs->image;
+	a1fs_blk_t blks = fs->size / A1FS_BLOCK_SIZE;
+	if (opts->hugepage && sb->magic == A1FS_MAGIC && sb->first_data_blk < blks) {
+		mmap_advise(fs, sb->first_data_blk, blks - sb->first_data_blk, MADV_HUGEPAGE);
+	}
+	return true;
+}
+
+static void mmap_close(fs_ctx *fs)
+{
+	munmap(fs->image, fs->size);
+	close(fs->fd);
+	fs->image = NULL;
+	fs->fd = -1;
+}
+
+static void *mmap_get(fs_ctx *fs, a1fs_blk_t blk, int flags)
+{
+	(void)flags;// unused
+	return fs->image + (size_t)blk * A1FS_BLOCK_SIZE;
+}
+
+static a1fs_blk_t mmap_blk_of(fs_ctx *fs, const void *ptr)
+{
+	return (ptr - fs->image) / A1FS_BLOCK_SIZE;
+}
+
+static void mmap_dirty(fs_ctx *fs, a1fs_blk_t blk)
+{
+	// The kernel tracks dirty pages of the mapping
+	(void)fs;// unused
+	(void)blk;// unused
+}
+
+static void mmap_zero(fs_ctx *fs, a1fs_blk_t blk, size_t count)
+{
+	memset(mmap_get(fs, blk, 0), 0, count * A1FS_BLOCK_SIZE);
+}
+
+static void mmap_advise(fs_ctx *fs, a1fs_blk_t blk, size_t count, int advice)
+{
+	if (madvise(mmap_get(fs, blk, 0), count * A1FS_BLOCK_SIZE, advice) < 0) {
+		perror("madvise");
+	}
+}
+
+static int mmap_flush(fs_ctx *fs, a1fs_blk_t blk, size_t count, int flags)
+{
+	if (msync(mmap_get(fs, blk, 0), count * A1FS_BLOCK_SIZE, flags) < 0) {
+		perror("msync");
+		return -1;
+	}
+	return 0;
+}
+
+const storage_ops mmap_storage = {
+	.name     = "mmap",
+	.stable   = true,
+	.open     = mmap_open,
+	.close    = mmap_close,
+	.get      = mmap_get,
+	.blk_of   = mmap_blk_of,
+	.dirty    = mmap_dirty,
+	.zero     = mmap_zero,
+	.flush    = mmap_flush,
+	.sync     = NULL,
+	.prefetch = NULL,
+	.advise   = mmap_advise,
+	.copy     = NULL,
+	.release  = NULL,
+};
+
+
+static const storage_ops *backends[] = {
+	&mmap_storage,
+	&cache_storage,
+	&uring_storage,
+	&window_storage,
+	&pmem_storage,
+};
+
+const storage_ops *storage_find(const char *name)
+{
+	if (!name) {
+		return backends[0];
+	}
+	for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (strcmp(backends[i]->name, name) == 0) {
+			return backends[i];
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,121 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Storage backend interface header file.
+ *
+ * All block access of the mounted file system goes through a storage backend.
+ * A backend hands out pointers to block contents that stay valid until the fs
+ * lock is released, and writes changed blocks back to the image file. The
+ * blocks from the superblock up to the first data block (bitmaps, inode table
+ * and journal) are always resident and contiguous in memory.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "a1fs.h"
+
+struct fs_ctx;
+struct a1fs_opts;
+
+
+/** Hint for storage_ops.get(): the block holds metadata (extents, dentries). */
+#define STORAGE_META 0x1
+
+/** A run of consecutive blocks. */
+typedef struct storage_run {
+	a1fs_blk_t blk;
+	size_t count;
+} storage_run;
+
+/** Storage backend operations. */
+typedef struct storage_ops {
+	/** Backend name, as given in the backend= mount option. */
+	const char *name;
+	/**
+	 * Whether block pointers stay valid for the whole mount. Data can then be
+	 * written back from the image file without going through the backend.
+	 */
+	bool stable;
+
+	/**
+	 * Open the image file. Must set fs->size and fs->fd.
+	 *
+	 * @return  true on success; false on failure.
+	 */
+	bool (*open)(struct fs_ctx *fs, const struct a1fs_opts *opts);
+	/** Write back all changed blocks and release all resources. */
+	void (*close)(struct fs_ctx *fs);
+
+	/**
+	 * Get a pointer to the contents of a block.
+	 *
+	 * @param blk    block number.
+	 * @param flags  STORAGE_* hints.
+	 * @return       pointer valid until the fs lock is released.
+	 */
+	void *(*get)(struct fs_ctx *fs, a1fs_blk_t blk, int flags);
+	/** Block number of a pointer returned by get(). */
+	a1fs_blk_t (*blk_of)(struct fs_ctx *fs, const void *ptr);
+	/** Record that a block was changed through its pointer. */
+	void (*dirty)(struct fs_ctx *fs, a1fs_blk_t blk);
+	/** Fill a range of blocks with zeros. */
+	void (*zero)(struct fs_ctx *fs, a1fs_blk_t blk, size_t count);
+	/**
+	 * Write a range of blocks back to the image file.
+	 *
+	 * @param flags  MS_SYNC to wait for the write to finish; MS_ASYNC to only
+	 *               start it.
+	 * @return       0 on success; -1 on error.
+	 */
+	int (*flush)(struct fs_ctx *fs, a1fs_blk_t blk, size_t count, int flags);
+	/**
+	 * Wait for all writes started by flush() with MS_ASYNC. NULL if each
+	 * MS_SYNC flush() has to be done separately.
+	 *
+	 * @return  0 on success; -1 on error.
+	 */
+	int (*sync)(struct fs_ctx *fs);
+	/**
+	 * Start reading runs of blocks that are about to be accessed, all in one
+	 * batch; NULL if not supported.
+	 */
+	void (*prefetch)(struct fs_ctx *fs, const storage_run *runs, size_t n);
+	/**
+	 * Apply an madvise() hint to the memory of a range of blocks; NULL if the
+	 * image isn't mapped.
+	 */
+	void (*advise)(struct fs_ctx *fs, a1fs_blk_t blk, size_t count, int advice);
+	/**
+	 * Copy file data into block memory, marking nothing dirty; NULL to use
+	 * memcpy().
+	 */
+	void (*copy)(struct fs_ctx *fs, void *dst, const void *src, size_t len);
+	/** Called before the fs lock is released; block pointers become invalid. */
+	void (*release)(struct fs_ctx *fs);
+} storage_ops;
+
+/** Whole image mapped into memory with mmap(). */
+extern const storage_ops mmap_storage;
+
+/**
+ * Find a storage backend by name.
+ *
+ * @param name  backend name; NULL for the default.
+ * @return      backend operations; NULL if there is no such backend.
+ */
+const storage_ops *storage_find(const char *name);
@@ -0,0 +1,259 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Background task pool implementation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "fs_ctx.h"
+#include "taskpool.h"
+
+
+/** Worker the calling thread runs as; NULL outside the pool. */
+static __thread task_worker *current_worker;
+
+
+static bool queue_push(task_queue *q, task t)
+{
+	if (q->count == TASKPOOL_QUEUE) {
+		return false;
+	}
+	q->tasks[(q->head + q->count) % TASKPOOL_QUEUE] = t;
+	q->count++;
+	return true;
+}
+
+/** Take the oldest task; the owner runs its tasks in order. */
+static bool queue_pop_front(task_queue *q, task *t)
+{
+	if (q->count == 0) {
+		return false;
+	}
+	*t = q->tasks[q->head];
+	q->head = (q->head + 1) % TASKPOOL_QUEUE;
+	q->count--;
+	return true;
+}
+
+/** Take the newest task; thieves take from the other end than the owner. */
+static bool queue_pop_back(task_queue *q, task *t)
+{
+	if (q->count == 0) {
+		return false;
+	}
+	q->count--;
+	*t = q->tasks[(q->head + q->count) % TASKPOOL_QUEUE];
+	return true;
+}
+
+/** Remove matching tasks, keeping the others in order. */
+static unsigned queue_remove(task_queue *q, task_fn fn, void *arg)
+{
+	unsigned kept = 0;
+	for (unsigned i = 0; i < q->count; i++) {
+		task t = q->tasks[(q->head + i) % TASKPOOL_QUEUE];
+		if (t.fn != fn || t.arg != arg) {
+			q->tasks[(q->head + kept) % TASKPOOL_QUEUE] = t;
+			kept++;
+		}
+	}
+	unsigned removed = q->count - kept;
+	q->count = kept;
+	return removed;
+}
+
+
+bool taskpool_init(fs_ctx *fs, unsigned workers)
+{
+	taskpool *tp = &fs->pool;
+	memset(tp, 0, sizeof(*tp));
+	tp->count = (workers > 0) ? workers : 1;
+	tp->workers = calloc(tp->count, sizeof(task_worker));
+	if (!tp->workers) {
+		perror("calloc");
+		return false;
+	}
+	for (unsigned i = 0; i < tp->count; i++) {
+		tp->workers[i].fs = fs;
+		pthread_mutex_init(&tp->workers[i].lock, NULL);
+	}
+	pthread_mutex_init(&tp->lock, NULL);
+	pthread_cond_init(&tp->wake, NULL);
+	return true;
+}
+
+void taskpool_destroy(fs_ctx *fs)
+{
+	taskpool *tp = &fs->pool;
+	if (!tp->workers) {
+		return;
+	}
+	for (unsigned i = 0; i < tp->count; i++) {
+		pthread_mutex_destroy(&tp->workers[i].lock);
+	}
+	free(tp->workers);
+	tp->workers = NULL;
+	pthread_cond_destroy(&tp->wake);
+	pthread_mutex_destroy(&tp->lock);
+}
+
+/** Take a task from the worker's own queues or steal one, highest priority first. */
+static bool take(taskpool *tp, task_worker *self, task *t)
+{
+	for (int prio = 0; prio < TASK_PRIOS; prio++) {
+		for (unsigned i = 0; i < tp->count; i++) {
+			task_worker *w = &tp->workers[(self - tp->workers + i) % tp->count];
+			pthread_mutex_lock(&w->lock);
+			bool found = (w == self) ? queue_pop_front(&w->queues[prio], t)
+			                         : queue_pop_back(&w->queues[prio], t);
+			pthread_mutex_unlock(&w->lock);
+			if (found) {
+				pthread_mutex_lock(&tp->lock);
+				tp->queued--;
+				pthread_mutex_unlock(&tp->lock);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static void *worker_main(void *arg)
+{
+	task_worker *self = (task_worker *)arg;
+	taskpool *tp = &self->fs->pool;
+	current_worker = self;
+	iosched_set_class(IO_BACKGROUND);
+
+	// Leave the CPU to request threads when they need it
+	if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), TASKPOOL_NICE) < 0) {
+		perror("setpriority");
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&tp->lock);
+		while (tp->queued == 0 && !tp->stopping) {
+			pthread_cond_wait(&tp->wake, &tp->lock);
+		}
+		bool stopping = tp->stopping;
+		pthread_mutex_unlock(&tp->lock);
+		if (stopping) {
+			break;
+		}
+
+		// Another worker may have taken the task meanwhile
+		task t;
+		if (take(tp, self, &t)) {
+			t.fn(self->fs, t.arg);
+		}
+	}
+	return NULL;
+}
+
+void taskpool_start(fs_ctx *fs)
+{
+	taskpool *tp = &fs->pool;
+	unsigned started = 0;
+	for (; started < tp->count; started++) {
+		task_worker *w = &tp->workers[started];
+		if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+			perror("pthread_create");
+			break;
+		}
+	}
+	tp->running = started > 0;
+	if (tp->running && started < tp->count) {
+		fprintf(stderr, "Started %u of %u task pool workers\n", started, tp->count);
+		tp->count = started;
+	}
+}
+
+void taskpool_stop(fs_ctx *fs)
+{
+	taskpool *tp = &fs->pool;
+	if (!tp->running) {
+		return;
+	}
+	fs_ctx_lock(fs);
+	fs->stopping = true;
+	fs_ctx_unlock(fs);
+
+	pthread_mutex_lock(&tp->lock);
+	tp->stopping = true;
+	pthread_cond_broadcast(&tp->wake);
+	pthread_mutex_unlock(&tp->lock);
+	for (unsigned i = 0; i < tp->count; i++) {
+		pthread_join(tp->workers[i].thread, NULL);
+	}
+	tp->running = false;
+}
+
+bool taskpool_submit(fs_ctx *fs, task_prio prio, task_fn fn, void *arg)
+{
+	taskpool *tp = &fs->pool;
+	task t = { fn, arg };
+	unsigned first = current_worker ? (unsigned)(current_worker - tp->workers)
+	                                : __atomic_fetch_add(&tp->next, 1, __ATOMIC_RELAXED) % tp->count;
+
+	// Count the task before it becomes visible so that a thief taking it
+	// right away can't take the count below zero
+	pthread_mutex_lock(&tp->lock);
+	tp->queued++;
+	pthread_mutex_unlock(&tp->lock);
+
+	for (unsigned i = 0; i < tp->count; i++) {
+		task_worker *w = &tp->workers[(first + i) % tp->count];
+		pthread_mutex_lock(&w->lock);
+		bool queued = queue_push(&w->queues[prio], t);
+		pthread_mutex_unlock(&w->lock);
+		if (queued) {
+			pthread_mutex_lock(&tp->lock);
+			pthread_cond_signal(&tp->wake);
+			pthread_mutex_unlock(&tp->lock);
+			return true;
+		}
+	}
+
+	pthread_mutex_lock(&tp->lock);
+	tp->queued--;
+	pthread_mutex_unlock(&tp->lock);
+	return false;
+}
+
+unsigned taskpool_cancel(fs_ctx *fs, task_fn fn, void *arg)
+{
+	taskpool *tp = &fs->pool;
+	unsigned removed = 0;
+	for (unsigned i = 0; i < tp->count; i++) {
+		task_worker *w = &tp->workers[i];
+		pthread_mutex_lock(&w->lock);
+		for (int prio = 0; prio < TASK_PRIOS; prio++) {
+			removed += queue_remove(&w->queues[prio], fn, arg);
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+	if (removed > 0) {
+		pthread_mutex_lock(&tp->lock);
+		tp->queued -= removed;
+		pthread_mutex_unlock(&tp->lock);
+	}
+	return removed;
+}
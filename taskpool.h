@@ -0,0 +1,132 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Background task pool header file.
+ *
+ * Work that doesn't have to be done by the FUSE request that caused it, such
+ * as freeing orphaned inodes or reading ahead the prefetch list, is submitted
+ * here as a task and run by a small pool of worker threads at a lower CPU
+ * priority than the request threads. Each worker has a bounded queue per
+ * priority class; a worker runs its own tasks first and steals from the
+ * others when it runs out, high priority tasks before low ones. Tasks that
+ * take the fs lock must drop it now and then so that requests can go on.
+ *
+ * The pool has its own locks, so tasks can be submitted and cancelled with or
+ * without the fs lock held. taskpool_start() and taskpool_stop() must be
+ * called without the fs lock held.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+
+struct fs_ctx;
+
+
+/** Capacity of each queue of a worker. */
+#define TASKPOOL_QUEUE 64
+
+/** Nice value of the worker threads relative to the request threads. */
+#define TASKPOOL_NICE 10
+
+/** Task priority classes, highest first. */
+typedef enum task_prio {
+	TASK_HIGH,
+	TASK_LOW,
+	TASK_PRIOS
+} task_prio;
+
+/** Task function. */
+typedef void (*task_fn)(struct fs_ctx *fs, void *arg);
+
+/** Queued task. */
+typedef struct task {
+	task_fn fn;
+	void *arg;
+} task;
+
+/** Bounded FIFO of tasks. */
+typedef struct task_queue {
+	task tasks[TASKPOOL_QUEUE];
+	unsigned head, count;
+} task_queue;
+
+/** Worker thread with its own queues. */
+typedef struct task_worker {
+	struct fs_ctx *fs;
+	pthread_t thread;
+	/** Protects queues. */
+	pthread_mutex_t lock;
+	task_queue queues[TASK_PRIOS];
+} task_worker;
+
+/** Runtime state of the task pool. */
+typedef struct taskpool {
+	task_worker *workers;
+	unsigned count;
+	/** Whether the worker threads have been started. */
+	bool running;
+	/** Worker to queue the next task submitted outside the pool on. */
+	unsigned next;
+
+	/** Protects queued and stopping. */
+	pthread_mutex_t lock;
+	/** Signalled when a task is queued or on stop. */
+	pthread_cond_t wake;
+	/** Number of tasks in all queues. */
+	unsigned queued;
+	/** Set to ask the workers to exit. */
+	bool stopping;
+} taskpool;
+
+/**
+ * Initialize the task pool.
+ *
+ * @param workers  number of worker threads; at least one is used.
+ * @return         true on success; false on failure.
+ */
+bool taskpool_init(struct fs_ctx *fs, unsigned workers);
+
+/** Free the task pool. */
+void taskpool_destroy(struct fs_ctx *fs);
+
+/** Start the worker threads. Tasks submitted before run once they start. */
+void taskpool_start(struct fs_ctx *fs);
+
+/**
+ * Stop the worker threads, dropping queued tasks. Sets fs->stopping so that
+ * running tasks finish early.
+ */
+void taskpool_stop(struct fs_ctx *fs);
+
+/**
+ * Submit a task. From a worker the task goes on the worker's own queue;
+ * otherwise on the queues of the workers in turn.
+ *
+ * @param prio  priority class.
+ * @param fn    function to call on a worker thread.
+ * @param arg   argument passed to fn.
+ * @return      true if queued; false if all queues of the class are full.
+ */
+bool taskpool_submit(struct fs_ctx *fs, task_prio prio, task_fn fn, void *arg);
+
+/**
+ * Remove the queued tasks with the given function and argument. A task that
+ * is already running is not affected.
+ *
+ * @return  number of tasks removed.
+ */
+unsigned taskpool_cancel(struct fs_ctx *fs, task_fn fn, void *arg);
@@ -0,0 +1,450 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - io_uring I/O engine implementation.
+ */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "fs_ctx.h"
+#include "uring.h"
+
+
+/** Runtime state of the io_uring engine. */
+typedef struct uring {
+	int ring_fd;
+	/** Number of submission queue entries. */
+	unsigned entries;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/** Whether the image file is registered as fixed file 0. */
+	bool fixed_file;
+	/**
+	 * Number of registered buffers, which are always buffers 0 to
+	 * bufs_count - 1; 0 if cache memory isn't registered.
+	 */
+	size_t bufs_count;
+	/** Size of the sparse buffer table; 0 if the kernel can't update it. */
+	size_t bufs_table;
+	/** Without a buffer table, number of buffers at which to register again. */
+	size_t bufs_next;
+	/** Whether the ring stopped working; I/O then uses pread()/pwrite(). */
+	bool broken;
+} uring;
+
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/** Fill in the iovecs of buffers from to n - 1; iovs[0] is buffer from. */
+static void fill_iovs(block_cache *c, struct iovec *iovs, size_t from, size_t n)
+{
+	if (from == 0) {
+		iovs[0].iov_base = c->meta;
+		iovs[0].iov_len = (size_t)c->meta_count * A1FS_BLOCK_SIZE;
+	}
+	for (size_t k = 0; k < c->chunks_count; k++) {
+		size_t i = c->chunks[k].buf_index;
+		if (i >= from && i < n) {
+			iovs[i - from].iov_base = c->chunks[k].data;
+			iovs[i - from].iov_len = CACHE_CHUNK_BLKS * A1FS_BLOCK_SIZE;
+		}
+	}
+}
+
+/**
+ * Register the cache chunks added since the last call as fixed buffers.
+ * Chunks are numbered in allocation order, so only the new entries of the
+ * buffer table are updated. Without a table, everything is registered again
+ * each time the number of chunks doubles.
+ */
+static void uring_bufs_changed(fs_ctx *fs)
+{
+	uring *r = fs->cache.io_data;
+	block_cache *c = &fs->cache;
+	size_t n = c->chunks_count + 1;
+
+#ifdef IORING_RSRC_REGISTER_SPARSE
+	if (r->bufs_table > 0) {
+		// Chunks past the table (the cache grew past its size) aren't registered
+		if (n > r->bufs_table) {
+			n = r->bufs_table;
+		}
+		if (n <= r->bufs_count) {
+			return;
+		}
+		struct iovec *iovs = calloc(n - r->bufs_count, sizeof(struct iovec));
+		if (!iovs) {
+			return;
+		}
+		fill_iovs(c, iovs, r->bufs_count, n);
+		struct io_uring_rsrc_update2 up;
+		memset(&up, 0, sizeof(up));
+		up.offset = r->bufs_count;
+		up.data = (uintptr_t)iovs;
+		up.nr = n - r->bufs_count;
+		// May fail e.g. if over RLIMIT_MEMLOCK; plain reads and writes still work
+		int ret = sys_register(r->ring_fd, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up));
+		if (ret > 0) {
+			r->bufs_count += ret;
+		}
+		free(iovs);
+		return;
+	}
+#endif
+
+	if (n < r->bufs_next) {
+		return;
+	}
+	r->bufs_next = 2 * n;
+	if (r->bufs_count > 0) {
+		sys_register(r->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+		r->bufs_count = 0;
+	}
+	struct iovec *iovs = calloc(n, sizeof(struct iovec));
+	if (!iovs) {
+		return;
+	}
+	fill_iovs(c, iovs, 0, n);
+	// May fail e.g. if over RLIMIT_MEMLOCK; plain reads and writes still work
+	if (sys_register(r->ring_fd, IORING_REGISTER_BUFFERS, iovs, n) == 0) {
+		r->bufs_count = n;
+	}
+	free(iovs);
+}
+
+/**
+ * Register the metadata region and a sparse table with room for the chunks of
+ * twice the cache size, so that chunks can be added one at a time later.
+ */
+static void register_bufs(fs_ctx *fs)
+{
+#ifdef IORING_RSRC_REGISTER_SPARSE
+	uring *r = fs->cache.io_data;
+	block_cache *c = &fs->cache;
+	size_t table = 2 * (c->cap / CACHE_CHUNK_BLKS) + 1;
+	if (table > URING_BUFS_MAX) {
+		table = URING_BUFS_MAX;
+	}
+	struct iovec *iovs = calloc(table, sizeof(struct iovec));
+	if (iovs) {
+		fill_iovs(c, iovs, 0, (c->chunks_count + 1 < table) ? c->chunks_count + 1 : table);
+		struct io_uring_rsrc_register reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.nr = table;
+		reg.data = (uintptr_t)iovs;
+		// Empty entries are allowed since the table could be updated (5.13)
+		if (sys_register(r->ring_fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) == 0) {
+			r->bufs_table = table;
+			r->bufs_count = (c->chunks_count + 1 < table) ? c->chunks_count + 1 : table;
+		}
+		free(iovs);
+	}
+	if (r->bufs_table > 0) {
+		return;
+	}
+#endif
+	uring_bufs_changed(fs);
+}
+
+static void uring_destroy(fs_ctx *fs)
+{
+	uring *r = fs->cache.io_data;
+	if (!r) {
+		return;
+	}
+	if (r->sqes) {
+		munmap(r->sqes, r->sqes_size);
+	}
+	if (r->cq_ring && r->cq_ring != r->sq_ring) {
+		munmap(r->cq_ring, r->cq_ring_size);
+	}
+	if (r->sq_ring) {
+		munmap(r->sq_ring, r->sq_ring_size);
+	}
+	close(r->ring_fd);
+	free(r);
+	fs->cache.io_data = NULL;
+}
+
+static void *map_ring(uring *r, size_t size, off_t offset)
+{
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                 r->ring_fd, offset);
+	if (ptr == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	return ptr;
+}
+
+static bool uring_init(fs_ctx *fs)
+{
+	uring *r = calloc(1, sizeof(uring));
+	if (!r) {
+		perror("calloc");
+		return false;
+	}
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	r->ring_fd = sys_setup(URING_DEPTH, &p);
+	if (r->ring_fd < 0) {
+		perror("io_uring_setup");
+		free(r);
+		return false;
+	}
+	fs->cache.io_data = r;
+	r->entries = p.sq_entries;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap) {
+		if (r->cq_ring_size > r->sq_ring_size) {
+			r->sq_ring_size = r->cq_ring_size;
+		}
+		r->cq_ring_size = r->sq_ring_size;
+	}
+	r->sq_ring = map_ring(r, r->sq_ring_size, IORING_OFF_SQ_RING);
+	if (!r->sq_ring) {
+		goto fail;
+	}
+	r->cq_ring = single_mmap ? r->sq_ring : map_ring(r, r->cq_ring_size, IORING_OFF_CQ_RING);
+	if (!r->cq_ring) {
+		goto fail;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = map_ring(r, r->sqes_size, IORING_OFF_SQES);
+	if (!r->sqes) {
+		goto fail;
+	}
+
+	r->sq_head = r->sq_ring + p.sq_off.head;
+	r->sq_tail = r->sq_ring + p.sq_off.tail;
+	r->sq_mask = r->sq_ring + p.sq_off.ring_mask;
+	r->sq_array = r->sq_ring + p.sq_off.array;
+	r->cq_head = r->cq_ring + p.cq_off.head;
+	r->cq_tail = r->cq_ring + p.cq_off.tail;
+	r->cq_mask = r->cq_ring + p.cq_off.ring_mask;
+	r->cqes = r->cq_ring + p.cq_off.cqes;
+
+	r->fixed_file = sys_register(r->ring_fd, IORING_REGISTER_FILES, &fs->fd, 1) == 0;
+	register_bufs(fs);
+	return true;
+
+fail:
+	uring_destroy(fs);
+	return false;
+}
+
+
+/** Queue a request; iov is used if the request can't use a fixed buffer. */
+static void prep(fs_ctx *fs, const cache_req *req, size_t i, bool write, struct iovec *iov)
+{
+	uring *r = fs->cache.io_data;
+	unsigned tail = *r->sq_tail;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+
+	if (req->buf_index >= 0 && (size_t)req->buf_index < r->bufs_count) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr = (uintptr_t)req->buf;
+		sqe->len = req->len;
+		sqe->buf_index = req->buf_index;
+	} else {
+		iov->iov_base = req->buf;
+		iov->iov_len = req->len;
+		sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (uintptr_t)iov;
+		sqe->len = 1;
+	}
+	if (r->fixed_file) {
+		sqe->fd = 0;
+		sqe->flags = IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd = fs->fd;
+	}
+	sqe->off = req->off;
+	sqe->user_data = i;
+
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/** Handle a completion; finishes short or interrupted transfers synchronously. */
+static int complete(fs_ctx *fs, const cache_req *req, int res, bool write)
+{
+	if (res == -EINTR || res == -EAGAIN) {
+		res = 0;
+	} else if (res < 0) {
+		errno = -res;
+		perror(write ? "io_uring write" : "io_uring read");
+		return -1;
+	}
+	if ((size_t)res < req->len) {
+		return cache_pio(fs->fd, req->buf + res, req->len - res, req->off + res, write);
+	}
+	return 0;
+}
+
+/** Perform requests with pread()/pwrite(), skipping those marked finished. */
+static int pio_all(fs_ctx *fs, const cache_req *reqs, size_t n, bool write, const bool *finished)
+{
+	int ret = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (!finished || !finished[i]) {
+			ret |= cache_pio(fs->fd, reqs[i].buf, reqs[i].len, reqs[i].off, write);
+		}
+	}
+	return ret;
+}
+
+/**
+ * Handle all completions in the queue.
+ *
+ * @param finished  marks the requests that completed.
+ * @param inflight  decremented for each completion.
+ * @return          0 on success; -1 if any of the requests failed.
+ */
+static int reap(fs_ctx *fs, const cache_req *reqs, bool write, bool *finished, unsigned *inflight)
+{
+	uring *r = fs->cache.io_data;
+	int ret = 0;
+	unsigned head = *r->cq_head;
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		ret |= complete(fs, &reqs[cqe->user_data], cqe->res, write);
+		finished[cqe->user_data] = true;
+		head++;
+		(*inflight)--;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return ret;
+}
+
+/**
+ * Give up on the ring after an unexpected error: take back the entries the
+ * kernel hasn't consumed, wait for the ones it has, and do the unfinished
+ * requests synchronously. Requests still in flight would race with doing them
+ * again, so if they can't be waited for, the batch fails instead.
+ *
+ * @param inflight  number of requests queued and not completed.
+ * @return          0 on success; -1 on error.
+ */
+static int fall_back(fs_ctx *fs, const cache_req *reqs, size_t n, bool write,
+                     bool *finished, unsigned inflight)
+{
+	uring *r = fs->cache.io_data;
+	fprintf(stderr, "io_uring stopped working, using pread\n");
+	r->broken = true;
+	unsigned sq_head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	inflight -= *r->sq_tail - sq_head;
+	__atomic_store_n(r->sq_tail, sq_head, __ATOMIC_RELEASE);
+
+	int ret = 0;
+	while (inflight > 0) {
+		if (sys_enter(r->ring_fd, 0, inflight, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+			perror("io_uring_enter");
+			return -1;
+		}
+		ret |= reap(fs, reqs, write, finished, &inflight);
+	}
+	return ret | pio_all(fs, reqs, n, write, finished);
+}
+
+static int uring_rw(fs_ctx *fs, const cache_req *reqs, size_t n, bool write)
+{
+	uring *r = fs->cache.io_data;
+	if (r->broken) {
+		return pio_all(fs, reqs, n, write, NULL);
+	}
+	struct iovec *iovs = malloc(n * sizeof(struct iovec));
+	bool *finished = calloc(n, sizeof(bool));
+	if (!iovs || !finished) {
+		free(iovs);
+		free(finished);
+		return pio_all(fs, reqs, n, write, NULL);
+	}
+
+	int ret = 0;
+	size_t next = 0;
+	unsigned inflight = 0, unsubmitted = 0;
+	while (next < n || inflight > 0) {
+		// Keep the queue full
+		while (next < n && inflight < r->entries) {
+			prep(fs, &reqs[next], next, write, &iovs[next]);
+			next++;
+			inflight++;
+			unsubmitted++;
+		}
+
+		int submitted = sys_enter(r->ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS);
+		if (submitted < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+				continue;
+			}
+			perror("io_uring_enter");
+			ret |= fall_back(fs, reqs, n, write, finished, inflight);
+			break;
+		}
+		unsubmitted -= submitted;
+		ret |= reap(fs, reqs, write, finished, &inflight);
+	}
+
+	free(iovs);
+	free(finished);
+	return ret;
+}
+
+const cache_io uring_io = {
+	.name         = "io_uring",
+	.init         = uring_init,
+	.destroy      = uring_destroy,
+	.bufs_changed = uring_bufs_changed,
+	.rw           = uring_rw,
+};
@@ -0,0 +1,39 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - io_uring I/O engine header file.
+ *
+ * Block cache I/O engine that submits each batch of reads or writes as one
+ * batch of io_uring submission queue entries, keeping up to URING_DEPTH of
+ * them in flight. The image file is registered as a fixed file and the cache
+ * memory as fixed buffers where the kernel allows it. Uses the raw system
+ * calls, so no library is needed; the engine can't be used if the kernel
+ * doesn't support io_uring, and falls back to pread()/pwrite() if the ring
+ * fails later.
+ */
+
+#pragma once
+
+#include "cache.h"
+
+
+/** Number of submission queue entries. */
+#define URING_DEPTH 64
+
+/** Largest registered buffer table the kernel accepts. */
+#define URING_BUFS_MAX 16384
+
+/** io_uring engine for the block cache. */
+extern const cache_io uring_io;
@@ -0,0 +1,350 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Windowed mapping storage backend implementation.
+ */
+
+// for sync_file_range()
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fs_ctx.h"
+#include "map.h"
+#include "window.h"
+
+
+static off_t blk_off(a1fs_blk_t blk)
+{
+	return (off_t)blk * A1FS_BLOCK_SIZE;
+}
+
+/** Unmap a live window; moves the last live window into its place. */
+static void unmap_window(window_map *m, int i)
+{
+	window *w = &m->live[i];
+	munmap(w->data, w->len);
+	m->slot_of[w->index] = -1;
+
+	int last = m->live_count - 1;
+	if (i != last) {
+		m->live[i] = m->live[last];
+		m->slot_of[m->live[i].index] = i;
+	}
+	m->live_count--;
+	m->last = -1;
+}
+
+/** Least recently used unpinned window; -1 if all are pinned. */
+static int victim(window_map *m)
+{
+	int best = -1;
+	for (size_t i = 0; i < m->live_count; i++) {
+		window *w = &m->live[i];
+		if (w->pin != m->epoch && (best < 0 || w->last_use < m->live[best].last_use)) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+/** Map window number index, making room for it if needed. */
+static int map_window(fs_ctx *fs, size_t index)
+{
+	window_map *m = &fs->windows;
+	if (m->live_count >= m->max_live) {
+		int i = victim(m);
+		if (i >= 0) {
+			unmap_window(m, i);
+		}
+	}
+	if (m->live_count == m->live_cap) {
+		size_t cap = m->live_cap * 2;
+		window *live = realloc(m->live, cap * sizeof(window));
+		if (!live) {
+			perror("realloc");
+			abort();
+		}
+		m->live = live;
+		m->live_cap = cap;
+	}
+
+	size_t bytes = m->window_blks * A1FS_BLOCK_SIZE;
+	off_t off = (off_t)index * bytes;
+	size_t len = (fs->size - off < bytes) ? fs->size - off : bytes;
+	void *data = map_range(fs->fd, off, len, MAP_SHARED);
+	if (!data) {
+		// Block pointers can't fail; the image is unusable at this point
+		abort();
+	}
+	if (m->hugepage && madvise(data, len, MADV_HUGEPAGE) < 0) {
+		perror("madvise");
+	}
+
+	int i = m->live_count++;
+	m->live[i] = (window){ .index = index, .data = data, .len = len };
+	m->slot_of[index] = i;
+	return i;
+}
+
+
+/* Backend operations */
+static bool window_open(fs_ctx *fs, const a1fs_opts *opts)
+{
+	window_map *m = &fs->windows;
+	memset(m, 0, sizeof(*m));
+
+	fs->fd = open(opts->img_path, O_RDWR);
+	if (fs->fd < 0) {
+		perror(opts->img_path);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fs->fd, &st) < 0) {
+		perror("fstat");
+		goto fail;
+	}
+	if (st.st_size == 0 || st.st_size % A1FS_BLOCK_SIZE != 0) {
+		fprintf(stderr, "Image file size is not a multiple of block size\n");
+		goto fail;
+	}
+	fs->size = st.st_size;
+
+	// Find out how large the metadata region is; an invalid superblock is
+	// reported by fs_ctx_init()
+	a1fs_superblock sb;
+	if (pread(fs->fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+		perror("pread");
+		goto fail;
+	}
+	m->meta_count = 1;
+	if (sb.magic == A1FS_MAGIC && sb.first_data_blk > 0 &&
+	    sb.first_data_blk <= fs->size / A1FS_BLOCK_SIZE) {
+		m->meta_count = sb.first_data_blk;
+	}
+	m->meta = map_range(fs->fd, 0, (size_t)m->meta_count * A1FS_BLOCK_SIZE, MAP_SHARED);
+	if (!m->meta) {
+		goto fail;
+	}
+
+	m->window_blks = (size_t)opts->window_size * (1024 * 1024 / A1FS_BLOCK_SIZE);
+	if (m->window_blks == 0) {
+		m->window_blks = 1;
+	}
+	size_t blks = fs->size / A1FS_BLOCK_SIZE;
+	m->windows_count = (blks + m->window_blks - 1) / m->window_blks;
+	m->max_live = opts->windows ? opts->windows : 1;
+	m->live_cap = m->max_live;
+	m->slot_of = malloc(m->windows_count * sizeof(int));
+	m->live = malloc(m->live_cap * sizeof(window));
+	if (!m->slot_of || !m->live) {
+		perror("malloc");
+		goto fail;
+	}
+	memset(m->slot_of, -1, m->windows_count * sizeof(int));
+	m->last = -1;
+	m->hugepage = opts->hugepage;
+	return true;
+
+fail:
+	if (m->meta) {
+		munmap(m->meta, (size_t)m->meta_count * A1FS_BLOCK_SIZE);
+	}
+	free(m->slot_of);
+	free(m->live);
+	close(fs->fd);
+	fs->fd = -1;
+	return false;
+}
+
+static void window_close(fs_ctx *fs)
+{
+	window_map *m = &fs->windows;
+	while (m->live_count > 0) {
+		unmap_window(m, 0);
+	}
+	munmap(m->meta, (size_t)m->meta_count * A1FS_BLOCK_SIZE);
+	free(m->slot_of);
+	free(m->live);
+	// Unmapped pages stay dirty in the page cache
+	if (fdatasync(fs->fd) < 0) {
+		perror("fdatasync");
+	}
+	close(fs->fd);
+	fs->fd = -1;
+}
+
+static void *window_get(fs_ctx *fs, a1fs_blk_t blk, int flags)
+{
+	(void)flags;// unused
+	window_map *m = &fs->windows;
+	if (blk < m->meta_count) {
+		return m->meta + (size_t)blk * A1FS_BLOCK_SIZE;
+	}
+
+	size_t index = blk / m->window_blks;
+	int i = m->slot_of[index];
+	if (i < 0) {
+		i = map_window(fs, index);
+	}
+	window *w = &m->live[i];
+	w->pin = m->epoch;
+	w->last_use = ++m->clock;
+	m->last = i;
+	return w->data + (size_t)(blk - index * m->window_blks) * A1FS_BLOCK_SIZE;
+}
+
+static a1fs_blk_t window_blk_of(fs_ctx *fs, const void *ptr)
+{
+	window_map *m = &fs->windows;
+	size_t meta_len = (size_t)m->meta_count * A1FS_BLOCK_SIZE;
+	if (ptr >= m->meta && ptr < m->meta + meta_len) {
+		return (ptr - m->meta) / A1FS_BLOCK_SIZE;
+	}
+
+	// Usually the pointer comes from the window used last
+	if (m->last >= 0) {
+		window *w = &m->live[m->last];
+		if (ptr >= w->data && ptr < w->data + w->len) {
+			return w->index * m->window_blks + (ptr - w->data) / A1FS_BLOCK_SIZE;
+		}
+	}
+	for (size_t i = 0; i < m->live_count; i++) {
+		window *w = &m->live[i];
+		if (ptr >= w->data && ptr < w->data + w->len) {
+			return w->index * m->window_blks + (ptr - w->data) / A1FS_BLOCK_SIZE;
+		}
+	}
+	fprintf(stderr, "Pointer %p is not in a mapped window\n", ptr);
+	abort();
+}
+
+static void window_dirty(fs_ctx *fs, a1fs_blk_t blk)
+{
+	// The kernel tracks dirty pages of the mappings, including unmapped ones
+	(void)fs;// unused
+	(void)blk;// unused
+}
+
+/** Call f on each run of blocks in the range that lies within one window. */
+static void for_each_run(fs_ctx *fs, a1fs_blk_t blk, size_t count,
+                         void (*f)(void *ptr, size_t len, int arg), int arg)
+{
+	window_map *m = &fs->windows;
+	while (count > 0) {
+		size_t n = m->window_blks - blk % m->window_blks;
+		if (blk < m->meta_count) {
+			n = m->meta_count - blk;
+		}
+		if (n > count) {
+			n = count;
+		}
+		f(window_get(fs, blk, 0), n * A1FS_BLOCK_SIZE, arg);
+		blk += n;
+		count -= n;
+	}
+}
+
+static void zero_run(void *ptr, size_t len, int arg)
+{
+	(void)arg;// unused
+	memset(ptr, 0, len);
+}
+
+static void window_zero(fs_ctx *fs, a1fs_blk_t blk, size_t count)
+{
+	for_each_run(fs, blk, count, zero_run, 0);
+}
+
+static void advise_run(void *ptr, size_t len, int advice)
+{
+	if (madvise(ptr, len, advice) < 0) {
+		perror("madvise");
+	}
+}
+
+static void window_advise(fs_ctx *fs, a1fs_blk_t blk, size_t count, int advice)
+{
+	for_each_run(fs, blk, count, advise_run, advice);
+}
+
+static void window_prefetch(fs_ctx *fs, const storage_run *runs, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		window_advise(fs, runs[i].blk, runs[i].count, MADV_WILLNEED);
+	}
+}
+
+static int window_sync(fs_ctx *fs)
+{
+	if (fdatasync(fs->fd) < 0) {
+		perror("fdatasync");
+		return -1;
+	}
+	return 0;
+}
+
+static int window_flush(fs_ctx *fs, a1fs_blk_t blk, size_t count, int flags)
+{
+	// Pages of windows that are no longer mapped are still dirty in the page
+	// cache, so write back the file range rather than the mappings
+	if (flags & MS_SYNC) {
+		return window_sync(fs);
+	}
+#ifdef SYNC_FILE_RANGE_WRITE
+	if (sync_file_range(fs->fd, blk_off(blk), blk_off(count), SYNC_FILE_RANGE_WRITE) < 0) {
+		perror("sync_file_range");
+		return -1;
+	}
+#else
+	(void)blk;// unused
+	(void)count;// unused
+#endif
+	return 0;
+}
+
+static void window_release(fs_ctx *fs)
+{
+	window_map *m = &fs->windows;
+	m->epoch++;
+	// Unmap windows mapped past the limit while all were pinned
+	while (m->live_count > m->max_live) {
+		unmap_window(m, victim(m));
+	}
+}
+
+const storage_ops window_storage = {
+	.name     = "window",
+	.stable   = false,
+	.open     = window_open,
+	.close    = window_close,
+	.get      = window_get,
+	.blk_of   = window_blk_of,
+	.dirty    = window_dirty,
+	.zero     = window_zero,
+	.flush    = window_flush,
+	.sync     = window_sync,
+	.prefetch = window_prefetch,
+	.advise   = window_advise,
+	.copy     = NULL,
+	.release  = window_release,
+};
@@ -0,0 +1,81 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Windowed mapping storage backend header file.
+ *
+ * Maps the image in fixed-size windows on demand instead of all at once, so
+ * that the address space and page tables used track the working set rather
+ * than the image size. The metadata region is mapped for the whole mount. At
+ * most a configurable number of data windows are mapped at a time; the least
+ * recently used one is unmapped to make room for a new one. Windows are
+ * placed at addresses that allow huge pages (see map_range()).
+ *
+ * Windows used by the current fs lock holder are pinned; if all windows are
+ * pinned, more are mapped until the lock is released.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "a1fs.h"
+#include "storage.h"
+
+
+/** A mapped part of the image. */
+typedef struct window {
+	/** Window number; the window maps blocks from index * window_blks on. */
+	size_t index;
+	void *data;
+	/** Mapping size in bytes; the last window may be short. */
+	size_t len;
+	/** Pinned if equal to the map epoch. */
+	unsigned pin;
+	/** Value of the map clock at the last access. */
+	unsigned long last_use;
+} window;
+
+/** Runtime state of the windowed mapping. */
+typedef struct window_map {
+	/** Mapping of the blocks from the superblock up to the first data block. */
+	void *meta;
+	a1fs_blk_t meta_count;
+
+	/** Window size in blocks. */
+	size_t window_blks;
+	/** Number of windows the image is divided into. */
+	size_t windows_count;
+	/** Index into live of each window; -1 if not mapped. */
+	int *slot_of;
+
+	/** Mapped windows, in no particular order. */
+	window *live;
+	size_t live_count, live_cap;
+	/** Number of windows kept mapped when none are pinned. */
+	size_t max_live;
+	/** Most recently used entry of live; -1 if none. */
+	int last;
+	/** Whether new windows are advised to use huge pages. */
+	bool hugepage;
+
+	/** Incremented on every window access. */
+	unsigned long clock;
+	/** Incremented each time the fs lock is released. */
+	unsigned epoch;
+} window_map;
+
+/** Image mapped in windows with mmap(). */
+extern const storage_ops window_storage;
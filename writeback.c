@@ -0,0 +1,221 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Background writeback implementation.
+ */
+
+// for sync_file_range()
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "fs_ctx.h"
+#include "writeback.h"
+
+
+void writeback_init(fs_ctx *fs, unsigned budget_mb)
+{
+	writeback *wb = &fs->wb;
+	wb->budget = (size_t)budget_mb * (1024 * 1024 / A1FS_BLOCK_SIZE);
+	blkset_init(&wb->dirty);
+	wb->inflight = 0;
+	wb->thread_running = false;
+	pthread_cond_init(&wb->cond, NULL);
+	pthread_cond_init(&wb->done, NULL);
+}
+
+void writeback_destroy(fs_ctx *fs)
+{
+	writeback *wb = &fs->wb;
+	blkset_destroy(&wb->dirty);
+	pthread_cond_destroy(&wb->cond);
+	pthread_cond_destroy(&wb->done);
+}
+
+void writeback_dirty(fs_ctx *fs, a1fs_blk_t blk, size_t count)
+{
+	writeback *wb = &fs->wb;
+	if (wb->budget == 0) {
+		return;
+	}
+	for (a1fs_blk_t b = blk; b < blk + count; b++) {
+		blkset_add(&wb->dirty, b);
+	}
+	// Start writing back at half the budget so that writers rarely hit it
+	if (wb->dirty.count >= wb->budget / 2) {
+		pthread_cond_signal(&wb->cond);
+	}
+}
+
+void writeback_throttle(fs_ctx *fs)
+{
+	writeback *wb = &fs->wb;
+	while (wb->thread_running && !fs->stopping &&
+	       wb->dirty.count + wb->inflight > wb->budget)
+	{
+		pthread_cond_signal(&wb->cond);
+		fs_ctx_wait(fs, &wb->done);
+	}
+}
+
+
+/**
+ * Write back a range of blocks.
+ *
+ * @param wait  false to only start writeback; true to wait for it to finish.
+ */
+static void write_range(fs_ctx *fs, a1fs_blk_t blk, size_t count, bool wait)
+{
+	if (!wait && !fs->storage->stable) {
+		// The backend has to hand its cached blocks to the kernel first
+		fs_ctx_flush(fs, blk, count, MS_ASYNC);
+		return;
+	}
+
+#ifdef SYNC_FILE_RANGE_WRITE
+	off_t off = (off_t)blk * A1FS_BLOCK_SIZE;
+	off_t len = (off_t)count * A1FS_BLOCK_SIZE;
+	unsigned flags = wait
+		? SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER
+		: SYNC_FILE_RANGE_WRITE;
+	if (sync_file_range(fs->fd, off, len, flags) < 0) {
+		perror("sync_file_range");
+	}
+#else
+	// msync() can't wait for writeback without forcing it synchronously
+	if (!wait) {
+		fs_ctx_flush(fs, blk, count, MS_ASYNC);
+	}
+#endif
+}
+
+/**
+ * Write back all runs of adjacent blocks.
+ *
+ * @param blks  sorted block numbers; NULL for the whole image.
+ * @param wait  false to only start writeback; true to wait for it to finish.
+ */
+static void write_blks(fs_ctx *fs, const a1fs_blk_t *blks, size_t n, bool wait)
+{
+	if (!blks) {
+		write_range(fs, 0, fs->size / A1FS_BLOCK_SIZE, wait);
+		return;
+	}
+	for (size_t i = 0; i < n;) {
+		size_t run = 1;
+		while (i + run < n && blks[i + run] == blks[i] + run) {
+			run++;
+		}
+		write_range(fs, blks[i], run, wait);
+		i += run;
+	}
+}
+
+/** Flusher thread: writes back dirty data in batches until unmount. */
+static void *writeback_thread_main(void *arg)
+{
+	fs_ctx *fs = (fs_ctx *)arg;
+	writeback *wb = &fs->wb;
+	iosched_set_class(IO_BACKGROUND);
+
+	fs_ctx_lock(fs);
+	while (!fs->stopping) {
+		if (wb->dirty.count < wb->budget / 2) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += WRITEBACK_INTERVAL_MS / 1000;
+			deadline.tv_nsec += (WRITEBACK_INTERVAL_MS % 1000) * 1000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&wb->cond, &fs->lock, &deadline);
+			if (fs->stopping || wb->dirty.count == 0) {
+				continue;
+			}
+			// Age-based writeback can wait; writers over budget can't
+			if (wb->dirty.count < wb->budget / 2) {
+				size_t n = wb->dirty.count;
+				fs_ctx_unlock(fs);
+				iosched_bg_wait(fs, n);
+				fs_ctx_lock(fs);
+				if (fs->stopping || wb->dirty.count == 0) {
+					continue;
+				}
+			}
+		}
+
+		size_t n = wb->dirty.count;
+		// If out of memory, can't sort; write back the whole image instead
+		a1fs_blk_t *blks = malloc(n * sizeof(a1fs_blk_t));
+		if (blks) {
+			blkset_to_sorted_array(&wb->dirty, blks);
+		}
+		blkset_clear(&wb->dirty);
+		wb->inflight = n;
+
+		// Writeback may block on I/O; let callbacks run meanwhile. Blocks
+		// cached by the backend can only be accessed under the lock.
+		bool stable = fs->storage->stable;
+		if (!stable) {
+			write_blks(fs, blks, n, false);
+		}
+		fs_ctx_unlock(fs);
+		if (stable) {
+			write_blks(fs, blks, n, false);
+		}
+		write_blks(fs, blks, n, true);
+		free(blks);
+		fs_ctx_lock(fs);
+
+		wb->inflight = 0;
+		pthread_cond_broadcast(&wb->done);
+	}
+	fs_ctx_unlock(fs);
+	return NULL;
+}
+
+void writeback_start(fs_ctx *fs)
+{
+	writeback *wb = &fs->wb;
+	if (wb->budget == 0) {
+		return;
+	}
+	if (pthread_create(&wb->thread, NULL, writeback_thread_main, fs) != 0) {
+		perror("pthread_create");
+		return;
+	}
+	wb->thread_running = true;
+}
+
+void writeback_stop(fs_ctx *fs)
+{
+	writeback *wb = &fs->wb;
+	if (!wb->thread_running) {
+		return;
+	}
+	fs_ctx_lock(fs);
+	fs->stopping = true;
+	pthread_cond_signal(&wb->cond);
+	pthread_cond_broadcast(&wb->done);
+	fs_ctx_unlock(fs);
+	pthread_join(wb->thread, NULL);
+	wb->thread_running = false;
+	blkset_clear(&wb->dirty);
+}
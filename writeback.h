@@ -0,0 +1,89 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019, 2021 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Background writeback header file.
+ *
+ * File data written to the image is collected into a dirty set.
+ * A flusher thread starts writeback of the dirty pages in the background once
+ * enough of them accumulate or they get old, so that the kernel never has to
+ * stall all writers at once. Writers that get more than the dirty budget ahead
+ * of the flusher are throttled until it catches up. All functions must be
+ * called with the fs lock held, except writeback_start() and writeback_stop().
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "a1fs.h"
+#include "blkset.h"
+
+struct fs_ctx;
+
+
+/** Maximum time a dirty page waits for writeback, in milliseconds. */
+#define WRITEBACK_INTERVAL_MS 500
+
+/** Runtime state of the writeback flusher. */
+typedef struct writeback {
+	/** Maximum number of dirty and in-flight blocks; 0 if disabled. */
+	size_t budget;
+	/** Data blocks written since they were last handed to the flusher. */
+	blkset dirty;
+	/** Number of blocks the flusher is currently writing back. */
+	size_t inflight;
+
+	/** Flusher thread. */
+	pthread_t thread;
+	/** Whether the flusher thread has been started. */
+	bool thread_running;
+	/** Signalled to wake up the flusher thread. */
+	pthread_cond_t cond;
+	/** Signalled when the flusher finishes a batch. */
+	pthread_cond_t done;
+} writeback;
+
+/**
+ * Initialize writeback state.
+ *
+ * @param budget_mb  dirty budget in MiB; 0 disables background writeback.
+ */
+void writeback_init(struct fs_ctx *fs, unsigned budget_mb);
+
+/** Free writeback state. */
+void writeback_destroy(struct fs_ctx *fs);
+
+/** Start the flusher thread. */
+void writeback_start(struct fs_ctx *fs);
+
+/** Stop the flusher thread. Pages still dirty are left to the caller. */
+void writeback_stop(struct fs_ctx *fs);
+
+/**
+ * Record a file data change and wake up the flusher if enough data is dirty.
+ *
+ * @param blk    first changed block number.
+ * @param count  number of changed blocks.
+ */
+void writeback_dirty(struct fs_ctx *fs, a1fs_blk_t blk, size_t count);
+
+/**
+ * Wait until the amount of dirty data is back under the budget.
+ *
+ * Temporarily releases the fs lock while waiting.
+ */
+void writeback_throttle(struct fs_ctx *fs);